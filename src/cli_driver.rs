@@ -4,6 +4,7 @@
 
 extern crate aho_corasick;
 extern crate clap;
+extern crate libc;
 #[macro_use] extern crate tectonic;
 extern crate termcolor;
 
@@ -12,17 +13,20 @@ use clap::{Arg, ArgMatches, App};
 use std::collections::{HashMap, HashSet};
 use std::ffi::{OsStr, OsString};
 use std::fs::File;
-use std::io::Write;
-use std::os::unix::ffi::OsStrExt;
+use std::io::{BufRead, BufReader, Cursor, Read, Write};
+use std::os::unix::ffi::{OsStrExt, OsStringExt};
+use std::os::unix::net::{UnixListener, UnixStream};
 use std::path::{Path, PathBuf};
 use std::process;
+use std::rc::Rc;
+use std::time::Instant;
 
 use tectonic::config::PersistentConfig;
 use tectonic::digest::DigestData;
-use tectonic::engines::IoEventBackend;
+use tectonic::engines::{IoEventBackend, NoopIoEventBackend};
 use tectonic::errors::{ErrorKind, Result, ResultExt};
 use tectonic::io::{FilesystemIo, FilesystemPrimaryInputIo, GenuineStdoutIo, InputOrigin,
-                   IoProvider, IoStack, MemoryIo, OpenResult};
+                   IoCounters, IoProvider, IoStack, MemoryIo, OpenResult};
 use tectonic::io::itarbundle::{HttpITarIoFactory, ITarBundle};
 use tectonic::io::stdstreams::BufferedPrimaryIo;
 use tectonic::io::zipbundle::ZipBundle;
@@ -51,44 +55,79 @@ struct CliIoSetup {
     filesystem: FilesystemIo,
     genuine_stdout: Option<GenuineStdoutIo>,
     format_primary: Option<BufferedPrimaryIo>,
+    counters: CliIoCounters,
+}
+
+/// Traffic counters for each of the layers of a CliIoSetup. They outlive the
+/// IoStacks that fill them, so they add up over the whole session.
+#[derive(Default)]
+struct CliIoCounters {
+    stdout: Rc<IoCounters>,
+    primary: Rc<IoCounters>,
+    mem: Rc<IoCounters>,
+    filesystem: Rc<IoCounters>,
+    bundle: Rc<IoCounters>,
+}
+
+impl CliIoCounters {
+    fn layers(&self) -> Vec<(&'static str, &IoCounters)> {
+        vec![
+            ("stdout", &*self.stdout),
+            ("primary", &*self.primary),
+            ("mem", &*self.mem),
+            ("filesystem", &*self.filesystem),
+            ("bundle", &*self.bundle),
+        ]
+    }
 }
 
 impl CliIoSetup {
     fn as_stack<'a> (&'a mut self) -> IoStack<'a> {
         let mut providers: Vec<&mut IoProvider> = Vec::new();
+        let mut counters = Vec::new();
 
         if let Some(ref mut p) = self.genuine_stdout {
             providers.push(p);
+            counters.push(Some(self.counters.stdout.clone()));
         }
 
         providers.push(&mut *self.primary_input);
+        counters.push(Some(self.counters.primary.clone()));
         providers.push(&mut self.mem);
+        counters.push(Some(self.counters.mem.clone()));
         providers.push(&mut self.filesystem);
+        counters.push(Some(self.counters.filesystem.clone()));
 
         if let Some(ref mut b) = self.bundle {
             providers.push(&mut **b);
+            counters.push(Some(self.counters.bundle.clone()));
         }
 
-        IoStack::new(providers)
+        IoStack::new_with_counters(providers, counters)
     }
 
     fn as_stack_for_format<'a> (&'a mut self, kickstart: &str) -> IoStack<'a> {
         let mut providers: Vec<&mut IoProvider> = Vec::new();
+        let mut counters = Vec::new();
 
         if let Some(ref mut p) = self.genuine_stdout {
             providers.push(p);
+            counters.push(Some(self.counters.stdout.clone()));
         }
 
 
         self.format_primary = Some(BufferedPrimaryIo::from_text(kickstart));
         providers.push(self.format_primary.as_mut().unwrap());
+        counters.push(Some(self.counters.primary.clone()));
         providers.push(&mut self.mem);
+        counters.push(Some(self.counters.mem.clone()));
 
         if let Some(ref mut b) = self.bundle {
             providers.push(&mut **b);
+            counters.push(Some(self.counters.bundle.clone()));
         }
 
-        IoStack::new(providers)
+        IoStack::new_with_counters(providers, counters)
     }
 }
 
@@ -181,6 +220,7 @@ impl CliIoBuilder {
                 None
             },
             format_primary: None,
+            counters: CliIoCounters::default(),
         })
     }
 }
@@ -240,15 +280,29 @@ impl FileSummary {
 /// The CliIoEvents type implements the IoEventBackend. The CLI uses it to
 /// figure out when to rerun the TeX engine; to figure out which files should
 /// be written to disk; and to emit Makefile rules.
-struct CliIoEvents(HashMap<OsString, FileSummary>);
+struct CliIoEvents {
+    files: HashMap<OsString, FileSummary>,
+
+    /// The metrics that the engine reports at the end of its current pass.
+    metrics: Vec<(String, u64)>,
+
+    /// Records the engines' spans, if we're writing a trace.
+    tracer: Option<Tracer>,
+}
 
 impl CliIoEvents {
-    fn new() -> CliIoEvents { CliIoEvents(HashMap::new()) }
+    fn new(trace: bool) -> CliIoEvents {
+        CliIoEvents {
+            files: HashMap::new(),
+            metrics: Vec::new(),
+            tracer: if trace { Some(Tracer::new()) } else { None },
+        }
+    }
 }
 
 impl IoEventBackend for CliIoEvents {
     fn output_opened(&mut self, name: &OsStr) {
-        if let Some(summ) = self.0.get_mut(name) {
+        if let Some(summ) = self.files.get_mut(name) {
             summ.access_pattern = match summ.access_pattern {
                 AccessPattern::Read => AccessPattern::ReadThenWritten,
                 c => c, // identity mapping makes sense for remaining options
@@ -256,14 +310,14 @@ impl IoEventBackend for CliIoEvents {
             return;
         }
 
-        self.0.insert(name.to_os_string(), FileSummary::new(AccessPattern::Written, InputOrigin::NotInput));
+        self.files.insert(name.to_os_string(), FileSummary::new(AccessPattern::Written, InputOrigin::NotInput));
     }
 
     fn stdout_opened(&mut self) {
         // Life is easier if we track stdout in the same way that we do other
         // output files.
 
-        if let Some(summ) = self.0.get_mut(OsStr::new("")) {
+        if let Some(summ) = self.files.get_mut(OsStr::new("")) {
             summ.access_pattern = match summ.access_pattern {
                 AccessPattern::Read => AccessPattern::ReadThenWritten,
                 c => c, // identity mapping makes sense for remaining options
@@ -271,11 +325,11 @@ impl IoEventBackend for CliIoEvents {
             return;
         }
 
-        self.0.insert(OsString::from(""), FileSummary::new(AccessPattern::Written, InputOrigin::NotInput));
+        self.files.insert(OsString::from(""), FileSummary::new(AccessPattern::Written, InputOrigin::NotInput));
     }
 
     fn output_closed(&mut self, name: OsString, digest: DigestData) {
-        let summ = self.0.get_mut(&name).expect("closing file that wasn't opened?");
+        let summ = self.files.get_mut(&name).expect("closing file that wasn't opened?");
         summ.write_digest = Some(digest);
     }
 
@@ -285,7 +339,7 @@ impl IoEventBackend for CliIoEvents {
         // don't see how such a file could have previously been written, but
         // let's use the full update logic just in case.
 
-        if let Some(summ) = self.0.get_mut(name) {
+        if let Some(summ) = self.files.get_mut(name) {
             summ.access_pattern = match summ.access_pattern {
                 AccessPattern::Written => AccessPattern::WrittenThenRead,
                 c => c, // identity mapping makes sense for remaining options
@@ -299,11 +353,11 @@ impl IoEventBackend for CliIoEvents {
         // is the contents of the file the very first time it was read.
         let mut fs = FileSummary::new(AccessPattern::Read, InputOrigin::NotInput);
         fs.read_digest = Some(DigestData::of_nothing());
-        self.0.insert(name.to_os_string(), fs);
+        self.files.insert(name.to_os_string(), fs);
     }
 
     fn input_opened(&mut self, name: &OsStr, origin: InputOrigin) {
-        if let Some(summ) = self.0.get_mut(name) {
+        if let Some(summ) = self.files.get_mut(name) {
             summ.access_pattern = match summ.access_pattern {
                 AccessPattern::Written => AccessPattern::WrittenThenRead,
                 c => c, // identity mapping makes sense for remaining options
@@ -311,13 +365,13 @@ impl IoEventBackend for CliIoEvents {
             return;
         }
 
-        self.0.insert(name.to_os_string(), FileSummary::new(AccessPattern::Read, origin));
+        self.files.insert(name.to_os_string(), FileSummary::new(AccessPattern::Read, origin));
     }
 
     //fn primary_input_opened(&mut self, _origin: InputOrigin) {}
 
     fn input_closed(&mut self, name: OsString, digest: Option<DigestData>) {
-        let summ = self.0.get_mut(&name).expect("closing file that wasn't opened?");
+        let summ = self.files.get_mut(&name).expect("closing file that wasn't opened?");
 
         // It's what was in the file the *first* time that it was read that
         // matters, so don't replace the read digest if it's already got one.
@@ -326,6 +380,184 @@ impl IoEventBackend for CliIoEvents {
             summ.read_digest = digest;
         }
     }
+
+    fn engine_metric(&mut self, name: &str, value: u64) {
+        self.metrics.push((name.to_owned(), value));
+    }
+
+    fn input_span_begin(&mut self, id: usize, name: &OsStr, origin: InputOrigin) {
+        if let Some(ref mut t) = self.tracer {
+            t.input_begin(id, &name.to_string_lossy(), origin);
+        }
+    }
+
+    fn input_span_end(&mut self, id: usize) {
+        if let Some(ref mut t) = self.tracer {
+            t.input_end(id);
+        }
+    }
+
+    fn span_begin(&mut self, name: &str, detail: &str) {
+        if let Some(ref mut t) = self.tracer {
+            t.begin(name, detail);
+        }
+    }
+
+    fn span_end(&mut self) {
+        if let Some(ref mut t) = self.tracer {
+            t.end();
+        }
+    }
+}
+
+
+/// The Tracer records what the engines are up to, as events in the Chrome
+/// trace-event format, for `--trace`. Engine passes and the engines' own
+/// spans are nested duration events; inputs, which needn't be closed in the
+/// order they were opened, are async events keyed by their handle.
+struct Tracer {
+    epoch: Instant,
+    events: Vec<String>,
+    open_spans: Vec<String>,
+    open_inputs: HashMap<usize, String>,
+}
+
+impl Tracer {
+    fn new() -> Tracer {
+        Tracer {
+            epoch: Instant::now(),
+            events: Vec::new(),
+            open_spans: Vec::new(),
+            open_inputs: HashMap::new(),
+        }
+    }
+
+    /// Microseconds from the start of the trace to `t`.
+    fn timestamp(&self, t: Instant) -> u64 {
+        let d = t.duration_since(self.epoch);
+        d.as_secs() * 1_000_000 + (d.subsec_nanos() / 1000) as u64
+    }
+
+    fn push(&mut self, ph: &str, cat: &str, name: &str, ts: u64, extra: &str) {
+        self.events.push(format!("{{\"ph\": \"{}\", \"cat\": {}, \"name\": {}, \"ts\": {}, \"pid\": 1, \"tid\": 1{}}}",
+                                 ph, json_string(cat), json_string(name), ts, extra));
+    }
+
+    fn begin(&mut self, name: &str, detail: &str) {
+        let ts = self.timestamp(Instant::now());
+        let extra = if detail.is_empty() {
+            String::new()
+        } else {
+            format!(", \"args\": {{\"detail\": {}}}", json_string(detail))
+        };
+
+        self.push("B", "engine", name, ts, &extra);
+        self.open_spans.push(name.to_owned());
+    }
+
+    fn end(&mut self) {
+        let ts = self.timestamp(Instant::now());
+
+        // An unbalanced end would confuse the viewer, so drop it.
+        if let Some(name) = self.open_spans.pop() {
+            self.push("E", "engine", &name, ts, "");
+        }
+    }
+
+    fn input_begin(&mut self, id: usize, name: &str, origin: InputOrigin) {
+        let ts = self.timestamp(Instant::now());
+        let extra = format!(", \"id\": \"{:x}\", \"args\": {{\"origin\": \"{:?}\"}}", id, origin);
+
+        self.push("b", "input", name, ts, &extra);
+        self.open_inputs.insert(id, name.to_owned());
+    }
+
+    fn input_end(&mut self, id: usize) {
+        let ts = self.timestamp(Instant::now());
+
+        if let Some(name) = self.open_inputs.remove(&id) {
+            self.push("e", "input", &name, ts, &format!(", \"id\": \"{:x}\"", id));
+        }
+    }
+
+    /// Record an engine pass that started at `start` and has just finished.
+    /// If the engine bailed out, some of its spans and inputs may never have
+    /// been closed; they end here too.
+    fn pass(&mut self, name: &str, start: Instant) {
+        while !self.open_spans.is_empty() {
+            self.end();
+        }
+
+        let ids: Vec<usize> = self.open_inputs.keys().cloned().collect();
+        for id in ids {
+            self.input_end(id);
+        }
+
+        let ts = self.timestamp(start);
+        let dur = self.timestamp(Instant::now()) - ts;
+        self.push("X", "pass", name, ts, &format!(", \"dur\": {}", dur));
+    }
+
+    fn write(&self, path: &Path) -> Result<()> {
+        let mut f = ctry!(File::create(path); "couldn't create trace file \"{}\"", path.display());
+        let mut json = String::from("{\"traceEvents\": [\n");
+
+        for (i, ev) in self.events.iter().enumerate() {
+            if i > 0 {
+                json.push_str(",\n");
+            }
+            json.push_str(ev);
+        }
+
+        json.push_str("\n], \"displayTimeUnit\": \"ms\"}\n");
+        ctry!(f.write_all(json.as_bytes()); "couldn't write trace file \"{}\"", path.display());
+        Ok(())
+    }
+}
+
+
+/// The time taken, and metrics reported, by one engine pass.
+struct PassMetrics {
+    name: &'static str,
+    wall_seconds: f64,
+    cpu_seconds: f64,
+    engine: Vec<(String, u64)>,
+}
+
+/// Note the wall-clock and CPU time at the start of an engine pass.
+fn pass_start() -> (Instant, f64) {
+    (Instant::now(), process_cpu_seconds())
+}
+
+/// The user plus system CPU time used by this process so far, in seconds.
+fn process_cpu_seconds() -> f64 {
+    let mut usage: libc::rusage = unsafe { std::mem::zeroed() };
+
+    if unsafe { libc::getrusage(libc::RUSAGE_SELF, &mut usage) } != 0 {
+        return 0.;
+    }
+
+    let secs = |tv: libc::timeval| tv.tv_sec as f64 + tv.tv_usec as f64 * 1e-6;
+    secs(usage.ru_utime) + secs(usage.ru_stime)
+}
+
+/// Quote a string for inclusion in JSON output.
+fn json_string(s: &str) -> String {
+    let mut q = String::with_capacity(s.len() + 2);
+    q.push('"');
+
+    for c in s.chars() {
+        match c {
+            '"' => q.push_str("\\\""),
+            '\\' => q.push_str("\\\\"),
+            '\n' => q.push_str("\\n"),
+            c if (c as u32) < 0x20 => q.push_str(&format!("\\u{:04x}", c as u32)),
+            c => q.push(c),
+        }
+    }
+
+    q.push('"');
+    q
 }
 
 
@@ -389,6 +621,21 @@ struct ProcessingSession {
     keep_logs: bool,
     noted_tex_warnings: bool,
     synctex_enabled: bool,
+    linebreak_cache_enabled: bool,
+    profile_enabled: bool,
+
+    /// If set, timings and counters for the session are written here as
+    /// JSON once it finishes.
+    metrics_json_path: Option<PathBuf>,
+    pass_metrics: Vec<PassMetrics>,
+
+    /// If set, a Chrome trace of the session is written here once it
+    /// finishes.
+    trace_path: Option<PathBuf>,
+
+    /// Where the engine may keep its index of the system fonts, if we have
+    /// a cache directory to put it in.
+    font_index_path: Option<PathBuf>,
 }
 
 
@@ -496,9 +743,12 @@ impl ProcessingSession {
 
         // Ready to roll.
 
+        let trace_path = args.value_of_os("trace").map(PathBuf::from);
+        let events = CliIoEvents::new(trace_path.is_some());
+
         Ok(ProcessingSession {
             io: io,
-            events: CliIoEvents::new(),
+            events: events,
             pass: pass,
             primary_input_path: primary_input_path,
             primary_input_tex_path: tex_input_stem.to_string_lossy().into_owned(),
@@ -514,6 +764,12 @@ impl ProcessingSession {
             keep_logs: args.is_present("keep_logs"),
             noted_tex_warnings: false,
             synctex_enabled: args.is_present("synctex"),
+            linebreak_cache_enabled: args.is_present("linebreak_cache"),
+            profile_enabled: args.is_present("profile"),
+            metrics_json_path: args.value_of_os("metrics_json").map(PathBuf::from),
+            pass_metrics: Vec::new(),
+            trace_path: trace_path,
+            font_index_path: config.font_index_path().ok(),
         })
     }
 
@@ -526,7 +782,7 @@ impl ProcessingSession {
         // stuff could get finicky and we're going to want to be able to
         // figure out why rerun detection is breaking.
 
-        for (name, info) in &self.events.0 {
+        for (name, info) in &self.events.files {
             if info.access_pattern == AccessPattern::ReadThenWritten {
                 let file_changed = match (&info.read_digest, &info.write_digest) {
                     (&Some(ref d1), &Some(ref d2)) => d1 != d2,
@@ -550,7 +806,7 @@ impl ProcessingSession {
 
     #[allow(dead_code)]
     fn _dump_access_info(&self, status: &mut TermcolorStatusBackend) {
-        for (name, info) in &self.events.0 {
+        for (name, info) in &self.events.files {
             if info.access_pattern != AccessPattern::Read {
                 use std::string::ToString;
                 let r = match info.read_digest {
@@ -603,6 +859,8 @@ impl ProcessingSession {
 
         if let Err(e) = result {
             self.write_files(None, status, true)?;
+            self.write_metrics()?;
+            self.write_trace()?;
             return Err(e);
         };
 
@@ -629,7 +887,7 @@ impl ProcessingSession {
                 ctry!(mf_dest.write_all(pip.as_os_str().as_bytes()); "couldn't write to Makefile-rules file");
             }
 
-            for (name, info) in &self.events.0 {
+            for (name, info) in &self.events.files {
                 if info.input_origin != InputOrigin::Filesystem {
                     continue;
                 }
@@ -654,12 +912,90 @@ impl ProcessingSession {
             ctry!(writeln!(mf_dest, ""); "couldn't write to Makefile-rules file");
         }
 
+        self.write_metrics()?;
+        self.write_trace()?;
+
         // All done.
 
         Ok(0)
     }
 
 
+    /// Record the cost of an engine pass that started at `start`, along with
+    /// whatever metrics the engine reported as it finished.
+    fn finish_pass(&mut self, name: &'static str, start: (Instant, f64)) {
+        if let Some(ref mut t) = self.events.tracer {
+            t.pass(name, start.0);
+        }
+
+        let wall = start.0.elapsed();
+
+        self.pass_metrics.push(PassMetrics {
+            name: name,
+            wall_seconds: wall.as_secs() as f64 + wall.subsec_nanos() as f64 * 1e-9,
+            cpu_seconds: process_cpu_seconds() - start.1,
+            engine: std::mem::replace(&mut self.events.metrics, Vec::new()),
+        });
+    }
+
+
+    /// Write out the session trace, if we were asked to.
+    fn write_trace(&self) -> Result<()> {
+        match (&self.trace_path, &self.events.tracer) {
+            (&Some(ref p), &Some(ref t)) => t.write(p),
+            _ => Ok(()),
+        }
+    }
+
+
+    /// Write out the session metrics, if we were asked to.
+    fn write_metrics(&self) -> Result<()> {
+        let path = match self.metrics_json_path {
+            Some(ref p) => p,
+            None => return Ok(()),
+        };
+
+        let mut json = String::from("{\n  \"passes\": [");
+
+        for (i, pass) in self.pass_metrics.iter().enumerate() {
+            json.push_str(if i == 0 { "\n" } else { ",\n" });
+            json.push_str(&format!("    {{\"name\": {}, \"wall_seconds\": {:.6}, \"cpu_seconds\": {:.6}, \"engine\": {{",
+                                   json_string(pass.name), pass.wall_seconds, pass.cpu_seconds));
+
+            for (j, &(ref name, value)) in pass.engine.iter().enumerate() {
+                if j > 0 {
+                    json.push_str(", ");
+                }
+                json.push_str(&format!("{}: {}", json_string(name), value));
+            }
+
+            json.push_str("}}");
+        }
+
+        json.push_str("\n  ],\n  \"io_layers\": [");
+
+        for (i, (name, c)) in self.io.counters.layers().into_iter().enumerate() {
+            json.push_str(if i == 0 { "\n" } else { ",\n" });
+            json.push_str(&format!("    {{\"name\": {}, \"files_opened\": {}, \"bytes_read\": {}, \"bytes_written\": {}}}",
+                                   json_string(name), c.files_opened.get(), c.bytes_read.get(),
+                                   c.bytes_written.get()));
+        }
+
+        json.push_str("\n  ],\n  \"local_cache\": ");
+
+        match self.io.bundle.as_ref().and_then(|b| b.cache_stats()) {
+            Some((hits, misses)) => json.push_str(&format!("{{\"hits\": {}, \"misses\": {}}}", hits, misses)),
+            None => json.push_str("null"),
+        }
+
+        json.push_str("\n}\n");
+
+        let mut f = ctry!(File::create(path); "couldn't create metrics file \"{}\"", path.display());
+        ctry!(f.write_all(json.as_bytes()); "couldn't write metrics file \"{}\"", path.display());
+        Ok(())
+    }
+
+
     fn write_files(&mut self, mut mf_dest_maybe: Option<&mut File>, status: &mut
                    TermcolorStatusBackend, only_logs: bool) -> Result<u32> {
         let mut n_skipped_intermediates = 0;
@@ -669,7 +1005,7 @@ impl ProcessingSession {
             }
 
             let sname = name.to_string_lossy();
-            let summ = self.events.0.get_mut(name).unwrap();
+            let summ = self.events.files.get_mut(name).unwrap();
 
             if !only_logs && (self.output_format == OutputFormat::Aux) {
                 // In this mode we're only writing the .aux file. I initially
@@ -786,7 +1122,7 @@ impl ProcessingSession {
             // can later know that it's OK to delete. I am not super confident
             // that the access_pattern data can just be left as-is when we do
             // this, but, uh, so far it seems to work.
-            for summ in self.events.0.values_mut() {
+            for summ in self.events.files.values_mut() {
                 summ.read_digest = None;
             }
 
@@ -828,6 +1164,7 @@ impl ProcessingSession {
         );
         let stem = r?;
 
+        let start = pass_start();
         let result = {
             let mut stack = self.io.as_stack_for_format(&format!("\\input tectonic-format-{}.tex", stem));
             TexEngine::new()
@@ -835,6 +1172,7 @@ impl ProcessingSession {
                     .initex_mode(true)
                     .process(&mut stack, &mut self.events, status, "UNUSED.fmt", "texput")
         };
+        self.finish_pass("format", start);
 
         match result {
             Ok(TexResult::Spotless) => {},
@@ -888,6 +1226,7 @@ impl ProcessingSession {
 
     /// Run one pass of the TeX engine.
     fn tex_pass(&mut self, rerun_explanation: Option<&str>, status: &mut TermcolorStatusBackend) -> Result<i32> {
+        let start = pass_start();
         let result = {
             let mut stack = self.io.as_stack();
             if let Some(s) = rerun_explanation {
@@ -901,8 +1240,12 @@ impl ProcessingSession {
                 .initex_mode(self.output_format == OutputFormat::Format)
                 .synctex(self.synctex_enabled)
                 .semantic_pagination(self.output_format == OutputFormat::Html)
+                .linebreak_cache(self.linebreak_cache_enabled)
+                .profile(self.profile_enabled)
+                .font_index_path(self.font_index_path.clone())
                 .process(&mut stack, &mut self.events, status, &self.format_path, &self.primary_input_tex_path)
         };
+        self.finish_pass("tex", start);
 
         match result {
             Ok(TexResult::Spotless) => {},
@@ -939,6 +1282,7 @@ impl ProcessingSession {
 
 
     fn bibtex_pass(&mut self, status: &mut TermcolorStatusBackend) -> Result<i32> {
+        let start = pass_start();
         let result = {
             let mut stack = self.io.as_stack();
             let mut engine = BibtexEngine::new ();
@@ -946,6 +1290,7 @@ impl ProcessingSession {
             engine.process(&mut stack, &mut self.events, status,
                            &self.tex_aux_path.to_str().unwrap())
         };
+        self.finish_pass("bibtex", start);
 
         match result {
             Ok(TexResult::Spotless) => {},
@@ -974,13 +1319,16 @@ impl ProcessingSession {
 
 
     fn xdvipdfmx_pass(&mut self, status: &mut TermcolorStatusBackend) -> Result<i32> {
-        {
+        let start = pass_start();
+        let result = {
             let mut stack = self.io.as_stack();
             let mut engine = XdvipdfmxEngine::new ();
             status.note_highlighted("Running ", "xdvipdfmx", " ...");
             engine.process(&mut stack, &mut self.events, status,
-                           &self.tex_xdv_path.to_str().unwrap(), &self.tex_pdf_path.to_str().unwrap())?;
-        }
+                           &self.tex_xdv_path.to_str().unwrap(), &self.tex_pdf_path.to_str().unwrap())
+        };
+        self.finish_pass("xdvipdfmx", start);
+        result?;
 
         self.io.mem.files.borrow_mut().remove(&self.tex_xdv_path);
         Ok(0)
@@ -988,13 +1336,16 @@ impl ProcessingSession {
 
 
     fn spx2html_pass(&mut self, status: &mut TermcolorStatusBackend) -> Result<i32> {
-        {
+        let start = pass_start();
+        let result = {
             let mut stack = self.io.as_stack();
             let mut engine = Spx2HtmlEngine::new ();
             status.note_highlighted("Running ", "spx2html", " ...");
             engine.process(&mut stack, &mut self.events, status,
-                           &self.tex_xdv_path.to_str().unwrap())?;
-        }
+                           &self.tex_xdv_path.to_str().unwrap())
+        };
+        self.finish_pass("spx2html", start);
+        result?;
 
         self.io.mem.files.borrow_mut().remove(&self.tex_xdv_path);
         Ok(0)
@@ -1002,7 +1353,275 @@ impl ProcessingSession {
 }
 
 
+/// The ServerJobEvents type records the I/O events of a single job run by
+/// the `--server` mode, so that the forked child can report them back to
+/// the parent. Each entry is a one-byte tag and a file name.
+struct ServerJobEvents(Vec<(u8, OsString)>);
+
+impl IoEventBackend for ServerJobEvents {
+    fn output_opened(&mut self, name: &OsStr) {
+        self.0.push((b'w', name.to_os_string()));
+    }
+
+    fn input_opened(&mut self, name: &OsStr, origin: InputOrigin) {
+        if origin == InputOrigin::Filesystem {
+            self.0.push((b'r', name.to_os_string()));
+        }
+    }
+}
+
+
+fn write_u64<W: Write>(dest: &mut W, value: u64) -> std::io::Result<()> {
+    let mut buf = [0u8; 8];
+
+    for (i, b) in buf.iter_mut().enumerate() {
+        *b = (value >> (8 * i)) as u8;
+    }
+
+    dest.write_all(&buf)
+}
+
+fn read_u64<R: Read>(src: &mut R) -> std::io::Result<u64> {
+    let mut buf = [0u8; 8];
+    src.read_exact(&mut buf)?;
+    Ok(buf.iter().rev().fold(0, |acc, b| (acc << 8) | (*b as u64)))
+}
+
+fn write_blob<W: Write>(dest: &mut W, data: &[u8]) -> std::io::Result<()> {
+    write_u64(dest, data.len() as u64)?;
+    dest.write_all(data)
+}
+
+fn read_blob<R: Read>(src: &mut R) -> std::io::Result<Vec<u8>> {
+    let len = read_u64(src)?;
+    let mut data = Vec::new();
+    src.take(len).read_to_end(&mut data)?;
+
+    if data.len() as u64 != len {
+        return Err(std::io::Error::new(std::io::ErrorKind::UnexpectedEof, "truncated server reply"));
+    }
+
+    Ok(data)
+}
+
+
+/// Run one server job inside a freshly forked child. The engine has already
+/// been preloaded by the parent, so all we need to do is set up the I/O for
+/// this particular document and go. Results are serialized into `dest`:
+/// a result code (0-2 for the TexResult values, 3 for an error followed by
+/// its message), the recorded I/O events, and every file that landed in the
+/// memory layer.
+fn server_child(dest: &mut UnixStream, engine: &mut TexEngine, bundle: &mut IoProvider,
+                tex_path: &Path, status: &mut StatusBackend) -> Result<()> {
+    let tex_name = match tex_path.file_name() {
+        Some(n) => n.to_string_lossy().into_owned(),
+        None => return Err(ErrorKind::Msg(format!("can't process \"{}\": not a file", tex_path.display())).into()),
+    };
+
+    let mut primary = FilesystemPrimaryInputIo::new(tex_path);
+    let mut mem = MemoryIo::new(true);
+    let mut filesystem = FilesystemIo::new(tex_path.parent().unwrap_or(Path::new("")), false, true, HashSet::new());
+    let mut events = ServerJobEvents(Vec::new());
+
+    let result = {
+        let mut providers: Vec<&mut IoProvider> = Vec::new();
+        providers.push(&mut primary);
+        providers.push(&mut mem);
+        providers.push(&mut filesystem);
+        providers.push(bundle);
+        let mut stack = IoStack::new(providers);
+
+        engine.process_preloaded(&mut stack, &mut events, status, &tex_name)
+    };
+
+    let mut buf = Vec::new();
+
+    match result {
+        Ok(TexResult::Spotless) => buf.push(0),
+        Ok(TexResult::Warnings) => buf.push(1),
+        Ok(TexResult::Errors) => buf.push(2),
+        Err(e) => {
+            buf.push(3);
+            write_blob(&mut buf, e.to_string().as_bytes())?;
+        },
+    }
+
+    write_u64(&mut buf, events.0.len() as u64)?;
+
+    for &(tag, ref name) in &events.0 {
+        buf.push(tag);
+        write_blob(&mut buf, name.as_bytes())?;
+    }
+
+    let files = mem.files.borrow();
+    write_u64(&mut buf, files.len() as u64)?;
+
+    for (name, contents) in &*files {
+        write_blob(&mut buf, name.as_bytes())?;
+        write_blob(&mut buf, contents)?;
+    }
+
+    dest.write_all(&buf)?;
+    Ok(())
+}
+
+
+/// Handle one client connection of the `--server` mode. The client sends the
+/// path of a TeX file on a single line. We fork, let the child process the
+/// document with the preloaded engine, and then write the files it created
+/// next to the input. The client gets back one line per file read from or
+/// written to disk ("read NAME", "wrote PATH") followed by a final "result"
+/// or "error" line.
+fn server_job(conn: &mut UnixStream, engine: &mut TexEngine, bundle: &mut IoProvider,
+              status: &mut TermcolorStatusBackend) -> Result<()> {
+    let mut line = String::new();
+    BufReader::new(&*conn).read_line(&mut line)?;
+    let tex_path = PathBuf::from(line.trim_right_matches(|c: char| c == '\n' || c == '\r'));
+    let out_dir = tex_path.parent().unwrap_or(Path::new("")).to_owned();
+
+    status.note_highlighted("Running ", "TeX", &format!(" on \"{}\" ...", tex_path.display()));
+
+    let (mut parent_end, mut child_end) = UnixStream::pair()?;
+
+    let pid = unsafe { libc::fork() };
+
+    if pid < 0 {
+        return Err(std::io::Error::last_os_error().into());
+    }
+
+    if pid == 0 {
+        // In the child. Never return from here: unwinding back into the
+        // accept loop would have two processes serving the same socket.
+        drop(parent_end);
+        let code = match server_child(&mut child_end, engine, bundle, &tex_path, status) {
+            Ok(_) => 0,
+            Err(_) => 1,
+        };
+        unsafe { libc::_exit(code); }
+    }
+
+    drop(child_end);
+    let mut reply = Vec::new();
+    let read_result = parent_end.read_to_end(&mut reply);
+    let mut wait_status = 0;
+    unsafe { libc::waitpid(pid, &mut wait_status, 0); }
+    read_result?;
+
+    let mut reply = Cursor::new(reply);
+    let mut code = [0u8; 1];
+
+    if reply.read_exact(&mut code).is_err() {
+        return Err(ErrorKind::Msg("the server child process exited without reporting a result".to_owned()).into());
+    }
+
+    let error = if code[0] == 3 {
+        Some(String::from_utf8_lossy(&read_blob(&mut reply)?).into_owned())
+    } else {
+        None
+    };
+
+    for _ in 0..read_u64(&mut reply)? {
+        let mut tag = [0u8; 1];
+        reply.read_exact(&mut tag)?;
+        let name = read_blob(&mut reply)?;
+
+        if tag[0] == b'r' {
+            conn.write_all(b"read ")?;
+            conn.write_all(&name)?;
+            conn.write_all(b"\n")?;
+        }
+    }
+
+    for _ in 0..read_u64(&mut reply)? {
+        let name = OsString::from_vec(read_blob(&mut reply)?);
+        let contents = read_blob(&mut reply)?;
+
+        if name.is_empty() {
+            continue; // the engine's stdout
+        }
+
+        let real_path = out_dir.join(&name);
+        let mut f = ctry!(File::create(&real_path); "can't open output file \"{}\"", real_path.display());
+        f.write_all(&contents)?;
+        conn.write_all(b"wrote ")?;
+        conn.write_all(real_path.as_os_str().as_bytes())?;
+        conn.write_all(b"\n")?;
+    }
+
+    match (error, code[0]) {
+        (Some(msg), _) => return Err(ErrorKind::Msg(msg).into()),
+        (None, 0) => writeln!(conn, "result spotless")?,
+        (None, 1) => writeln!(conn, "result warnings")?,
+        (None, _) => writeln!(conn, "result errors")?,
+    }
+
+    Ok(())
+}
+
+
+/// The `--server` mode: load the format once, then process documents
+/// submitted over a Unix socket, forking a fresh copy of the warm engine for
+/// each one. This skips the format load and engine setup that otherwise
+/// dominate the runtime of small documents. Each job is a single TeX pass
+/// producing XDV; BibTeX, reruns, and xdvipdfmx are left to the client.
+fn run_server(args: &ArgMatches, config: &PersistentConfig, status: &mut TermcolorStatusBackend) -> Result<i32> {
+    let socket_path = PathBuf::from(args.value_of_os("server").unwrap());
+    let format_path = args.value_of("format").unwrap();
+
+    let mut bundle: Box<IoProvider> = if let Some(p) = args.value_of("bundle") {
+        Box::new(ctry!(ZipBundle::<File>::open(Path::new(&p)); "error opening bundle"))
+    } else if let Some(u) = args.value_of("web_bundle") {
+        Box::new(ITarBundle::<HttpITarIoFactory>::new(&u))
+    } else {
+        config.default_io_provider(status)?
+    };
+
+    // The parent never runs another engine after this, so the warm state
+    // stays intact for each forked child's `process_preloaded()`.
+    let mut engine = TexEngine::new();
+
+    {
+        let mut mem = MemoryIo::new(true);
+        let mut providers: Vec<&mut IoProvider> = Vec::new();
+        providers.push(&mut mem);
+        providers.push(&mut *bundle);
+        let mut stack = IoStack::new(providers);
+
+        ctry!(engine
+              .halt_on_error_mode(true)
+              .synctex(args.is_present("synctex"))
+              .font_index_path(config.font_index_path().ok())
+              .preload(&mut stack, &mut NoopIoEventBackend::new(), status, format_path);
+              "failed to preload the format \"{}\"; run a regular build once to generate it", format_path);
+    }
+
+    let listener = ctry!(UnixListener::bind(&socket_path); "couldn't listen on \"{}\"", socket_path.display());
+    tt_note!(status, "serving on \"{}\" with format \"{}\" preloaded", socket_path.display(), format_path);
+
+    for conn in listener.incoming() {
+        let mut conn = match conn {
+            Ok(c) => c,
+            Err(e) => {
+                tt_warning!(status, "failed to accept a connection"; e.into());
+                continue;
+            }
+        };
+
+        if let Err(e) = server_job(&mut conn, &mut engine, &mut *bundle, status) {
+            tt_error!(status, "server job failed"; e);
+            let _ = writeln!(conn, "error {}", e);
+        }
+    }
+
+    Ok(0)
+}
+
+
 fn inner(matches: ArgMatches, config: PersistentConfig, status: &mut TermcolorStatusBackend) -> Result<i32> {
+    if matches.is_present("server") {
+        return run_server(&matches, &config, status);
+    }
+
     let mut sess = ProcessingSession::new(&matches, &config, status)?;
     sess.run(status)
 }
@@ -1060,6 +1679,20 @@ fn main() {
         .arg(Arg::with_name("synctex")
              .long("synctex")
              .help("Generate SyncTeX data."))
+        .arg(Arg::with_name("linebreak_cache")
+             .long("linebreak-cache")
+             .help("Reuse the line breaks of unchanged paragraphs when rerunning the TeX engine."))
+        .arg(Arg::with_name("profile")
+             .long("profile")
+             .help("Profile macro expansion and write the results to <jobname>.prof, for flame graph tools."))
+        .arg(Arg::with_name("metrics_json")
+             .long("metrics-json")
+             .value_name("PATH")
+             .help("Write per-pass timings, I/O counters and engine statistics to <PATH> as JSON."))
+        .arg(Arg::with_name("trace")
+             .long("trace")
+             .value_name("PATH")
+             .help("Write a trace of the engine passes, pages, fonts and inputs to <PATH> in Chrome trace-event format."))
         .arg(Arg::with_name("hide")
              .long("hide")
              .value_name("PATH")
@@ -1082,9 +1715,13 @@ fn main() {
              .short("o")
              .value_name("OUTDIR")
              .help("The directory in which to place output files. [default: the directory containing INPUT]"))
+        .arg(Arg::with_name("server")
+             .long("server")
+             .value_name("SOCKET")
+             .help("Preload the format and process files submitted over the Unix socket <SOCKET>."))
         .arg(Arg::with_name("INPUT")
              .help("The file to process.")
-             .required(true)
+             .required_unless("server")
              .index(1))
         .get_matches ();
 
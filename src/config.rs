@@ -13,6 +13,7 @@
 use std::io::{Read, Write};
 use std::io::ErrorKind as IoErrorKind;
 use std::fs::File;
+use std::path::PathBuf;
 
 use app_dirs::{app_dir, app_root, get_app_root, sanitized, AppDataType};
 use toml;
@@ -89,6 +90,13 @@ impl PersistentConfig {
         )
     }
 
+    /// Where the TeX engine may keep its index of the system's fonts.
+    pub fn font_index_path(&self) -> Result<PathBuf> {
+        let mut path = app_dir(AppDataType::UserCache, &::APP_INFO, "fonts")?;
+        path.push("fontconfig-index.txt");
+        Ok(path)
+    }
+
     pub fn default_io_provider(&self, status: &mut StatusBackend) -> Result<Box<IoProvider>> {
         if self.default_bundles.len() != 1 {
             return Err(ErrorKind::Msg("exactly one default_bundle item must be specified (for now)".to_owned()).into());
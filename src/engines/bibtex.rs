@@ -23,6 +23,7 @@ impl BibtexEngine {
     pub fn process (&mut self, io: &mut IoStack,
                     events: &mut IoEventBackend,
                     status: &mut StatusBackend, aux: &str) -> Result<TexResult> {
+        let _guard = super::lock_engines();
         let caux = CString::new(aux)?;
 
         let /*mut*/ state = ExecutionState::new(io, events, status);
@@ -20,6 +20,7 @@ use std::ffi::{CStr, OsStr, OsString};
 use std::io::{Read, SeekFrom, Write};
 use std::os::unix::ffi::OsStrExt;
 use std::path::Path;
+use std::sync::{Mutex, MutexGuard};
 use std::{io, ptr, slice};
 
 use digest::DigestData;
@@ -41,6 +42,35 @@ pub use self::tex::TexEngine;
 pub use self::xdvipdfmx::XdvipdfmxEngine;
 
 
+// The C/C++ engines keep all of their state in process globals -- the TeX
+// memory arrays, eqtb, the DVI buffer, the bridge pointer used by every
+// `ttstub_*` function -- so no two of them can run at once within one
+// process. Every entry point holds this lock while it runs; callers on
+// different threads are serialized rather than corrupting each other. To
+// process documents in parallel, use separate processes (e.g. the CLI's
+// `--server` mode).
+//
+// The lock also counts the runs started so far. A preloaded TeX engine leaves
+// its warm state in those globals between two locked calls, and uses the
+// count to tell whether any other run has happened in between.
+
+lazy_static! {
+    static ref ENGINE_LOCK: Mutex<u64> = Mutex::new(0);
+}
+
+/// Take the engine lock for one run and return it, with the number of the
+/// run in its guard.
+fn lock_engines() -> MutexGuard<'static, u64> {
+    // A panic while the lock was held leaves it poisoned. Every run but
+    // `TexEngine::process_preloaded()` sets its engine up from scratch, and
+    // that one refuses to run if the count shows that anything, including a
+    // run that panicked, came after its `preload()`. So it's fine to carry on.
+    let mut guard = ENGINE_LOCK.lock().unwrap_or_else(|e| e.into_inner());
+    *guard += 1;
+    guard
+}
+
+
 // Now, the public API.
 
 /// The IoEventBackend trait allows the program driving the TeX engines to
@@ -81,6 +111,24 @@ pub trait IoEventBackend {
     /// used seeks while reading the file. Note that this function takes
     /// ownership of the name and digest.
     fn input_closed(&mut self, _name: OsString, _digest: Option<DigestData>) {}
+
+    /// This function is called when an engine reports one of its internal
+    /// figures, such as the peak size of one of its big arrays, usually at
+    /// the end of its run.
+    fn engine_metric(&mut self, _name: &str, _value: u64) {}
+
+    /// These functions are called when an engine opens and closes an input
+    /// file through the C bridge. The `id` passed to `input_span_begin`
+    /// identifies the handle until the matching `input_span_end`. Unlike
+    /// the spans below, these need not nest.
+    fn input_span_begin(&mut self, _id: usize, _name: &OsStr, _origin: InputOrigin) {}
+    fn input_span_end(&mut self, _id: usize) {}
+
+    /// These functions are called when an engine starts and finishes a
+    /// piece of work worth showing in a timing trace, such as shipping out a
+    /// page. Spans nest, so `span_end` ends the latest unfinished span.
+    fn span_begin(&mut self, _name: &str, _detail: &str) {}
+    fn span_end(&mut self) {}
 }
 
 
@@ -173,9 +221,12 @@ impl<'a, I: 'a + IoProvider> ExecutionState<'a, I> {
         match base {
             OpenResult::Ok(ih) => {
                 let origin = ih.origin();
+                let counters = ih.counters();
                 let dr = GzDecoder::new(ih.into_inner());
+                let mut gzh = InputHandle::new(name, dr, origin);
 
-                OpenResult::Ok(InputHandle::new(name, dr, origin))
+                gzh.count_into(counters);
+                OpenResult::Ok(gzh)
             },
             _ => base
         }
@@ -254,7 +305,9 @@ impl<'a, I: 'a + IoProvider> ExecutionState<'a, I> {
 
         if is_gz {
             let name = oh.name().to_os_string();
+            let counters = oh.counters();
             oh = OutputHandle::new(&name, GzBuilder::new().write(oh.into_inner(), Compression::default()));
+            oh.count_into(counters);
         }
 
         self.events.output_opened(oh.name());
@@ -340,8 +393,7 @@ impl<'a, I: 'a + IoProvider> ExecutionState<'a, I> {
 
         // the file name may have had an extension added, so we use ih.name() here:
         self.events.input_opened(ih.name(), ih.origin());
-        self.input_handles.push(Box::new(ih));
-        &*self.input_handles[self.input_handles.len()-1]
+        self.push_input_handle(ih)
     }
 
     fn input_open_primary(&mut self) -> *const InputHandle {
@@ -358,8 +410,17 @@ impl<'a, I: 'a + IoProvider> ExecutionState<'a, I> {
         };
 
         self.events.primary_input_opened(ih.origin());
-        self.input_handles.push(Box::new(ih));
-        &*self.input_handles[self.input_handles.len()-1]
+        self.push_input_handle(ih)
+    }
+
+    fn push_input_handle(&mut self, ih: InputHandle) -> *const InputHandle {
+        let ih = Box::new(ih);
+        let rv: *const InputHandle = &*ih;
+
+        // Moving the box doesn't move the handle, so `rv` stays good.
+        self.events.input_span_begin(rv as usize, ih.name(), ih.origin());
+        self.input_handles.push(ih);
+        rv
     }
 
     fn input_get_size(&mut self, handle: *mut InputHandle) -> usize {
@@ -389,6 +450,11 @@ impl<'a, I: 'a + IoProvider> ExecutionState<'a, I> {
         Ok(rhandle.read_exact(buf)?)
     }
 
+    fn input_read_partial(&mut self, handle: *mut InputHandle, buf: &mut [u8]) -> Result<usize> {
+        let rhandle: &mut InputHandle = unsafe { &mut *handle };
+        Ok(rhandle.read(buf)?)
+    }
+
     fn input_getc(&mut self, handle: *mut InputHandle) -> Result<u8> {
         let rhandle: &mut InputHandle = unsafe { &mut *handle };
         rhandle.getc()
@@ -409,6 +475,7 @@ impl<'a, I: 'a + IoProvider> ExecutionState<'a, I> {
                 let ih = self.input_handles.swap_remove(i);
                 let (name, digest_opt) = ih.into_name_digest();
                 self.events.input_closed(name, digest_opt);
+                self.events.input_span_end(p as usize);
                 return false;
             }
         }
@@ -441,16 +508,24 @@ struct TectonicBridgeApi {
     input_get_size: *const libc::c_void,
     input_seek: *const libc::c_void,
     input_read: *const libc::c_void,
+    input_read_partial: *const libc::c_void,
     input_getc: *const libc::c_void,
     input_ungetc: *const libc::c_void,
     input_close: *const libc::c_void,
+    report_metric: *const libc::c_void,
+    trace_begin: *const libc::c_void,
+    trace_end: *const libc::c_void,
 }
 
 extern {
     fn tt_get_error_message() -> *const libc::c_char;
     fn tt_set_int_variable(var_name: *const libc::c_char, value: libc::c_int) -> libc::c_int;
-    //fn tt_set_string_variable(var_name: *const libc::c_char, value: *const libc::c_char) -> libc::c_int;
+    fn tt_get_node_alloc_counts(counts: *mut u64, n_counts: libc::c_int) -> libc::c_int;
+    fn tt_get_counter(name: *const libc::c_char, value: *mut u64) -> libc::c_int;
+    fn tt_set_string_variable(var_name: *const libc::c_char, value: *const libc::c_char) -> libc::c_int;
     fn tex_simple_main(api: *const TectonicBridgeApi, dump_name: *const libc::c_char, input_file_name: *const libc::c_char) -> libc::c_int;
+    fn tex_preload_main(api: *const TectonicBridgeApi, dump_name: *const libc::c_char) -> libc::c_int;
+    fn tex_preloaded_main(api: *const TectonicBridgeApi, input_file_name: *const libc::c_char) -> libc::c_int;
     fn dvipdfmx_simple_main(api: *const TectonicBridgeApi,
                             dviname: *const libc::c_char,
                             pdfname: *const libc::c_char,
@@ -654,6 +729,20 @@ fn input_read<'a, I: 'a + IoProvider>(es: *mut ExecutionState<'a, I>, handle: *m
     }
 }
 
+fn input_read_partial<'a, I: 'a + IoProvider>(es: *mut ExecutionState<'a, I>, handle: *mut libc::c_void, data: *mut u8, len: libc::size_t) -> libc::ssize_t {
+    let es = unsafe { &mut *es };
+    let rhandle = handle as *mut InputHandle;
+    let rdata = unsafe { slice::from_raw_parts_mut(data, len) };
+
+    match es.input_read_partial(rhandle, rdata) {
+        Ok(n) => n as isize,
+        Err(e) => {
+            tt_warning!(es.status, "read of up to {} bytes failed", len; e);
+            -1
+        }
+    }
+}
+
 fn input_close<'a, I: 'a + IoProvider>(es: *mut ExecutionState<'a, I>, handle: *mut libc::c_void) -> libc::c_int {
     let es = unsafe { &mut *es };
 
@@ -670,6 +759,31 @@ fn input_close<'a, I: 'a + IoProvider>(es: *mut ExecutionState<'a, I>, handle: *
     }
 }
 
+fn report_metric<'a, I: 'a + IoProvider>(es: *mut ExecutionState<'a, I>, name: *const libc::c_char, value: u64) {
+    let es = unsafe { &mut *es };
+    let rname = unsafe { CStr::from_ptr(name) };
+
+    es.events.engine_metric(&rname.to_string_lossy(), value);
+}
+
+fn trace_begin<'a, I: 'a + IoProvider>(es: *mut ExecutionState<'a, I>, name: *const libc::c_char, detail: *const libc::c_char) {
+    let es = unsafe { &mut *es };
+    let rname = unsafe { CStr::from_ptr(name) };
+
+    if detail.is_null() {
+        es.events.span_begin(&rname.to_string_lossy(), "");
+    } else {
+        let rdetail = unsafe { CStr::from_ptr(detail) };
+        es.events.span_begin(&rname.to_string_lossy(), &rdetail.to_string_lossy());
+    }
+}
+
+fn trace_end<'a, I: 'a + IoProvider>(es: *mut ExecutionState<'a, I>) {
+    let es = unsafe { &mut *es };
+
+    es.events.span_end();
+}
+
 
 // All of these entry points are used to populate the bridge API struct:
 
@@ -692,9 +806,13 @@ impl TectonicBridgeApi {
             input_get_size: input_get_size::<'a, I> as *const libc::c_void,
             input_seek: input_seek::<'a, I> as *const libc::c_void,
             input_read: input_read::<'a, I> as *const libc::c_void,
+            input_read_partial: input_read_partial::<'a, I> as *const libc::c_void,
             input_getc: input_getc::<'a, I> as *const libc::c_void,
             input_ungetc: input_ungetc::<'a, I> as *const libc::c_void,
             input_close: input_close::<'a, I> as *const libc::c_void,
+            report_metric: report_metric::<'a, I> as *const libc::c_void,
+            trace_begin: trace_begin::<'a, I> as *const libc::c_void,
+            trace_end: trace_end::<'a, I> as *const libc::c_void,
         }
     }
 }
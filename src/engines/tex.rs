@@ -2,7 +2,10 @@
 // Copyright 2017-2018 the Tectonic Project
 // Licensed under the MIT License.
 
+use libc;
 use std::ffi::{CStr, CString};
+use std::path::PathBuf;
+use std::ptr;
 
 use errors::{DefinitelySame, ErrorKind, Result};
 use io::IoStack;
@@ -28,6 +31,42 @@ impl DefinitelySame for TexResult {
     }
 }
 
+/// Statistics of the most recent run, read out of the engine's globals before
+/// it releases the engine lock.
+#[derive(Clone,Debug,Default)]
+struct RunStats {
+    node_allocation_counts: Vec<u64>,
+    input_lines_normalized: u64,
+    shaping_cache: (u64, u64),
+    hyphenation_cache: (u64, u64),
+    linebreak_cache: (u64, u64),
+    cs_lookups: (u64, u64),
+}
+
+impl RunStats {
+    // Must be called with the engine lock held.
+    fn collect() -> RunStats {
+        fn counter(name: &[u8]) -> u64 {
+            let mut value = 0u64;
+            unsafe { super::tt_get_counter(name.as_ptr() as _, &mut value); }
+            value
+        }
+
+        let n = unsafe { super::tt_get_node_alloc_counts(ptr::null_mut(), 0) };
+        let mut counts = vec![0u64; n as usize];
+        unsafe { super::tt_get_node_alloc_counts(counts.as_mut_ptr(), n); }
+
+        RunStats {
+            node_allocation_counts: counts,
+            input_lines_normalized: counter(b"input_lines_normalized\0"),
+            shaping_cache: (counter(b"shaping_cache_hits\0"), counter(b"shaping_cache_misses\0")),
+            hyphenation_cache: (counter(b"hyphenation_cache_hits\0"), counter(b"hyphenation_cache_misses\0")),
+            linebreak_cache: (counter(b"linebreak_cache_hits\0"), counter(b"linebreak_cache_misses\0")),
+            cs_lookups: (counter(b"cs_lookups\0"), counter(b"cs_index_probes\0")),
+        }
+    }
+}
+
 #[derive(Debug)]
 pub struct TexEngine {
     // One day, the engine will hold its own state. For the time being,
@@ -37,6 +76,15 @@ pub struct TexEngine {
     initex_mode: bool,
     synctex_enabled: bool,
     semantic_pagination_enabled: bool,
+    linebreak_cache_enabled: bool,
+    profile_enabled: bool,
+    font_index_path: Option<PathBuf>,
+
+    // The engine run number of a successful `preload()`, until
+    // `process_preloaded()` consumes the warm state.
+    preloaded_run: Option<u64>,
+
+    stats: RunStats,
 }
 
 impl Default for TexEngine {
@@ -46,6 +94,11 @@ impl Default for TexEngine {
             initex_mode: false,
             synctex_enabled: false,
             semantic_pagination_enabled: false,
+            linebreak_cache_enabled: false,
+            profile_enabled: false,
+            font_index_path: None,
+            preloaded_run: None,
+            stats: RunStats::default(),
         }
     }
 }
@@ -89,6 +142,39 @@ impl TexEngine {
         self
     }
 
+    /// Let the engine reuse the line breaks of paragraphs that it has already
+    /// broken in an earlier run in this process.
+    ///
+    /// Reruns of a LaTeX document usually only change cross-references, so
+    /// most paragraphs come out exactly as before. Only paragraphs that TeX
+    /// breaks on its first (unhyphenated) pass are remembered.
+    pub fn linebreak_cache (&mut self, enabled: bool) -> &mut Self {
+        self.linebreak_cache_enabled = enabled;
+        self
+    }
+
+    /// Configure the engine to profile macro expansion.
+    ///
+    /// The engine times every macro call, expansion of an expandable
+    /// primitive, and execution of a command, and at the end of the run
+    /// writes the results to `<jobname>.prof` in the collapsed-stack format
+    /// understood by flame graph tools. A summary of the most expensive
+    /// control sequences goes to the log file.
+    pub fn profile (&mut self, enabled: bool) -> &mut Self {
+        self.profile_enabled = enabled;
+        self
+    }
+
+    /// Let the engine keep an index of the system fonts at the given path.
+    ///
+    /// Finding a system font by name otherwise means opening every candidate
+    /// font file to read its names, which is slow on machines with many
+    /// fonts. The index is only used by the Fontconfig font manager.
+    pub fn font_index_path (&mut self, path: Option<PathBuf>) -> &mut Self {
+        self.font_index_path = path;
+        self
+    }
+
     // This function can't be generic across the IoProvider trait, for now,
     // since the global pointer that stashes the ExecutionState must have a
     // complete type.
@@ -97,13 +183,131 @@ impl TexEngine {
                     events: &mut IoEventBackend,
                     status: &mut StatusBackend,
                     format_file_name: &str, input_file_name: &str) -> Result<TexResult> {
+        let _guard = super::lock_engines();
         let cformat = CString::new(format_file_name)?;
         let cinput = CString::new(input_file_name)?;
 
-        let /*mut*/ state = ExecutionState::new(io, events, status);
-        let bridge = TectonicBridgeApi::new(&state);
+        // Any warm state left by `preload()` is about to be overwritten.
+        self.preloaded_run = None;
+
+        let result = {
+            let /*mut*/ state = ExecutionState::new(io, events, status);
+            let bridge = TectonicBridgeApi::new(&state);
+
+            self.set_globals();
+
+            history_to_result(unsafe { super::tex_simple_main(&bridge, cformat.as_ptr(), cinput.as_ptr()) })
+        };
+
+        self.stats = RunStats::collect();
+        result
+    }
+
+    /// Initialize the engine and load the named format file, but do not
+    /// process any input. The engine's global state is left "warm" so that
+    /// `process_preloaded()` can pick up from here.
+    ///
+    /// The intended use is to preload once and then `fork()`: each child
+    /// process calls `process_preloaded()` on its copy of this engine,
+    /// sharing the parent's loaded format copy-on-write.
+    /// `process_preloaded()` consumes the warm state, so calling it twice is
+    /// an error.
+    ///
+    /// The warm state lives in the engine's process globals, so any other
+    /// engine run in this process between the two calls destroys it. In that
+    /// case `process_preloaded()` returns an error rather than running on
+    /// whatever is left.
+    pub fn preload (&mut self, io: &mut IoStack,
+                    events: &mut IoEventBackend,
+                    status: &mut StatusBackend,
+                    format_file_name: &str) -> Result<()> {
+        let guard = super::lock_engines();
+        let cformat = CString::new(format_file_name)?;
 
-        // initialize globals
+        self.preloaded_run = None;
+
+        {
+            let /*mut*/ state = ExecutionState::new(io, events, status);
+            let bridge = TectonicBridgeApi::new(&state);
+
+            self.set_globals();
+
+            history_to_result(unsafe { super::tex_preload_main(&bridge, cformat.as_ptr()) })?;
+        }
+
+        self.preloaded_run = Some(*guard);
+        Ok(())
+    }
+
+    /// Process the primary input using engine state set up by a previous
+    /// call to `preload()`. The settings used are those that were in effect
+    /// when `preload()` was called.
+    pub fn process_preloaded (&mut self, io: &mut IoStack,
+                              events: &mut IoEventBackend,
+                              status: &mut StatusBackend,
+                              input_file_name: &str) -> Result<TexResult> {
+        let guard = super::lock_engines();
+
+        match self.preloaded_run.take() {
+            Some(n) if n + 1 == *guard => {},
+            Some(_) => return Err(ErrorKind::Msg("another engine has run since the TeX engine was preloaded".to_owned()).into()),
+            None => return Err(ErrorKind::Msg("the TeX engine has not been preloaded".to_owned()).into()),
+        }
+
+        let cinput = CString::new(input_file_name)?;
+
+        let result = {
+            let /*mut*/ state = ExecutionState::new(io, events, status);
+            let bridge = TectonicBridgeApi::new(&state);
+
+            history_to_result(unsafe { super::tex_preloaded_main(&bridge, cinput.as_ptr()) })
+        };
+
+        self.stats = RunStats::collect();
+        result
+    }
+
+    /// Get the number of nodes of each size that the engine allocated during
+    /// the most recent run. Element `n` counts requests for `n`-word nodes,
+    /// except that the last element lumps together all sizes too large to
+    /// have an entry of their own.
+    pub fn node_allocation_counts(&self) -> Vec<u64> {
+        self.stats.node_allocation_counts.clone()
+    }
+
+    /// Get the number of input lines that the engine had to run through the
+    /// Unicode normalizer during the most recent run. Lines that are already
+    /// in the requested form (`\XeTeXinputnormalization`) aren't counted.
+    pub fn input_lines_normalized(&self) -> u64 {
+        self.stats.input_lines_normalized
+    }
+
+    /// Get the (hits, misses) of the engine's word shaping cache during the
+    /// most recent run.
+    pub fn shaping_cache_stats(&self) -> (u64, u64) {
+        self.stats.shaping_cache
+    }
+
+    /// Get the (hits, misses) of the engine's hyphenation cache during the
+    /// most recent run.
+    pub fn hyphenation_cache_stats(&self) -> (u64, u64) {
+        self.stats.hyphenation_cache
+    }
+
+    /// Get the number of paragraphs whose line breaks were taken from the
+    /// line-break cache during the most recent run, and the number that had
+    /// to be broken afresh.
+    pub fn linebreak_cache_stats(&self) -> (u64, u64) {
+        self.stats.linebreak_cache
+    }
+
+    /// Get the number of control sequence lookups during the most recent run,
+    /// and the number of slots of the lookup index that they examined.
+    pub fn cs_lookup_stats(&self) -> (u64, u64) {
+        self.stats.cs_lookups
+    }
+
+    fn set_globals(&self) {
         let v = if self.halt_on_error { 1 } else { 0 };
         unsafe { super::tt_set_int_variable(b"halt_on_error_p\0".as_ptr() as _, v); }
         let v = if self.initex_mode { 1 } else { 0 };
@@ -112,19 +316,29 @@ impl TexEngine {
         unsafe { super::tt_set_int_variable(b"synctex_enabled\0".as_ptr() as _, v); }
         let v = if self.semantic_pagination_enabled { 1 } else { 0 };
         unsafe { super::tt_set_int_variable(b"semantic_pagination_enabled\0".as_ptr() as _, v); }
+        let v = if self.linebreak_cache_enabled { 1 } else { 0 };
+        unsafe { super::tt_set_int_variable(b"linebreak_cache_enabled\0".as_ptr() as _, v); }
+        let v = if self.profile_enabled { 1 } else { 0 };
+        unsafe { super::tt_set_int_variable(b"profile_enabled\0".as_ptr() as _, v); }
 
-        unsafe {
-            match super::tex_simple_main(&bridge, cformat.as_ptr(), cinput.as_ptr()) {
-                0 => Ok(TexResult::Spotless),
-                1 => Ok(TexResult::Warnings),
-                2 => Ok(TexResult::Errors),
-                3 => {
-                    let ptr = super::tt_get_error_message();
-                    let msg = CStr::from_ptr(ptr).to_string_lossy().into_owned();
-                    Err(ErrorKind::Msg(msg).into())
-                },
-                x => Err(ErrorKind::Msg(format!("internal error: unexpected 'history' value {}", x)).into())
-            }
-        }
+        // An empty path turns the index off.
+        let path = self.font_index_path.as_ref().and_then(|p| p.to_str()).unwrap_or("");
+        let v = CString::new(path).unwrap_or_default();
+        unsafe { super::tt_set_string_variable(b"font_index_path\0".as_ptr() as _, v.as_ptr()); }
+    }
+}
+
+
+fn history_to_result(history: libc::c_int) -> Result<TexResult> {
+    match history {
+        0 => Ok(TexResult::Spotless),
+        1 => Ok(TexResult::Warnings),
+        2 => Ok(TexResult::Errors),
+        3 => {
+            let ptr = unsafe { super::tt_get_error_message() };
+            let msg = unsafe { CStr::from_ptr(ptr) }.to_string_lossy().into_owned();
+            Err(ErrorKind::Msg(msg).into())
+        },
+        x => Err(ErrorKind::Msg(format!("internal error: unexpected 'history' value {}", x)).into())
     }
 }
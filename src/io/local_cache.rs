@@ -32,6 +32,8 @@ pub struct LocalCache<B: IoProvider> {
     formats_base: PathBuf,
     data_path: PathBuf,
     contents: HashMap<OsString,LocalCacheItem>,
+    hits: u64,
+    misses: u64,
 }
 
 
@@ -157,7 +159,9 @@ impl<B: IoProvider> LocalCache<B> {
             manifest_path: manifest_path,
             formats_base: formats_base.to_owned(),
             data_path: data.to_owned(),
-            contents: contents
+            contents: contents,
+            hits: 0,
+            misses: 0,
         })
     }
 
@@ -231,6 +235,8 @@ impl<B: IoProvider> LocalCache<B> {
 
     fn path_for_name(&mut self, name: &OsStr, status: &mut StatusBackend) -> OpenResult<PathBuf> {
         if let Some(info) = self.contents.get(name) {
+            self.hits += 1;
+
             return match info.digest {
                 None => OpenResult::NotAvailable,
                 Some(ref d) => match d.create_two_part_path(&self.data_path) {
@@ -246,6 +252,8 @@ impl<B: IoProvider> LocalCache<B> {
         // Fun times. Because we're touching the backend, we need to verify that
         // its digest is what we think.
 
+        self.misses += 1;
+
         if let Err(e) = self.check_digest(status) {
             return OpenResult::Err(e);
         }
@@ -391,7 +399,10 @@ impl<B: IoProvider> IoProvider for LocalCache<B> {
             OpenResult::Err(e) => return OpenResult::Err(e),
         };
 
-        OpenResult::Ok(InputHandle::new(name, BufReader::new(f), InputOrigin::Other))
+        // The engine reads the whole format in one go, so there's no point
+        // in buffering, and format files never trigger reruns, so there's no
+        // point in digesting them either.
+        OpenResult::Ok(InputHandle::new_without_digest(name, f, InputOrigin::Other))
     }
 
 
@@ -409,4 +420,9 @@ impl<B: IoProvider> IoProvider for LocalCache<B> {
 
         fs::rename(&temp_path, &final_path).map_err(|e| e.into())
     }
+
+
+    fn cache_stats(&self) -> Option<(u64, u64)> {
+        Some((self.hits, self.misses))
+    }
 }
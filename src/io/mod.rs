@@ -9,10 +9,12 @@ use hyper_native_tls::NativeTlsClient;
 use hyper::net::HttpsConnector;
 use hyper::Client;
 use std::borrow::Cow;
+use std::cell::Cell;
 use std::ffi::{OsStr, OsString};
 use std::fs::File;
 use std::io::{self, Cursor, Read, Seek, SeekFrom, Write};
 use std::path::Path;
+use std::rc::Rc;
 
 use digest::{self, Digest, DigestData};
 use errors::{Error, ErrorKind, Result};
@@ -53,6 +55,29 @@ pub enum InputOrigin {
 }
 
 
+/// Running totals of the traffic through one I/O layer. An IoStack can be
+/// given one of these per layer; it then attaches the right one to every
+/// handle that it opens, and the handles add to it as they are used. Byte
+/// counts are of the data as the engines see it, i.e. after decompression
+/// of gzipped inputs and before compression of gzipped outputs.
+#[derive(Debug, Default)]
+pub struct IoCounters {
+    pub files_opened: Cell<u64>,
+    pub bytes_read: Cell<u64>,
+    pub bytes_written: Cell<u64>,
+}
+
+impl IoCounters {
+    pub fn new() -> Rc<IoCounters> {
+        Rc::new(IoCounters::default())
+    }
+}
+
+fn add_count(counter: &Cell<u64>, n: usize) {
+    counter.set(counter.get() + n as u64);
+}
+
+
 /// Input handles are basically Read objects with a few extras. We don't
 /// require the standard io::Seek because we need to provide a dummy
 /// implementation for GZip streams, which we wouldn't be allowed to do
@@ -82,9 +107,11 @@ pub struct InputHandle {
     inner: Box<InputFeatures>,
     digest: digest::DigestComputer,
     origin: InputOrigin,
+    compute_digest: bool,
     ever_read: bool,
     did_unhandled_seek: bool,
     ungetc_char: Option<u8>,
+    counters: Option<Rc<IoCounters>>,
 }
 
 
@@ -95,12 +122,26 @@ impl InputHandle {
             inner: Box::new(inner),
             digest: Default::default(),
             origin: origin,
+            compute_digest: true,
             ever_read: false,
             did_unhandled_seek: false,
             ungetc_char: None,
+            counters: None,
         }
     }
 
+    /// Create a handle that does not compute a digest of the data read
+    /// through it. This is appropriate for large files that can never be a
+    /// reason to rerun the engine, such as format files: the engine slurps
+    /// them in one read, and hashing tens of megabytes would then dominate
+    /// the cost of loading them. `into_name_digest()` always returns `None`
+    /// for such handles.
+    pub fn new_without_digest<T: 'static + InputFeatures>(name: &OsStr, inner: T, origin: InputOrigin) -> InputHandle {
+        let mut ih = InputHandle::new(name, inner, origin);
+        ih.compute_digest = false;
+        ih
+    }
+
     pub fn name(&self) -> &OsStr {
         self.name.as_os_str()
     }
@@ -109,6 +150,16 @@ impl InputHandle {
         self.origin
     }
 
+    /// Add the data read through this handle to the given counters.
+    pub fn count_into(&mut self, counters: Option<Rc<IoCounters>>) {
+        self.counters = counters;
+    }
+
+    /// The counters that this handle adds to, if any.
+    pub fn counters(&self) -> Option<Rc<IoCounters>> {
+        self.counters.clone()
+    }
+
     /// Consumes the object and returns the underlying readable handle that
     /// it references.
     pub fn into_inner(self) -> Box<InputFeatures> {
@@ -122,7 +173,7 @@ impl InputHandle {
     /// TeX access pattern: files are opened, immediately closed, and then
     /// opened again.
     pub fn into_name_digest(self) -> (OsString, Option<DigestData>) {
-        if self.did_unhandled_seek || !self.ever_read {
+        if self.did_unhandled_seek || !self.ever_read || !self.compute_digest {
             (self.name, None)
         } else {
             (self.name, Some(DigestData::from(self.digest)))
@@ -174,7 +225,12 @@ impl Read for InputHandle {
 
         self.ever_read = true;
         let n = self.inner.read(buf)?;
-        self.digest.input(&buf[..n]);
+        if self.compute_digest {
+            self.digest.input(&buf[..n]);
+        }
+        if let Some(ref c) = self.counters {
+            add_count(&c.bytes_read, n);
+        }
         Ok(n)
     }
 }
@@ -213,6 +269,7 @@ pub struct OutputHandle {
     name: OsString,
     inner: Box<Write>,
     digest: digest::DigestComputer,
+    counters: Option<Rc<IoCounters>>,
 }
 
 
@@ -222,6 +279,7 @@ impl OutputHandle {
             name: name.to_os_string(),
             inner: Box::new(inner),
             digest: digest::create(),
+            counters: None,
         }
     }
 
@@ -229,6 +287,16 @@ impl OutputHandle {
         self.name.as_os_str()
     }
 
+    /// Add the data written through this handle to the given counters.
+    pub fn count_into(&mut self, counters: Option<Rc<IoCounters>>) {
+        self.counters = counters;
+    }
+
+    /// The counters that this handle adds to, if any.
+    pub fn counters(&self) -> Option<Rc<IoCounters>> {
+        self.counters.clone()
+    }
+
     /// Consumes the object and returns the underlying writable handle that
     /// it references.
     pub fn into_inner(self) -> Box<Write> {
@@ -246,6 +314,9 @@ impl Write for OutputHandle {
     fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
         let n = self.inner.write(buf)?;
         self.digest.input(&buf[..n]);
+        if let Some(ref c) = self.counters {
+            add_count(&c.bytes_written, n);
+        }
         Ok(n)
     }
 
@@ -336,6 +407,12 @@ pub trait IoProvider {
     fn write_format(&mut self, _name: &str, _data: &[u8], _status: &mut StatusBackend) -> Result<()> {
         Err(ErrorKind::Msg("this I/O layer cannot save format files".to_owned()).into())
     }
+
+    /// For providers that keep a cache of files obtained from somewhere
+    /// else, the number of (hits, misses) of that cache so far.
+    fn cache_stats(&self) -> Option<(u64, u64)> {
+        None
+    }
 }
 
 
@@ -3,9 +3,10 @@
 // Licensed under the MIT License.
 
 use std::ffi::OsStr;
+use std::rc::Rc;
 
 use status::StatusBackend;
-use super::{InputHandle, IoProvider, OpenResult, OutputHandle};
+use super::{InputHandle, IoCounters, IoProvider, OpenResult, OutputHandle};
 
 
 /// An IoStack is an IoProvider that delegates to an ordered list of
@@ -15,26 +16,71 @@ use super::{InputHandle, IoProvider, OpenResult, OutputHandle};
 
 pub struct IoStack<'a> {
     items: Vec<&'a mut IoProvider>,
+    counters: Vec<Option<Rc<IoCounters>>>,
 }
 
 
 impl<'a> IoStack<'a> {
     pub fn new(items: Vec<&'a mut IoProvider>) -> IoStack<'a> {
+        let counters = vec![None; items.len()];
+
+        IoStack {
+            items: items,
+            counters: counters,
+        }
+    }
+
+    /// Create a stack that keeps track of how much each of its layers is
+    /// used. `counters[i]`, if present, accumulates the traffic of the
+    /// handles opened by `items[i]`.
+    pub fn new_with_counters(items: Vec<&'a mut IoProvider>,
+                             counters: Vec<Option<Rc<IoCounters>>>) -> IoStack<'a> {
+        assert_eq!(items.len(), counters.len());
+
         IoStack {
             items: items,
+            counters: counters,
         }
     }
 }
 
 
+fn count_input(r: OpenResult<InputHandle>, counters: &Option<Rc<IoCounters>>) -> OpenResult<InputHandle> {
+    match r {
+        OpenResult::Ok(mut h) => {
+            if let Some(ref c) = *counters {
+                c.files_opened.set(c.files_opened.get() + 1);
+                h.count_into(Some(c.clone()));
+            }
+            OpenResult::Ok(h)
+        },
+        r => r
+    }
+}
+
+
+fn count_output(r: OpenResult<OutputHandle>, counters: &Option<Rc<IoCounters>>) -> OpenResult<OutputHandle> {
+    match r {
+        OpenResult::Ok(mut h) => {
+            if let Some(ref c) = *counters {
+                c.files_opened.set(c.files_opened.get() + 1);
+                h.count_into(Some(c.clone()));
+            }
+            OpenResult::Ok(h)
+        },
+        r => r
+    }
+}
+
+
 impl<'a> IoProvider for IoStack<'a> {
     fn output_open_name(&mut self, name: &OsStr) -> OpenResult<OutputHandle> {
-        for item in &mut self.items {
+        for (item, counters) in self.items.iter_mut().zip(&self.counters) {
             let r = item.output_open_name(name);
 
             match r {
                 OpenResult::NotAvailable => continue,
-                _ => return r
+                _ => return count_output(r, counters)
             };
         }
 
@@ -42,12 +88,12 @@ impl<'a> IoProvider for IoStack<'a> {
     }
 
     fn output_open_stdout(&mut self) -> OpenResult<OutputHandle> {
-        for item in &mut self.items {
+        for (item, counters) in self.items.iter_mut().zip(&self.counters) {
             let r = item.output_open_stdout();
 
             match r {
                 OpenResult::NotAvailable => continue,
-                _ => return r
+                _ => return count_output(r, counters)
             };
         }
 
@@ -55,12 +101,12 @@ impl<'a> IoProvider for IoStack<'a> {
     }
 
     fn input_open_name(&mut self, name: &OsStr, status: &mut StatusBackend) -> OpenResult<InputHandle> {
-        for item in &mut self.items {
+        for (item, counters) in self.items.iter_mut().zip(&self.counters) {
             let r = item.input_open_name(name, status);
 
             match r {
                 OpenResult::NotAvailable => continue,
-                _ => return r
+                _ => return count_input(r, counters)
             };
         }
 
@@ -68,12 +114,12 @@ impl<'a> IoProvider for IoStack<'a> {
     }
 
     fn input_open_primary(&mut self, status: &mut StatusBackend) -> OpenResult<InputHandle> {
-        for item in &mut self.items {
+        for (item, counters) in self.items.iter_mut().zip(&self.counters) {
             let r = item.input_open_primary(status);
 
             match r {
                 OpenResult::NotAvailable => continue,
-                _ => return r
+                _ => return count_input(r, counters)
             };
         }
 
@@ -81,12 +127,12 @@ impl<'a> IoProvider for IoStack<'a> {
     }
 
     fn input_open_format(&mut self, name: &OsStr, status: &mut StatusBackend) -> OpenResult<InputHandle> {
-        for item in &mut self.items {
+        for (item, counters) in self.items.iter_mut().zip(&self.counters) {
             let r = item.input_open_format(name, status);
 
             match r {
                 OpenResult::NotAvailable => continue,
-                _ => return r
+                _ => return count_input(r, counters)
             };
         }
 
@@ -38,6 +38,7 @@ extern crate flate2;
 extern crate fs2;
 extern crate hyper;
 extern crate hyper_native_tls;
+#[macro_use] extern crate lazy_static;
 extern crate libc;
 extern crate md5;
 extern crate mkstemp;
@@ -580,9 +580,60 @@ binary_search(const T* array, UInt32 count, UInt32 value)
 	return array;
 }
 
+template<class T>
+static void
+build_class_index(const T* members, UInt32 memberCount, UInt32& first, std::vector<UInt32>& slots)
+{
+	// Only index classes whose members are reasonably dense; a class spanning
+	// most of the BMP with a handful of members is left to binary_search.
+	if (memberCount == 0)
+		return;
+	first = READ(members[0]);
+	UInt32	span = READ(members[memberCount - 1]) - first + 1;
+	if (span > 256 && span / 8 > memberCount)
+		return;
+	slots.assign(span, 0);
+	for (UInt32 i = 0; i < memberCount; ++i) {
+		UInt32&	slot = slots[READ(members[i]) - first];
+		if (slot == 0)	// keep the first of any duplicates, as binary_search would
+			slot = i + 1;
+	}
+}
+
+const Pass::ClassIndex&
+Pass::classIndex(UInt32 classNumber) const
+{
+	if (classNumber >= classIndexes.size()) {
+		ClassIndex	empty = { false, 0, std::vector<UInt32>() };
+		classIndexes.resize(classNumber + 1, empty);
+	}
+	ClassIndex&	ci = classIndexes[classNumber];
+	if (!ci.built) {
+		const UInt32*	classPtr = (const UInt32*)(matchClassBase + READ(*((const UInt32*)matchClassBase + classNumber)));
+		UInt32			memberCount = READ(*classPtr++);
+		if (bInputIsUnicode) {
+			if (bSupplementaryChars)
+				build_class_index(classPtr, memberCount, ci.first, ci.slots);
+			else
+				build_class_index((const UInt16*)classPtr, memberCount, ci.first, ci.slots);
+		}
+		else
+			build_class_index((const UInt8*)classPtr, memberCount, ci.first, ci.slots);
+		ci.built = true;
+	}
+	return ci;
+}
+
 long
 Pass::classMatch(UInt32 classNumber, UInt32 inChar) const
 {
+	const ClassIndex&	ci = classIndex(classNumber);
+	if (!ci.slots.empty()) {
+		if (inChar < ci.first || inChar - ci.first >= ci.slots.size())
+			return -1;
+		return (long)ci.slots[inChar - ci.first] - 1;
+	}
+
 	const UInt32*	classPtr = (const UInt32*)(matchClassBase + READ(*((const UInt32*)matchClassBase + classNumber)));
 	UInt32			memberCount = READ(*classPtr++);
 	if (bInputIsUnicode) {
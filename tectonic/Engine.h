@@ -23,6 +23,8 @@ Description:
 #include "TECkit_Engine.h"
 #include "TECkit_Format.h"
 
+#include <vector>
+
 class Converter;
 
 class Stage
@@ -102,6 +104,14 @@ protected:
 	long				classMatch(UInt32 classNumber, UInt32 inChar) const;
 	UInt32				repClassMember(UInt32 classNumber, UInt32 index) const;
 
+	struct ClassIndex {
+		bool				built;
+		UInt32				first;	// lowest member of the class
+		std::vector<UInt32>	slots;	// member index + 1 for each char from first, 0 if not a member;
+									// empty if the class is too sparse to index directly
+	};
+	const ClassIndex&	classIndex(UInt32 classNumber) const;
+
 	struct MatchInfo {
 		UInt32			classIndex;
 		int				groupRepeats;
@@ -149,6 +159,8 @@ protected:
 	bool				bOutputIsUnicode;
 	bool				bSupplementaryChars;
 	UInt8				numPageMaps;
+
+	mutable std::vector<ClassIndex>	classIndexes;	// built lazily by classIndex()
 };
 
 class Converter
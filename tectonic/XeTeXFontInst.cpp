@@ -50,6 +50,7 @@ authorization from the copyright holders.
 #include <string.h>
 #include FT_GLYPH_H
 #include FT_ADVANCES_H
+#include FT_OUTLINE_H
 
 
 /* Return NAME with any leading path stripped off.  This returns a
@@ -86,6 +87,7 @@ XeTeXFontInst::XeTeXFontInst(const char* pathname, int index, float pointSize, i
     , m_vertical(false)
     , m_filename(NULL)
     , m_index(0)
+    , m_face(NULL)
     , m_ftFace(0)
     , m_hbFont(NULL)
 {
@@ -93,13 +95,16 @@ XeTeXFontInst::XeTeXFontInst(const char* pathname, int index, float pointSize, i
         initialize(pathname, index, status);
 }
 
+static void releaseSharedFace(XeTeXSharedFace* face);
+
 XeTeXFontInst::~XeTeXFontInst()
 {
-    if (m_ftFace != 0) {
-        FT_Done_Face(m_ftFace);
+    hb_font_destroy(m_hbFont);
+    if (m_face != NULL) {
+        releaseSharedFace(m_face);
+        m_face = NULL;
         m_ftFace = 0;
     }
-    hb_font_destroy(m_hbFont);
     delete[] m_filename;
 }
 
@@ -108,7 +113,7 @@ XeTeXFontInst::~XeTeXFontInst()
 static hb_bool_t
 _get_glyph(hb_font_t*, void *font_data, hb_codepoint_t ch, hb_codepoint_t vs, hb_codepoint_t *gid, void*)
 {
-    FT_Face face = (FT_Face) font_data;
+    FT_Face face = ((XeTeXFontInst*) font_data)->getFtFace();
     *gid = 0;
 
     if (vs)
@@ -144,13 +149,13 @@ _get_glyph_advance(FT_Face face, FT_UInt gid, bool vertical)
 static hb_position_t
 _get_glyph_h_advance(hb_font_t*, void *font_data, hb_codepoint_t gid, void*)
 {
-    return _get_glyph_advance((FT_Face) font_data, gid, false);
+    return ((XeTeXFontInst*) font_data)->getGlyphAdvanceUnits(gid, false);
 }
 
 static hb_position_t
 _get_glyph_v_advance(hb_font_t*, void *font_data, hb_codepoint_t gid, void*)
 {
-    return _get_glyph_advance((FT_Face) font_data, gid, true);
+    return ((XeTeXFontInst*) font_data)->getGlyphAdvanceUnits(gid, true);
 }
 
 static hb_bool_t
@@ -172,7 +177,7 @@ _get_glyph_v_origin(hb_font_t*, void *font_data, hb_codepoint_t gid, hb_position
     // Reconsider this (e.g. using BASE table) when we get around overhauling
     // the text directionality model and implementing real vertical typesetting.
 
-    FT_Face face = (FT_Face) font_data;
+    FT_Face face = ((XeTeXFontInst*) font_data)->getFtFace();
     FT_Error error;
 
     error = FT_Load_Glyph (face, gid, FT_LOAD_NO_SCALE);
@@ -187,7 +192,7 @@ _get_glyph_v_origin(hb_font_t*, void *font_data, hb_codepoint_t gid, hb_position
 static hb_position_t
 _get_glyph_h_kerning(hb_font_t*, void *font_data, hb_codepoint_t gid1, hb_codepoint_t gid2, void*)
 {
-    FT_Face face = (FT_Face) font_data;
+    FT_Face face = ((XeTeXFontInst*) font_data)->getFtFace();
     FT_Error error;
     FT_Vector kerning;
     hb_position_t ret;
@@ -210,24 +215,22 @@ _get_glyph_v_kerning(hb_font_t*, void *font_data, hb_codepoint_t gid1, hb_codepo
 static hb_bool_t
 _get_glyph_extents(hb_font_t*, void *font_data, hb_codepoint_t gid, hb_glyph_extents_t *extents, void*)
 {
-    FT_Face face = (FT_Face) font_data;
-    FT_Error error;
+    FT_Pos xBearing, yBearing, width, height;
 
-    error = FT_Load_Glyph (face, gid, FT_LOAD_NO_SCALE);
-    if (!error) {
-        extents->x_bearing = face->glyph->metrics.horiBearingX;
-        extents->y_bearing = face->glyph->metrics.horiBearingY;
-        extents->width  =  face->glyph->metrics.width;
-        extents->height = -face->glyph->metrics.height;
-    }
+    if (!((XeTeXFontInst*) font_data)->getGlyphExtentsUnits(gid, &xBearing, &yBearing, &width, &height))
+        return false;
 
-    return !error;
+    extents->x_bearing = xBearing;
+    extents->y_bearing = yBearing;
+    extents->width  =  width;
+    extents->height = -height;
+    return true;
 }
 
 static hb_bool_t
 _get_glyph_contour_point(hb_font_t*, void *font_data, hb_codepoint_t gid, unsigned int point_index, hb_position_t *x, hb_position_t *y, void*)
 {
-    FT_Face face = (FT_Face) font_data;
+    FT_Face face = ((XeTeXFontInst*) font_data)->getFtFace();
     FT_Error error;
     bool ret = false;
 
@@ -248,7 +251,7 @@ _get_glyph_contour_point(hb_font_t*, void *font_data, hb_codepoint_t gid, unsign
 static hb_bool_t
 _get_glyph_name(hb_font_t *, void *font_data, hb_codepoint_t gid, char *name, unsigned int size, void *)
 {
-    FT_Face face = (FT_Face) font_data;
+    FT_Face face = ((XeTeXFontInst*) font_data)->getFtFace();
     bool ret = false;
 
     ret = !FT_Get_Glyph_Name (face, gid, name, size);
@@ -302,30 +305,95 @@ _get_table(hb_face_t *, hb_tag_t tag, void *user_data)
     return blob;
 }
 
+/* Shared faces. A document typically loads the same few font files at many
+ * sizes, and find_native_font() even loads a throwaway instance just to
+ * read the design size; parsing the file once and sharing the FT_Face,
+ * hb_face_t and per-glyph metrics saves both the I/O and the parsing.
+ * Faces stay cached after their last instance goes away, since the next
+ * \font is likely to want them again, until too many pile up.
+ *
+ * Within one engine run a face is reused as is. The same name may resolve
+ * to different bytes in a later run (another bundle or I/O stack), so
+ * resetSharedFontFaces() drops the unused faces at engine setup, and a
+ * face that is still in use is read through the bridge again the first
+ * time a new run asks for it. That also keeps the driver's record of the
+ * run's inputs complete. */
+
+#define MAX_UNUSED_SHARED_FACES 64
+
+typedef std::map<std::pair<std::string,int>,XeTeXSharedFace*> SharedFaceMap;
+static SharedFaceMap sSharedFaces;
+static int sUnusedSharedFaces = 0;
+static unsigned int sSharedFaceGeneration = 0;
+
+static void
+destroySharedFace(XeTeXSharedFace* face)
+{
+    std::map<OTTag,void*>::iterator i;
+
+    for (i = face->tables.begin(); i != face->tables.end(); ++i)
+        free(i->second);
+
+    hb_face_destroy(face->hbFace);
+    FT_Done_Face(face->ftFace);
+    free(face->data);
+    free(face->afmData);
+    delete face;
+}
+
+static void
+purgeUnusedSharedFaces(void)
+{
+    SharedFaceMap::iterator i = sSharedFaces.begin();
+
+    while (i != sSharedFaces.end()) {
+        if (i->second->refCount == 0) {
+            destroySharedFace(i->second);
+            sSharedFaces.erase(i++);
+        } else {
+            ++i;
+        }
+    }
+
+    sUnusedSharedFaces = 0;
+}
+
 void
-XeTeXFontInst::initialize(const char* pathname, int index, int &status)
+resetSharedFontFaces(void)
 {
-    TT_Postscript *postTable;
-    TT_OS2* os2Table;
-    FT_Error error;
-    hb_face_t *hbFace;
+    purgeUnusedSharedFaces();
+    sSharedFaceGeneration++;
+}
 
-    if (!gFreeTypeLibrary) {
-        error = FT_Init_FreeType(&gFreeTypeLibrary);
-        if (error)
-            _tt_abort("FreeType initialization failed, error %d", error);
+static void
+releaseSharedFace(XeTeXSharedFace* face)
+{
+    if (--face->refCount > 0)
+        return;
+
+    // A face whose file changed under it was replaced in the map and is
+    // only kept alive by its remaining instances.
+    SharedFaceMap::iterator i = sSharedFaces.find(face->key);
+    if (i == sSharedFaces.end() || i->second != face) {
+        destroySharedFace(face);
+        return;
     }
 
+    if (++sUnusedSharedFaces > MAX_UNUSED_SHARED_FACES)
+        purgeUnusedSharedFaces();
+}
+
+static FT_Byte*
+readFontFile(const char* pathname, size_t* size)
+{
     // Here we emulate some logic that was originally in find_native_font();
     rust_input_handle_t handle = ttstub_input_open (pathname, TTIF_OPENTYPE, 0);
     if (handle == NULL)
         handle = ttstub_input_open (pathname, TTIF_TRUETYPE, 0);
     if (handle == NULL)
         handle = ttstub_input_open (pathname, TTIF_TYPE1, 0);
-    if (handle == NULL) {
-        status = 1;
-        return;
-    }
+    if (handle == NULL)
+        return NULL;
 
     size_t sz = ttstub_input_get_size (handle);
     FT_Byte *data = (FT_Byte *) xmalloc (sz);
@@ -334,15 +402,81 @@ XeTeXFontInst::initialize(const char* pathname, int index, int &status)
         _tt_abort("failed to read font file");
     ttstub_input_close(handle);
 
-    error = FT_New_Memory_Face(gFreeTypeLibrary, data, sz, index, &m_ftFace);
+    *size = sz;
+    return data;
+}
 
-    if (!FT_IS_SCALABLE(m_ftFace)) {
-        status = 1;
-        return;
+static XeTeXSharedFace*
+acquireSharedFace(const char* pathname, int index)
+{
+    std::pair<std::string,int> key(pathname, index);
+    SharedFaceMap::iterator i = sSharedFaces.find(key);
+    FT_Byte *data = NULL;
+    size_t sz = 0;
+
+    if (i != sSharedFaces.end()) {
+        XeTeXSharedFace* face = i->second;
+        bool current = face->generation == sSharedFaceGeneration;
+
+        if (!current) {
+            data = readFontFile(pathname, &sz);
+            current = data != NULL && sz == face->dataSize && memcmp(data, face->data, sz) == 0;
+        }
+
+        if (current) {
+            free(data);
+            face->generation = sSharedFaceGeneration;
+            if (face->refCount++ == 0)
+                sUnusedSharedFaces--;
+            return face;
+        }
+
+        // Stale: the old face lives on with its remaining instances, and
+        // a new one is built from the bytes we just read.
+        sSharedFaces.erase(i);
+        if (face->refCount == 0) {
+            destroySharedFace(face);
+            sUnusedSharedFaces--;
+        }
+    } else {
+        data = readFontFile(pathname, &sz);
+    }
+
+    if (data == NULL)
+        return NULL;
+
+    FT_Error error;
+    FT_Face ftFace;
+
+    if (!gFreeTypeLibrary) {
+        error = FT_Init_FreeType(&gFreeTypeLibrary);
+        if (error)
+            _tt_abort("FreeType initialization failed, error %d", error);
+    }
+
+    error = FT_New_Memory_Face(gFreeTypeLibrary, data, sz, index, &ftFace);
+    if (error) {
+        free(data);
+        return NULL;
     }
 
+    if (!FT_IS_SCALABLE(ftFace)) {
+        FT_Done_Face(ftFace);
+        free(data);
+        return NULL;
+    }
+
+    XeTeXSharedFace* face = new XeTeXSharedFace;
+    face->key = key;
+    face->refCount = 1;
+    face->ftFace = ftFace;
+    face->data = data;
+    face->dataSize = sz;
+    face->afmData = NULL;
+    face->generation = sSharedFaceGeneration;
+
     /* for non-sfnt-packaged fonts (presumably Type 1), see if there is an AFM file we can attach */
-    if (index == 0 && !FT_IS_SFNT(m_ftFace)) {
+    if (index == 0 && !FT_IS_SFNT(ftFace)) {
         // Tectonic: this code used to use kpse_find_file and FT_Attach_File
         // to try to find metrics for this font. Thanks to the existence of
         // FT_Attach_Stream we can emulate this behavior while going through
@@ -357,23 +491,43 @@ XeTeXFontInst::initialize(const char* pathname, int index, int &status)
         free (afm);
 
         if (afm_handle != NULL) {
-            sz = ttstub_input_get_size (afm_handle);
-            data = (FT_Byte *) xmalloc (sz);
-            r = ttstub_input_read (afm_handle, (char *) data, sz);
-            if (r < 0 || (size_t) r != sz)
+            size_t afm_sz = ttstub_input_get_size (afm_handle);
+            face->afmData = (FT_Byte *) xmalloc (afm_sz);
+            ssize_t r = ttstub_input_read (afm_handle, (char *) face->afmData, afm_sz);
+            if (r < 0 || (size_t) r != afm_sz)
                 _tt_abort("failed to read AFM file");
             ttstub_input_close(afm_handle);
 
             FT_Open_Args open_args;
             open_args.flags = FT_OPEN_MEMORY;
-            open_args.memory_base = data;
-            open_args.memory_size = sz;
+            open_args.memory_base = face->afmData;
+            open_args.memory_size = afm_sz;
 
-            FT_Attach_Stream(m_ftFace, &open_args);
-            // TBD: memory management of `data`?
+            FT_Attach_Stream(ftFace, &open_args);
         }
     }
 
+    face->hbFace = hb_face_create_for_tables(_get_table, ftFace, NULL);
+    hb_face_set_index(face->hbFace, index);
+    hb_face_set_upem(face->hbFace, ftFace->units_per_EM);
+
+    sSharedFaces[key] = face;
+    return face;
+}
+
+void
+XeTeXFontInst::initialize(const char* pathname, int index, int &status)
+{
+    TT_Postscript *postTable;
+    TT_OS2* os2Table;
+
+    m_face = acquireSharedFace(pathname, index);
+    if (m_face == NULL) {
+        status = 1;
+        return;
+    }
+    m_ftFace = m_face->ftFace;
+
     m_filename = xstrdup(pathname);
     m_index = index;
     m_unitsPerEM = m_ftFace->units_per_EM;
@@ -391,17 +545,13 @@ XeTeXFontInst::initialize(const char* pathname, int index, int &status)
         m_xHeight = unitsToPoints(os2Table->sxHeight);
     }
 
-    // Set up HarfBuzz font
-    hbFace = hb_face_create_for_tables(_get_table, m_ftFace, NULL);
-    hb_face_set_index(hbFace, index);
-    hb_face_set_upem(hbFace, m_unitsPerEM);
-    m_hbFont = hb_font_create(hbFace);
-    hb_face_destroy(hbFace);
+    // Set up HarfBuzz font: a scaled view of the shared face
+    m_hbFont = hb_font_create(m_face->hbFace);
 
     if (hbFontFuncs == NULL)
         hbFontFuncs = _get_font_funcs();
 
-    hb_font_set_funcs(m_hbFont, hbFontFuncs, m_ftFace, NULL);
+    hb_font_set_funcs(m_hbFont, hbFontFuncs, this, NULL);
     hb_font_set_scale(m_hbFont, m_unitsPerEM, m_unitsPerEM);
     // We don’t want device tables adjustments
     hb_font_set_ppem(m_hbFont, 0, 0);
@@ -415,23 +565,27 @@ XeTeXFontInst::setLayoutDirVertical(bool vertical)
     m_vertical = vertical;
 }
 
+// The returned table belongs to the shared face; callers must not free it.
 void *
 XeTeXFontInst::getFontTable(OTTag tag) const
 {
+    std::map<OTTag,void*>::const_iterator i = m_face->tables.find(tag);
+    if (i != m_face->tables.end())
+        return i->second;
+
     FT_ULong tmpLength = 0;
+    void* table = NULL;
     FT_Error error = FT_Load_Sfnt_Table(m_ftFace, tag, 0, NULL, &tmpLength);
-    if (error)
-        return NULL;
-
-    void* table = xmalloc(tmpLength * sizeof(char));
-    if (table != NULL) {
+    if (!error) {
+        table = xmalloc(tmpLength * sizeof(char));
         error = FT_Load_Sfnt_Table(m_ftFace, tag, 0, (FT_Byte*)table, &tmpLength);
         if (error) {
             free((void *) table);
-            return NULL;
+            table = NULL;
         }
     }
 
+    m_face->tables[tag] = table;
     return table;
 }
 
@@ -441,26 +595,110 @@ XeTeXFontInst::getFontTable(FT_Sfnt_Tag tag) const
     return FT_Get_Sfnt_Table(m_ftFace, tag);
 }
 
+/* Per-glyph metrics. Shaping and glyph-metrics mode ask for the same few
+ * glyphs over and over, so each glyph is loaded from FreeType at most once
+ * (and its advance fetched at most once per direction). Glyph IDs stay
+ * 32-bit here, as HarfBuzz passes them, so that IDs past 0xFFFF are
+ * rejected by the bounds check rather than wrapped onto another glyph. */
+
+#define GLYPH_H_ADVANCE   0x01
+#define GLYPH_V_ADVANCE   0x02
+#define GLYPH_LOADED      0x04 /* slot metrics and cbox are valid */
+#define GLYPH_LOAD_FAILED 0x08
+
+const XeTeXGlyphMetrics*
+XeTeXFontInst::glyphMetrics(uint32_t gid, uint8_t wanted)
+{
+    if (gid >= (unsigned long) m_ftFace->num_glyphs)
+        return NULL;
+
+    std::vector<XeTeXGlyphMetrics>& metrics = m_face->glyphMetrics;
+    if (metrics.empty())
+        metrics.resize(m_ftFace->num_glyphs, XeTeXGlyphMetrics());
+
+    XeTeXGlyphMetrics* m = &metrics[gid];
+
+    if ((wanted & GLYPH_H_ADVANCE) && !(m->flags & GLYPH_H_ADVANCE)) {
+        m->hAdvance = _get_glyph_advance(m_ftFace, gid, false);
+        m->flags |= GLYPH_H_ADVANCE;
+    }
+
+    if ((wanted & GLYPH_V_ADVANCE) && !(m->flags & GLYPH_V_ADVANCE)) {
+        m->vAdvance = _get_glyph_advance(m_ftFace, gid, true);
+        m->flags |= GLYPH_V_ADVANCE;
+    }
+
+    if ((wanted & GLYPH_LOADED) && !(m->flags & (GLYPH_LOADED | GLYPH_LOAD_FAILED))) {
+        FT_Error error = FT_Load_Glyph(m_ftFace, gid, FT_LOAD_NO_SCALE);
+
+        if (error) {
+            m->flags |= GLYPH_LOAD_FAILED;
+        } else {
+            FT_GlyphSlot slot = m_ftFace->glyph;
+
+            m->xBearing = slot->metrics.horiBearingX;
+            m->yBearing = slot->metrics.horiBearingY;
+            m->width = slot->metrics.width;
+            m->height = slot->metrics.height;
+
+            m->cbox.xMin = m->cbox.yMin = m->cbox.xMax = m->cbox.yMax = 0;
+            if (slot->format == FT_GLYPH_FORMAT_OUTLINE) {
+                FT_Outline_Get_CBox(&slot->outline, &m->cbox);
+            } else {
+                FT_Glyph glyph;
+                if (FT_Get_Glyph(slot, &glyph) == 0) {
+                    FT_Glyph_Get_CBox(glyph, FT_GLYPH_BBOX_UNSCALED, &m->cbox);
+                    FT_Done_Glyph(glyph);
+                }
+            }
+
+            m->flags |= GLYPH_LOADED;
+        }
+    }
+
+    return m;
+}
+
+FT_Pos
+XeTeXFontInst::getGlyphAdvanceUnits(uint32_t gid, bool vertical)
+{
+    const XeTeXGlyphMetrics* m = glyphMetrics(gid, vertical ? GLYPH_V_ADVANCE : GLYPH_H_ADVANCE);
+
+    if (m == NULL)
+        return _get_glyph_advance(m_ftFace, gid, vertical);
+
+    return vertical ? m->vAdvance : m->hAdvance;
+}
+
+bool
+XeTeXFontInst::getGlyphExtentsUnits(uint32_t gid, FT_Pos* xBearing, FT_Pos* yBearing,
+                                    FT_Pos* width, FT_Pos* height)
+{
+    const XeTeXGlyphMetrics* m = glyphMetrics(gid, GLYPH_LOADED);
+
+    if (m == NULL || !(m->flags & GLYPH_LOADED))
+        return false;
+
+    *xBearing = m->xBearing;
+    *yBearing = m->yBearing;
+    *width = m->width;
+    *height = m->height;
+    return true;
+}
+
 void
 XeTeXFontInst::getGlyphBounds(GlyphID gid, GlyphBBox* bbox)
 {
     bbox->xMin = bbox->yMin = bbox->xMax = bbox->yMax = 0.0;
 
-    FT_Error error = FT_Load_Glyph(m_ftFace, gid, FT_LOAD_NO_SCALE);
-    if (error)
+    const XeTeXGlyphMetrics* m = glyphMetrics(gid, GLYPH_LOADED);
+    if (m == NULL || !(m->flags & GLYPH_LOADED))
         return;
 
-    FT_Glyph glyph;
-    error = FT_Get_Glyph(m_ftFace->glyph, &glyph);
-    if (error == 0) {
-        FT_BBox ft_bbox;
-        FT_Glyph_Get_CBox(glyph, FT_GLYPH_BBOX_UNSCALED, &ft_bbox);
-        bbox->xMin = unitsToPoints(ft_bbox.xMin);
-        bbox->yMin = unitsToPoints(ft_bbox.yMin);
-        bbox->xMax = unitsToPoints(ft_bbox.xMax);
-        bbox->yMax = unitsToPoints(ft_bbox.yMax);
-        FT_Done_Glyph(glyph);
-    }
+    bbox->xMin = unitsToPoints(m->cbox.xMin);
+    bbox->yMin = unitsToPoints(m->cbox.yMin);
+    bbox->xMax = unitsToPoints(m->cbox.xMax);
+    bbox->yMax = unitsToPoints(m->cbox.yMax);
 }
 
 GlyphID
@@ -478,7 +716,7 @@ XeTeXFontInst::getNumGlyphs() const
 float
 XeTeXFontInst::getGlyphWidth(GlyphID gid)
 {
-    return unitsToPoints(_get_glyph_advance(m_ftFace, gid, false));
+    return unitsToPoints(getGlyphAdvanceUnits(gid, false));
 }
 
 void
@@ -45,6 +45,73 @@ authorization from the copyright holders.
 #include "xetex-core.h"
 #include "XeTeXFontMgr.h"
 
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Unscaled metrics of a single glyph, filled in on first use
+struct XeTeXGlyphMetrics {
+    uint8_t flags;
+    FT_Pos hAdvance;
+    FT_Pos vAdvance;
+    FT_Pos xBearing, yBearing, width, height; // glyph slot metrics, for HarfBuzz
+    FT_BBox cbox; // outline control box, for our own bounds queries
+};
+
+// A MathKern table from the OpenType MATH table: kern values[i] applies
+// up to and including correction heights[i], values.back() beyond the top.
+struct XeTeXMathKern {
+    std::vector<hb_position_t> heights;
+    std::vector<hb_position_t> values;
+};
+
+// OpenType MATH data of a face, decoded on first use so that the math
+// typesetter doesn't go back to HarfBuzz for every noad. All values are in
+// font units; callers scale them to the instance's size.
+struct XeTeXMathData {
+                        XeTeXMathData()
+                            : constantsLoaded(false)
+                            , kernsLoaded(false), kernsValid(false)
+                            , minConnectorOverlapLoaded(false), minConnectorOverlap(0)
+                            { }
+
+    bool                constantsLoaded;
+    std::vector<hb_position_t> constants; // indexed by hb_ot_math_constant_t
+
+    // keyed by glyph * 2 + (horizontal ? 1 : 0)
+    std::unordered_map<uint32_t,std::vector<hb_ot_math_glyph_variant_t> > variants;
+    std::unordered_map<uint32_t,std::vector<hb_ot_math_glyph_part_t> > assemblies;
+
+    // keyed by glyph
+    std::unordered_map<uint32_t,hb_position_t> italicsCorrections;
+    std::unordered_map<uint32_t,hb_position_t> topAccentAttachments;
+
+    bool                kernsLoaded;
+    bool                kernsValid; // false if the table couldn't be decoded; ask HarfBuzz instead
+    std::unordered_map<uint32_t,XeTeXMathKern> kerns; // keyed by glyph * 4 + hb_ot_math_kern_t
+
+    bool                minConnectorOverlapLoaded;
+    hb_position_t       minConnectorOverlap;
+};
+
+// A parsed font file. Every XeTeXFontInst for the same file and face index
+// shares one of these, whatever its size; an instance only adds its own
+// scaled hb_font_t on top.
+struct XeTeXSharedFace {
+    std::pair<std::string,int> key; // (pathname, face index)
+    int refCount;
+    FT_Face ftFace;
+    hb_face_t* hbFace;
+    FT_Byte* data; // the font file, which must outlive ftFace
+    size_t dataSize;
+    unsigned int generation; // engine run that last read the file
+    FT_Byte* afmData; // attached AFM metrics, if any
+    std::vector<XeTeXGlyphMetrics> glyphMetrics; // indexed by glyph ID
+    std::map<OTTag,void*> tables; // raw sfnt tables handed out by getFontTable()
+    XeTeXMathData math;
+};
+
 // create specific subclasses for each supported platform
 
 class XeTeXFontInst
@@ -63,9 +130,12 @@ protected:
     char *m_filename; // font filename
     uint32_t m_index; // face index
 
-    FT_Face m_ftFace;
+    XeTeXSharedFace* m_face;
+    FT_Face m_ftFace; // m_face->ftFace
     hb_font_t* m_hbFont;
 
+    const XeTeXGlyphMetrics* glyphMetrics(uint32_t gid, uint8_t wanted);
+
 public:
     XeTeXFontInst(float pointSize, int &status);
     XeTeXFontInst(const char* filename, int index, float pointSize, int &status);
@@ -83,6 +153,8 @@ public:
         return m_filename;
     }
     hb_font_t *getHbFont() const { return m_hbFont; }
+    FT_Face getFtFace() const { return m_ftFace; }
+    XeTeXMathData& getMathData() const { return m_face->math; }
     void setLayoutDirVertical(bool vertical);
     bool getLayoutDirVertical() const { return m_vertical; };
 
@@ -100,6 +172,11 @@ public:
 
     void getGlyphBounds(GlyphID glyph, GlyphBBox* bbox);
 
+    // unscaled values, as used by the HarfBuzz callbacks
+    FT_Pos getGlyphAdvanceUnits(uint32_t glyph, bool vertical);
+    bool getGlyphExtentsUnits(uint32_t glyph, FT_Pos* xBearing, FT_Pos* yBearing,
+                              FT_Pos* width, FT_Pos* height);
+
     float getGlyphWidth(GlyphID glyph);
     void getGlyphHeightDepth(GlyphID glyph, float *ht, float* dp);
     void getGlyphSidebearings(GlyphID glyph, float* lsb, float* rsb);
@@ -54,6 +54,7 @@ authorization from the copyright holders.
 
 XeTeXFontMgr* XeTeXFontMgr::sFontManager = NULL;
 char XeTeXFontMgr::sReqEngine = 0;
+std::string XeTeXFontMgr::sIndexPath;
 
 /* use our own fmax function because it seems to be missing on certain platforms
    (solaris2.9, at least) */
@@ -78,6 +79,12 @@ XeTeXFontMgr::GetFontManager()
     return sFontManager;
 }
 
+void
+XeTeXFontMgr::SetIndexPath(const char* path)
+{
+    sIndexPath = (path != NULL) ? path : "";
+}
+
 void
 XeTeXFontMgr::Terminate()
 {
@@ -48,6 +48,9 @@ public:
         // returns the global fontmanager (creating it if necessary)
     static void                     Terminate();
         // clean up (may be required if using the cocoa implementation)
+    static void                     SetIndexPath(const char* path);
+        // where the platform font manager may keep a persistent index of the
+        // host's fonts; NULL or "" disables the index
 
     PlatformFontRef                 findFont(const char* name, char* variant, double ptSize);
         // 1st arg is name as specified by user (C string, UTF-8)
@@ -81,6 +84,7 @@ public:
 protected:
     static XeTeXFontMgr*            sFontManager;
     static char                     sReqEngine;
+    static std::string              sIndexPath;
 
                                     XeTeXFontMgr()
                                         { }
@@ -80,8 +80,295 @@ convertToUtf8(UConverter* conv, const unsigned char* name, int len)
     return buffer2;
 }
 
+/* The font index. Fontconfig keeps its own cache of the host's fonts, but
+ * that only gives us Fontconfig's idea of their names; to match fonts the
+ * way XeTeX always has we need the sfnt name tables and the OS/2, head,
+ * post and GPOS 'size' data, which means opening each candidate font. On
+ * machines with thousands of fonts that dominates the time of a run, so we
+ * remember what we found in a file next to Tectonic's other caches.
+ *
+ * Records are keyed by file path and face index, and each is trusted only
+ * while the file's size and modification time are unchanged. The format is
+ * one tab-separated line per face; name lists are joined with \x1f. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INDEX_SIGNATURE "tectonic-fontconfig-index 1"
+#define INDEX_LIST_SEP '\x1f'
+#define INDEX_N_FIELDS 20
+
+static bool
+statFontFile(const char* path, long long* mtime, long long* size)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0)
+        return false;
+
+    *mtime = (long long) st.st_mtime;
+    *size = (long long) st.st_size;
+    return true;
+}
+
+// Records whose strings would break the line format are just not saved.
+static bool
+indexSafe(const std::string& s)
+{
+    return s.find_first_of("\t\n\r\x1f") == std::string::npos;
+}
+
+static bool
+indexSafe(const std::list<std::string>& l)
+{
+    for (std::list<std::string>::const_iterator i = l.begin(); i != l.end(); ++i)
+        if (i->empty() || !indexSafe(*i))
+            return false;
+    return true;
+}
+
+static void
+writeList(FILE* f, const std::list<std::string>& l)
+{
+    for (std::list<std::string>::const_iterator i = l.begin(); i != l.end(); ++i) {
+        if (i != l.begin())
+            fputc(INDEX_LIST_SEP, f);
+        fputs(i->c_str(), f);
+    }
+}
+
+static void
+splitString(const std::string& s, char sep, std::vector<std::string>* out)
+{
+    size_t start = 0;
+
+    out->clear();
+    while (true) {
+        size_t end = s.find(sep, start);
+        if (end == std::string::npos) {
+            out->push_back(s.substr(start));
+            return;
+        }
+        out->push_back(s.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+static void
+readList(const std::string& s, std::list<std::string>* l)
+{
+    std::vector<std::string> parts;
+
+    l->clear();
+    if (s.empty())
+        return;
+
+    splitString(s, INDEX_LIST_SEP, &parts);
+    l->insert(l->end(), parts.begin(), parts.end());
+}
+
+std::string
+XeTeXFontMgr_FC::indexKey(FcPattern* pat)
+{
+    char* pathname;
+    int index;
+    char buf[32];
+
+    if (FcPatternGetString(pat, FC_FILE, 0, (FcChar8**)&pathname) != FcResultMatch)
+        return std::string();
+    if (FcPatternGetInteger(pat, FC_INDEX, 0, &index) != FcResultMatch)
+        return std::string();
+
+    snprintf(buf, sizeof(buf), "%d", index);
+    std::string key(pathname);
+    key += '\t';
+    key += buf;
+    return key;
+}
+
+XeTeXFontMgr_FC::IndexRecord*
+XeTeXFontMgr_FC::findIndexRecord(FcPattern* pat)
+{
+    if (m_index.empty())
+        return NULL;
+
+    std::string key = indexKey(pat);
+    std::map<std::string,IndexRecord>::iterator i = m_index.find(key);
+    if (i == m_index.end())
+        return NULL;
+
+    IndexRecord* rec = &i->second;
+    if (!rec->checked) {
+        long long mtime, size;
+        std::string path(key, 0, key.rfind('\t'));
+
+        if (!statFontFile(path.c_str(), &mtime, &size) || mtime != rec->mtime || size != rec->size) {
+            m_index.erase(i);
+            m_indexDirty = true;
+            return NULL;
+        }
+        rec->checked = true;
+    }
+
+    return rec;
+}
+
+void
+XeTeXFontMgr_FC::addIndexRecord(FcPattern* pat, const NameCollection* names)
+{
+    if (sIndexPath.empty())
+        return;
+
+    std::string key = indexKey(pat);
+    if (key.empty())
+        return;
+
+    IndexRecord rec;
+    std::string path(key, 0, key.rfind('\t'));
+    if (!indexSafe(path) || !indexSafe(names->m_psName) || !indexSafe(names->m_fullNames)
+        || !indexSafe(names->m_familyNames) || !indexSafe(names->m_styleNames))
+        return;
+    if (!statFontFile(path.c_str(), &rec.mtime, &rec.size))
+        return;
+
+    rec.checked = true;
+    rec.names = *names;
+    m_index[key] = rec;
+    m_indexDirty = true;
+}
+
+void
+XeTeXFontMgr_FC::loadIndex()
+{
+    m_index.clear();
+    m_indexDirty = false;
+
+    if (sIndexPath.empty())
+        return;
+
+    FILE* f = fopen(sIndexPath.c_str(), "rb");
+    if (f == NULL)
+        return;
+
+    std::string line;
+    std::vector<std::string> fields;
+    bool first = true;
+    int c;
+
+    while (true) {
+        line.clear();
+        while ((c = getc(f)) != EOF && c != '\n')
+            line += (char) c;
+        if (c == EOF && line.empty())
+            break;
+
+        if (first) {
+            first = false;
+            if (line != INDEX_SIGNATURE)
+                break; // some other version; we'll just start over
+            continue;
+        }
+
+        splitString(line, '\t', &fields);
+        if (fields.size() != INDEX_N_FIELDS)
+            continue;
+
+        IndexRecord rec;
+        rec.mtime = strtoll(fields[2].c_str(), NULL, 10);
+        rec.size = strtoll(fields[3].c_str(), NULL, 10);
+        rec.names.m_psName = fields[4];
+        readList(fields[5], &rec.names.m_fullNames);
+        readList(fields[6], &rec.names.m_familyNames);
+        readList(fields[7], &rec.names.m_styleNames);
+        rec.hasStyle = fields[8] == "1";
+        rec.weight = strtol(fields[9].c_str(), NULL, 10);
+        rec.width = strtol(fields[10].c_str(), NULL, 10);
+        rec.slant = strtol(fields[11].c_str(), NULL, 10);
+        rec.isReg = fields[12] == "1";
+        rec.isBold = fields[13] == "1";
+        rec.isItalic = fields[14] == "1";
+        rec.opSizeInfo.designSize = strtoul(fields[15].c_str(), NULL, 10);
+        rec.opSizeInfo.subFamilyID = strtoul(fields[16].c_str(), NULL, 10);
+        rec.opSizeInfo.nameCode = strtoul(fields[17].c_str(), NULL, 10);
+        rec.opSizeInfo.minSize = strtoul(fields[18].c_str(), NULL, 10);
+        rec.opSizeInfo.maxSize = strtoul(fields[19].c_str(), NULL, 10);
+
+        m_index[fields[0] + '\t' + fields[1]] = rec;
+    }
+
+    fclose(f);
+}
+
+void
+XeTeXFontMgr_FC::saveIndex()
+{
+    if (!m_indexDirty || sIndexPath.empty() || allFonts == NULL)
+        return;
+
+    // Several compiles may share a cache directory, so each writes its own
+    // temporary file next to the index and renames it into place.
+    std::string tmpPath = sIndexPath + ".XXXXXX";
+    int fd = mkstemp(&tmpPath[0]);
+    if (fd < 0)
+        return; // the index is only an optimization
+
+    FILE* f = fdopen(fd, "wb");
+    if (f == NULL) {
+        close(fd);
+        remove(tmpPath.c_str());
+        return;
+    }
+
+    fprintf(f, "%s\n", INDEX_SIGNATURE);
+
+    // Only faces that Fontconfig still lists are written out, so the index
+    // doesn't accumulate fonts that have since been removed.
+    for (int i = 0; i < allFonts->nfont; ++i) {
+        std::string key = indexKey(allFonts->fonts[i]);
+        std::map<std::string,IndexRecord>::const_iterator it = m_index.find(key);
+        if (it == m_index.end())
+            continue;
+
+        const IndexRecord& rec = it->second;
+        if (!indexSafe(rec.names.m_psName) || !indexSafe(rec.names.m_fullNames)
+            || !indexSafe(rec.names.m_familyNames) || !indexSafe(rec.names.m_styleNames))
+            continue;
+
+        fprintf(f, "%s\t%lld\t%lld\t%s\t", key.c_str(), rec.mtime, rec.size, rec.names.m_psName.c_str());
+        writeList(f, rec.names.m_fullNames);
+        fputc('\t', f);
+        writeList(f, rec.names.m_familyNames);
+        fputc('\t', f);
+        writeList(f, rec.names.m_styleNames);
+        fprintf(f, "\t%d\t%u\t%u\t%d\t%d\t%d\t%d\t%u\t%u\t%u\t%u\t%u\n",
+                rec.hasStyle ? 1 : 0, rec.weight, rec.width, rec.slant,
+                rec.isReg ? 1 : 0, rec.isBold ? 1 : 0, rec.isItalic ? 1 : 0,
+                rec.opSizeInfo.designSize, rec.opSizeInfo.subFamilyID, rec.opSizeInfo.nameCode,
+                rec.opSizeInfo.minSize, rec.opSizeInfo.maxSize);
+    }
+
+    if (fclose(f) == 0 && rename(tmpPath.c_str(), sIndexPath.c_str()) == 0)
+        m_indexDirty = false;
+    else
+        remove(tmpPath.c_str());
+}
+
 XeTeXFontMgr::NameCollection*
 XeTeXFontMgr_FC::readNames(FcPattern* pat)
+{
+    IndexRecord* rec = findIndexRecord(pat);
+    if (rec != NULL)
+        return new NameCollection(rec->names);
+
+    NameCollection* names = readNamesFromFile(pat);
+    addIndexRecord(pat, names);
+    return names;
+}
+
+XeTeXFontMgr::NameCollection*
+XeTeXFontMgr_FC::readNamesFromFile(FcPattern* pat)
 {
     NameCollection* names = new NameCollection;
 
@@ -190,6 +477,18 @@ XeTeXFontMgr_FC::readNames(FcPattern* pat)
 void
 XeTeXFontMgr_FC::getOpSizeRecAndStyleFlags(Font* theFont)
 {
+    IndexRecord* rec = findIndexRecord(theFont->fontRef);
+    if (rec != NULL && rec->hasStyle) {
+        theFont->opSizeInfo = rec->opSizeInfo;
+        theFont->weight = rec->weight;
+        theFont->width = rec->width;
+        theFont->slant = rec->slant;
+        theFont->isReg = rec->isReg;
+        theFont->isBold = rec->isBold;
+        theFont->isItalic = rec->isItalic;
+        return;
+    }
+
     XeTeXFontMgr::getOpSizeRecAndStyleFlags(theFont);
 
     if (theFont->weight == 0 && theFont->width == 0) {
@@ -203,6 +502,18 @@ XeTeXFontMgr_FC::getOpSizeRecAndStyleFlags(Font* theFont)
         if (FcPatternGetInteger(pat, FC_SLANT, 0, &value) == FcResultMatch)
             theFont->slant = value;
     }
+
+    if (rec != NULL) {
+        rec->hasStyle = true;
+        rec->opSizeInfo = theFont->opSizeInfo;
+        rec->weight = theFont->weight;
+        rec->width = theFont->width;
+        rec->slant = theFont->slant;
+        rec->isReg = theFont->isReg;
+        rec->isBold = theFont->isBold;
+        rec->isItalic = theFont->isItalic;
+        m_indexDirty = true;
+    }
 }
 
 void
@@ -330,11 +641,15 @@ XeTeXFontMgr_FC::initialize()
     FcPatternDestroy(pat);
 
     cachedAll = false;
+
+    loadIndex();
 }
 
 void
 XeTeXFontMgr_FC::terminate()
 {
+    saveIndex();
+
     if (macRomanConv != NULL) {
         ucnv_close(macRomanConv);
         macRomanConv = NULL;
@@ -54,13 +54,50 @@ protected:
     virtual void                    searchForHostPlatformFonts(const std::string& name);
 
     virtual NameCollection*         readNames(FcPattern* pat);
+    NameCollection*                 readNamesFromFile(FcPattern* pat);
 
     std::string                     getPlatformFontDesc(PlatformFontRef font) const;
 
     void                            cacheFamilyMembers(const std::list<std::string>& familyNames);
 
+    // What we learned about one font file the last time we opened it, so
+    // that later runs can find fonts without opening every candidate.
+    struct IndexRecord {
+                        IndexRecord()
+                            : mtime(0), size(0), checked(false), hasStyle(false)
+                            , weight(0), width(0), slant(0)
+                            , isReg(false), isBold(false), isItalic(false)
+                            { opSizeInfo.designSize = 100;
+                              opSizeInfo.subFamilyID = 0;
+                              opSizeInfo.nameCode = 0;
+                              opSizeInfo.minSize = 0;
+                              opSizeInfo.maxSize = 0; }
+
+        long long       mtime;
+        long long       size;
+        bool            checked; // mtime and size verified against the file in this run
+        NameCollection  names;
+        bool            hasStyle; // the fields below are valid
+        OpSizeRec       opSizeInfo;
+        uint16_t        weight;
+        uint16_t        width;
+        int16_t         slant;
+        bool            isReg;
+        bool            isBold;
+        bool            isItalic;
+    };
+
+    static std::string              indexKey(FcPattern* pat);
+    IndexRecord*                    findIndexRecord(FcPattern* pat);
+    void                            addIndexRecord(FcPattern* pat, const NameCollection* names);
+    void                            loadIndex();
+    void                            saveIndex();
+
     FcFontSet*  allFonts;
     bool        cachedAll;
+
+    std::map<std::string,IndexRecord>   m_index; // keyed by indexKey()
+    bool                                m_indexDirty;
 };
 
 #endif  /* __XETEX_FONT_MGR_FC_H */
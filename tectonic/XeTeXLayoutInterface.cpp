@@ -70,24 +70,111 @@ struct XeTeXLayoutEngine_rec
     hb_buffer_t*    hbBuffer;
 };
 
+/*******************************************************************/
+/* Open-addressing table for the per-glyph lookups done in hpack   */
+/*******************************************************************/
+#include <vector>
+
+// Maps integer keys to small values with linear probing, so that a lookup
+// is a hash and (usually) a single cache line, rather than a walk down a
+// red-black tree as with std::map.
+template <typename V>
+class FlatTable
+{
+public:
+    FlatTable() : m_count(0) {}
+
+    const V* find(uint64_t key) const
+    {
+        if (m_count == 0)
+            return NULL;
+
+        size_t mask = m_slots.size() - 1;
+        for (size_t i = hash(key) & mask; m_slots[i].used; i = (i + 1) & mask) {
+            if (m_slots[i].key == key)
+                return &m_slots[i].value;
+        }
+        return NULL;
+    }
+
+    void insert(uint64_t key, const V& value)
+    {
+        // keep the load factor at or below one half
+        if (2 * (m_count + 1) > m_slots.size())
+            grow();
+
+        size_t mask = m_slots.size() - 1;
+        size_t i = hash(key) & mask;
+        while (m_slots[i].used && m_slots[i].key != key)
+            i = (i + 1) & mask;
+
+        if (!m_slots[i].used) {
+            m_slots[i].used = true;
+            m_slots[i].key = key;
+            m_count++;
+        }
+        m_slots[i].value = value;
+    }
+
+    void clear()
+    {
+        m_slots.clear();
+        m_count = 0;
+    }
+
+private:
+    struct Slot {
+        Slot() : key(0), used(false), value() {}
+        uint64_t key;
+        bool used;
+        V value;
+    };
+
+    std::vector<Slot> m_slots;
+    size_t m_count;
+
+    static size_t hash(uint64_t key)
+    {
+        // the finalizer from MurmurHash3
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return (size_t) key;
+    }
+
+    void grow()
+    {
+        std::vector<Slot> old;
+        old.swap(m_slots);
+        m_slots.resize(old.empty() ? 256 : 2 * old.size());
+        m_count = 0;
+
+        for (size_t i = 0; i < old.size(); i++) {
+            if (old[i].used)
+                insert(old[i].key, old[i].value);
+        }
+    }
+};
+
 /*******************************************************************/
 /* Glyph bounding box cache to speed up \XeTeXuseglyphmetrics mode */
 /*******************************************************************/
-#include <map>
 
 // key is combined value representing (font_id << 16) + glyph
 // value is glyph bounding box in TeX points
-static std::map<uint32_t,GlyphBBox> sGlyphBoxes;
+static FlatTable<GlyphBBox> sGlyphBoxes;
 
 int
 getCachedGlyphBBox(uint16_t fontID, uint16_t glyphID, GlyphBBox* bbox)
 {
     uint32_t key = ((uint32_t)fontID << 16) + glyphID;
-    std::map<uint32_t,GlyphBBox>::const_iterator i = sGlyphBoxes.find(key);
-    if (i == sGlyphBoxes.end()) {
+    const GlyphBBox* cached = sGlyphBoxes.find(key);
+    if (cached == NULL) {
         return 0;
     }
-    *bbox = i->second;
+    *bbox = *cached;
     return 1;
 }
 
@@ -95,7 +182,106 @@ void
 cacheGlyphBBox(uint16_t fontID, uint16_t glyphID, const GlyphBBox* bbox)
 {
     uint32_t key = ((uint32_t)fontID << 16) + glyphID;
-    sGlyphBoxes[key] = *bbox;
+    sGlyphBoxes.insert(key, *bbox);
+}
+
+void
+clearGlyphBBoxCache(void)
+{
+    // Font numbers are only meaningful within a single run.
+    sGlyphBoxes.clear();
+}
+
+/*******************************************************************/
+/* Shaping cache: the same words in the same font recur constantly */
+/*******************************************************************/
+#include <string>
+#include <unordered_map>
+
+// We start over rather than evicting when the cache gets this big.
+#define SHAPING_CACHE_MAX_ENTRIES 200000
+
+struct ShapingResult {
+    int glyphCount;
+    Fixed width;
+    std::vector<char> glyphInfo; // native_glyph_info_size bytes per glyph
+    std::vector<Fixed> advances;
+};
+
+// key is the font number followed by the UTF-16 text of the word
+static std::unordered_map<std::string, ShapingResult> sShapingCache;
+static uint64_t sShapingCacheHits = 0;
+static uint64_t sShapingCacheMisses = 0;
+
+static std::string
+shapingCacheKey(uint32_t fontID, const uint16_t* text, int len)
+{
+    std::string key(reinterpret_cast<const char*>(&fontID), sizeof(fontID));
+    key.append(reinterpret_cast<const char*>(text), len * sizeof(uint16_t));
+    return key;
+}
+
+int
+getCachedShaping(uint32_t fontID, const uint16_t* text, int len,
+                 int* glyphCount, Fixed* width, void** glyphInfo, Fixed** advances)
+{
+    std::unordered_map<std::string, ShapingResult>::const_iterator i =
+        sShapingCache.find(shapingCacheKey(fontID, text, len));
+
+    if (i == sShapingCache.end()) {
+        sShapingCacheMisses++;
+        return 0;
+    }
+
+    const ShapingResult& r = i->second;
+    sShapingCacheHits++;
+    *glyphCount = r.glyphCount;
+    *width = r.width;
+    *glyphInfo = NULL;
+    *advances = NULL;
+
+    if (r.glyphCount > 0) {
+        *glyphInfo = xmalloc(r.glyphInfo.size());
+        memcpy(*glyphInfo, r.glyphInfo.data(), r.glyphInfo.size());
+        *advances = (Fixed*) xmalloc(r.advances.size() * sizeof(Fixed));
+        memcpy(*advances, r.advances.data(), r.advances.size() * sizeof(Fixed));
+    }
+
+    return 1;
+}
+
+void
+cacheShaping(uint32_t fontID, const uint16_t* text, int len,
+             int glyphCount, Fixed width, const void* glyphInfo, const Fixed* advances)
+{
+    if (sShapingCache.size() >= SHAPING_CACHE_MAX_ENTRIES)
+        sShapingCache.clear();
+
+    ShapingResult& r = sShapingCache[shapingCacheKey(fontID, text, len)];
+    r.glyphCount = glyphCount;
+    r.width = width;
+
+    if (glyphCount > 0) {
+        const char* info = static_cast<const char*>(glyphInfo);
+        r.glyphInfo.assign(info, info + glyphCount * native_glyph_info_size);
+        r.advances.assign(advances, advances + glyphCount);
+    }
+}
+
+void
+clearShapingCache(void)
+{
+    // Font numbers are only meaningful within a single run.
+    sShapingCache.clear();
+    sShapingCacheHits = 0;
+    sShapingCacheMisses = 0;
+}
+
+void
+getShapingCacheStats(uint64_t* hits, uint64_t* misses)
+{
+    *hits = sShapingCacheHits;
+    *misses = sShapingCacheMisses;
 }
 
 /* The following code used to be in a file called "hz.cpp" and there's no
@@ -103,21 +289,27 @@ cacheGlyphBBox(uint16_t fontID, uint16_t glyphID, const GlyphBBox* bbox)
  * name so I wanted to get rid of it. The functions are invoked from the C
  * code. */
 
-typedef std::pair<int, unsigned int> GlyphId;
-typedef std::map<GlyphId, int>  ProtrusionFactor;
-ProtrusionFactor leftProt, rightProt;
+// key is combined value representing (font number << 32) + code
+typedef FlatTable<int> ProtrusionFactor;
+static ProtrusionFactor leftProt, rightProt;
+
+static inline uint64_t
+protrusionKey(int fontNum, unsigned int code)
+{
+    return ((uint64_t)(uint32_t)fontNum << 32) | code;
+}
 
 void
 set_cp_code(int fontNum, unsigned int code, int side, int value)
 {
-    GlyphId id(fontNum, code);
+    uint64_t id = protrusionKey(fontNum, code);
 
     switch (side) {
     case LEFT_SIDE:
-        leftProt[id] = value;
+        leftProt.insert(id, value);
         break;
     case RIGHT_SIDE:
-        rightProt[id] = value;
+        rightProt.insert(id, value);
         break;
     default:
         assert(0); // we should not reach here
@@ -128,8 +320,8 @@ set_cp_code(int fontNum, unsigned int code, int side, int value)
 int
 get_cp_code(int fontNum, unsigned int code, int side)
 {
-    GlyphId id(fontNum, code);
-    ProtrusionFactor *container;
+    uint64_t id = protrusionKey(fontNum, code);
+    const ProtrusionFactor *container;
 
     switch (side) {
     case LEFT_SIDE:
@@ -142,11 +334,21 @@ get_cp_code(int fontNum, unsigned int code, int side)
         assert(0); // we should not reach here
     }
 
-    ProtrusionFactor::iterator it = container->find(id);
-    if (it == container->end())
+    const int *value = container->find(id);
+    if (value == NULL)
         return 0;
 
-    return it->second;
+    return *value;
+}
+
+
+/* \lpcode and \rpcode settings are global, but only for the rest of the run;
+ * the next run may load a different font under the same number. */
+void
+clear_cp_codes(void)
+{
+    leftProt.clear();
+    rightProt.clear();
 }
 
 
@@ -159,6 +361,12 @@ terminate_font_manager()
     XeTeXFontMgr::Terminate();
 }
 
+void
+set_font_index_path(const char* path)
+{
+    XeTeXFontMgr::SetIndexPath(path);
+}
+
 XeTeXFont
 createFont(PlatformFontRef fontRef, Fixed pointSize)
 {
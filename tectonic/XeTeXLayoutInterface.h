@@ -43,8 +43,18 @@ extern char gPrefEngine;
 
 int getCachedGlyphBBox(uint16_t fontID, uint16_t glyphID, GlyphBBox* bbox);
 void cacheGlyphBBox(uint16_t fontID, uint16_t glyphID, const GlyphBBox* bbox);
+void clearGlyphBBoxCache(void);
+
+int getCachedShaping(uint32_t fontID, const uint16_t* text, int len,
+                     int* glyphCount, Fixed* width, void** glyphInfo, Fixed** advances);
+void cacheShaping(uint32_t fontID, const uint16_t* text, int len,
+                  int glyphCount, Fixed width, const void* glyphInfo, const Fixed* advances);
+void clearShapingCache(void);
+void resetSharedFontFaces(void);
+void getShapingCacheStats(uint64_t* hits, uint64_t* misses);
 
 void terminate_font_manager(void);
+void set_font_index_path(const char* path);
 
 XeTeXFont createFont(PlatformFontRef fontRef, Fixed pointSize);
 XeTeXFont createFontFromFile(const char* filename, int index, Fixed pointSize);
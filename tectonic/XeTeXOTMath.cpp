@@ -44,6 +44,186 @@ authorization from the copyright holders.
 #include "XeTeXLayoutInterface.h"
 #include "XeTeXFontInst.h"
 
+#define kMATH HB_TAG('M','A','T','H')
+
+/* Accessors for the decoded MATH data of a font (see XeTeXMathData); each
+ * goes to HarfBuzz only the first time a given item is asked for. */
+
+static const std::vector<hb_position_t>&
+mathConstants(XeTeXFontInst* font)
+{
+    XeTeXMathData& math = font->getMathData();
+
+    if (!math.constantsLoaded) {
+        int n = HB_OT_MATH_CONSTANT_RADICAL_DEGREE_BOTTOM_RAISE_PERCENT + 1;
+        math.constants.resize(n);
+        for (int i = 0; i < n; i++)
+            math.constants[i] = hb_ot_math_get_constant(font->getHbFont(), (hb_ot_math_constant_t) i);
+        math.constantsLoaded = true;
+    }
+
+    return math.constants;
+}
+
+static const std::vector<hb_ot_math_glyph_variant_t>&
+mathVariants(XeTeXFontInst* font, hb_codepoint_t g, int horiz)
+{
+    XeTeXMathData& math = font->getMathData();
+    uint32_t key = g * 2 + (horiz ? 1 : 0);
+
+    std::unordered_map<uint32_t,std::vector<hb_ot_math_glyph_variant_t> >::const_iterator i = math.variants.find(key);
+    if (i != math.variants.end())
+        return i->second;
+
+    hb_direction_t dir = horiz ? HB_DIRECTION_RTL : HB_DIRECTION_TTB;
+    std::vector<hb_ot_math_glyph_variant_t>& variants = math.variants[key];
+    unsigned int count = hb_ot_math_get_glyph_variants(font->getHbFont(), g, dir, 0, NULL, NULL);
+
+    if (count > 0) {
+        variants.resize(count);
+        hb_ot_math_get_glyph_variants(font->getHbFont(), g, dir, 0, &count, &variants[0]);
+        variants.resize(count);
+    }
+
+    return variants;
+}
+
+static const std::vector<hb_ot_math_glyph_part_t>&
+mathAssembly(XeTeXFontInst* font, hb_codepoint_t g, int horiz)
+{
+    XeTeXMathData& math = font->getMathData();
+    uint32_t key = g * 2 + (horiz ? 1 : 0);
+
+    std::unordered_map<uint32_t,std::vector<hb_ot_math_glyph_part_t> >::const_iterator i = math.assemblies.find(key);
+    if (i != math.assemblies.end())
+        return i->second;
+
+    hb_direction_t dir = horiz ? HB_DIRECTION_RTL : HB_DIRECTION_TTB;
+    std::vector<hb_ot_math_glyph_part_t>& parts = math.assemblies[key];
+    unsigned int count = hb_ot_math_get_glyph_assembly(font->getHbFont(), g, dir, 0, NULL, NULL, NULL);
+
+    if (count > 0) {
+        parts.resize(count);
+        hb_ot_math_get_glyph_assembly(font->getHbFont(), g, dir, 0, &count, &parts[0], NULL);
+        parts.resize(count);
+    }
+
+    return parts;
+}
+
+static inline unsigned int
+read16(const FT_Byte* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+/* Decode the MathKernInfo subtable. HarfBuzz (at least the versions we
+ * build against) has no API to get at the kern tables themselves, only at
+ * one value for a given height, so we read the MATH table ourselves. Device
+ * tables are ignored, as they are by HarfBuzz since we set no ppem. Returns
+ * false if the table is malformed. */
+static bool
+decodeMathKerns(const FT_Byte* table, FT_ULong length, std::unordered_map<uint32_t,XeTeXMathKern>& kerns)
+{
+    if (length < 10)
+        return false;
+
+    FT_ULong glyphInfo = read16(table + 6);
+    if (glyphInfo == 0)
+        return true;
+    if (glyphInfo + 8 > length)
+        return false;
+
+    FT_ULong kernInfoOffset = read16(table + glyphInfo + 6);
+    if (kernInfoOffset == 0)
+        return true;
+
+    FT_ULong kernInfo = glyphInfo + kernInfoOffset;
+    if (kernInfo + 4 > length)
+        return false;
+
+    FT_ULong coverage = kernInfo + read16(table + kernInfo);
+    unsigned int recordCount = read16(table + kernInfo + 2);
+    if (kernInfo + 4 + 8 * (FT_ULong) recordCount > length || coverage + 4 > length)
+        return false;
+
+    unsigned int format = read16(table + coverage);
+    unsigned int n = read16(table + coverage + 2);
+    FT_ULong entrySize = format == 1 ? 2 : 6;
+    if ((format != 1 && format != 2) || coverage + 4 + entrySize * n > length)
+        return false;
+
+    for (unsigned int i = 0; i < n; i++) {
+        const FT_Byte* entry = table + coverage + 4 + entrySize * i;
+        unsigned int first, last, index;
+
+        if (format == 1) {
+            first = last = read16(entry);
+            index = i;
+        } else {
+            first = read16(entry);
+            last = read16(entry + 2);
+            index = read16(entry + 4);
+        }
+
+        for (unsigned int g = first; g <= last && first <= last; g++, index++) {
+            if (index >= recordCount)
+                break;
+
+            const FT_Byte* record = table + kernInfo + 4 + 8 * index;
+
+            for (unsigned int side = 0; side < 4; side++) {
+                FT_ULong offset = read16(record + 2 * side);
+                if (offset == 0)
+                    continue;
+
+                FT_ULong mk = kernInfo + offset;
+                if (mk + 2 > length)
+                    return false;
+
+                unsigned int heightCount = read16(table + mk);
+                if (mk + 2 + 4 * (2 * (FT_ULong) heightCount + 1) > length)
+                    return false;
+
+                XeTeXMathKern& kern = kerns[g * 4 + side];
+                const FT_Byte* values = table + mk + 2;
+                kern.heights.resize(heightCount);
+                kern.values.resize(heightCount + 1);
+                for (unsigned int j = 0; j < heightCount; j++)
+                    kern.heights[j] = (int16_t) read16(values + 4 * j);
+                for (unsigned int j = 0; j <= heightCount; j++)
+                    kern.values[j] = (int16_t) read16(values + 4 * (heightCount + j));
+            }
+        }
+    }
+
+    return true;
+}
+
+static const XeTeXMathData&
+mathKerns(XeTeXFontInst* font)
+{
+    XeTeXMathData& math = font->getMathData();
+
+    if (!math.kernsLoaded) {
+        FT_Face face = font->getFtFace();
+        FT_ULong length = 0;
+
+        math.kernsValid = true;
+        if (FT_Load_Sfnt_Table(face, kMATH, 0, NULL, &length) == 0) {
+            FT_Byte* table = (FT_Byte*) xmalloc(length);
+            if (FT_Load_Sfnt_Table(face, kMATH, 0, table, &length) == 0)
+                math.kernsValid = decodeMathKerns(table, length, math.kerns);
+            free(table);
+        }
+        if (!math.kernsValid)
+            math.kerns.clear();
+        math.kernsLoaded = true;
+    }
+
+    return math;
+}
+
 int
 get_ot_math_constant(int f, int n)
 {
@@ -52,8 +232,9 @@ get_ot_math_constant(int f, int n)
 
     if (font_area[f] == OTGR_FONT_FLAG) {
         XeTeXFontInst *font = (XeTeXFontInst *) getFont((XeTeXLayoutEngine) font_layout_engine[f]);
-        hb_font_t *hbFont = font->getHbFont();
-        rval = hb_ot_math_get_constant(hbFont, constant);
+        const std::vector<hb_position_t>& constants = mathConstants(font);
+        if (n >= 0 && n < (int) constants.size())
+            rval = constants[n];
 
         /* scale according to font size, except the ones that are percentages */
         switch (constant) {
@@ -193,14 +374,11 @@ get_ot_math_variant(int f, int g, int v, int32_t* adv, int horiz)
 
     if (font_area[f] == OTGR_FONT_FLAG) {
         XeTeXFontInst *font = (XeTeXFontInst *) getFont((XeTeXLayoutEngine) font_layout_engine[f]);
-        hb_font_t *hbFont = font->getHbFont();
-        hb_ot_math_glyph_variant_t variant[1];
-        unsigned int count = 1;
-        hb_ot_math_get_glyph_variants(hbFont, g, horiz ? HB_DIRECTION_RTL : HB_DIRECTION_TTB, v, &count, variant);
-
-        if (count > 0) {
-            rval = variant->glyph;
-            *adv = D2Fix(font->unitsToPoints(variant->advance));
+        const std::vector<hb_ot_math_glyph_variant_t>& variants = mathVariants(font, g, horiz);
+
+        if (v >= 0 && v < (int) variants.size()) {
+            rval = variants[v].glyph;
+            *adv = D2Fix(font->unitsToPoints(variants[v].advance));
         }
     }
 
@@ -215,19 +393,13 @@ get_ot_assembly_ptr(int f, int g, int horiz)
 
     if (font_area[f] == OTGR_FONT_FLAG) {
         XeTeXFontInst *font = (XeTeXFontInst *) getFont((XeTeXLayoutEngine) font_layout_engine[f]);
-        hb_font_t* hbFont = font->getHbFont();
+        const std::vector<hb_ot_math_glyph_part_t>& parts = mathAssembly(font, g, horiz);
 
-        unsigned int count = hb_ot_math_get_glyph_assembly(hbFont, g,
-                                                           horiz ? HB_DIRECTION_RTL : HB_DIRECTION_TTB,
-                                                           0, NULL, NULL, NULL);
-
-        if (count > 0) {
+        if (parts.size() > 0) {
             GlyphAssembly *a = (GlyphAssembly *) xmalloc(sizeof(GlyphAssembly));
-            a->count = count;
-            a->parts = (hb_ot_math_glyph_part_t *) xmalloc(count * sizeof(hb_ot_math_glyph_part_t));
-            hb_ot_math_get_glyph_assembly(hbFont, g,
-                                          horiz ? HB_DIRECTION_RTL : HB_DIRECTION_TTB,
-                                          0, &a->count, a->parts, NULL);
+            a->count = parts.size();
+            a->parts = (hb_ot_math_glyph_part_t *) xmalloc(a->count * sizeof(hb_ot_math_glyph_part_t));
+            std::copy(parts.begin(), parts.end(), a->parts);
             rval = (void *) a;
         }
     }
@@ -253,8 +425,12 @@ get_ot_math_ital_corr(int f, int g)
 
     if (font_area[f] == OTGR_FONT_FLAG) {
         XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)font_layout_engine[f]);
-        hb_font_t* hbFont = font->getHbFont();
-        rval = hb_ot_math_get_glyph_italics_correction(hbFont, g);
+        std::unordered_map<uint32_t,hb_position_t>& cache = font->getMathData().italicsCorrections;
+        std::unordered_map<uint32_t,hb_position_t>::const_iterator i = cache.find(g);
+        if (i != cache.end())
+            rval = i->second;
+        else
+            rval = cache[g] = hb_ot_math_get_glyph_italics_correction(font->getHbFont(), g);
         rval = D2Fix(font->unitsToPoints(rval));
     }
 
@@ -268,8 +444,12 @@ get_ot_math_accent_pos(int f, int g)
 
     if (font_area[f] == OTGR_FONT_FLAG) {
         XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)font_layout_engine[f]);
-        hb_font_t* hbFont = font->getHbFont();
-        rval = hb_ot_math_get_glyph_top_accent_attachment(hbFont, g);
+        std::unordered_map<uint32_t,hb_position_t>& cache = font->getMathData().topAccentAttachments;
+        std::unordered_map<uint32_t,hb_position_t>::const_iterator i = cache.find(g);
+        if (i != cache.end())
+            rval = i->second;
+        else
+            rval = cache[g] = hb_ot_math_get_glyph_top_accent_attachment(font->getHbFont(), g);
         rval = D2Fix(font->unitsToPoints(rval));
     }
 
@@ -283,9 +463,12 @@ ot_min_connector_overlap(int f)
 
     if (font_area[f] == OTGR_FONT_FLAG) {
         XeTeXFontInst*  font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)font_layout_engine[f]);
-        hb_font_t* hbFont = font->getHbFont();
-        rval = hb_ot_math_get_min_connector_overlap(hbFont, HB_DIRECTION_RTL);
-        rval = D2Fix(font->unitsToPoints(rval));
+        XeTeXMathData& math = font->getMathData();
+        if (!math.minConnectorOverlapLoaded) {
+            math.minConnectorOverlap = hb_ot_math_get_min_connector_overlap(font->getHbFont(), HB_DIRECTION_RTL);
+            math.minConnectorOverlapLoaded = true;
+        }
+        rval = D2Fix(font->unitsToPoints(math.minConnectorOverlap));
     }
 
     return rval;
@@ -298,8 +481,20 @@ getMathKernAt(int f, int g, hb_ot_math_kern_t side, int height)
 
     if (font_area[f] == OTGR_FONT_FLAG) {
         XeTeXFontInst* font = (XeTeXFontInst*)getFont((XeTeXLayoutEngine)font_layout_engine[f]);
-        hb_font_t* hbFont = font->getHbFont();
-        rval = hb_ot_math_get_glyph_kerning(hbFont, g, side, height);
+        const XeTeXMathData& math = mathKerns(font);
+
+        if (!math.kernsValid) {
+            rval = hb_ot_math_get_glyph_kerning(font->getHbFont(), g, side, height);
+        } else {
+            std::unordered_map<uint32_t,XeTeXMathKern>::const_iterator i = math.kerns.find(g * 4 + side);
+            if (i != math.kerns.end()) {
+                // same rule as HarfBuzz: the first height that is >= the
+                // requested one selects the value; past the top, the last one
+                const XeTeXMathKern& kern = i->second;
+                size_t j = std::lower_bound(kern.heights.begin(), kern.heights.end(), height) - kern.heights.begin();
+                rval = kern.values[j];
+            }
+        }
     }
 
     return rval;
@@ -65,49 +65,116 @@ authorization from the copyright holders.
 #define kGPOS HB_TAG('G','P','O','S')
 
 
+/* Line-break iterators are expensive to create (ICU loads the break rules
+ * and dictionaries for the locale), and documents that switch
+ * \XeTeXlinebreaklocale back and forth between paragraphs would otherwise
+ * rebuild them constantly. So we keep the most recently used few, most
+ * recent first, keyed by locale name. A locale that ICU can't open is cached
+ * with the fallback iterator and the error, so that its diagnostic can be
+ * repeated whenever a run switches to it, as if it had been opened afresh. */
+#define BRK_ITER_CACHE_SIZE 8
+
+static struct {
+    char* locale;
+    UBreakIterator* iter;
+    UErrorCode failure;
+} brkIterCache[BRK_ITER_CACHE_SIZE];
+
 static UBreakIterator* brkIter = NULL;
-static int brkLocaleStrNum = 0;
+static bool brkIterUsedThisRun = false;
+
+uint64_t linebreak_iterators_opened = 0;
+
+static void
+report_linebreak_locale_failure(const char* locale, UErrorCode status)
+{
+    begin_diagnostic();
+    print_nl('E');
+    print_c_string("rror ");
+    print_int(status);
+    print_c_string(" creating linebreak iterator for locale `");
+    print_c_string(locale);
+    print_c_string("'; trying default locale `en_us'.");
+    end_diagnostic(1);
+}
+
+static UBreakIterator*
+open_linebreak_iterator(const char* locale, UErrorCode* status, UErrorCode* failure)
+{
+    UBreakIterator* iter;
+
+    linebreak_iterators_opened++;
+    *failure = U_ZERO_ERROR;
+    iter = ubrk_open(UBRK_LINE, locale, NULL, 0, status);
+    if (U_FAILURE(*status)) {
+        report_linebreak_locale_failure(locale, *status);
+        *failure = *status;
+        if (iter != NULL)
+            ubrk_close(iter);
+        *status = U_ZERO_ERROR;
+        iter = ubrk_open(UBRK_LINE, "en_us", NULL, 0, status);
+    }
+
+    return iter;
+}
+
+/* Called at the start of each run. The cached iterators are kept. */
+void
+linebreak_reset(void)
+{
+    brkIterUsedThisRun = false;
+    linebreak_iterators_opened = 0;
+}
 
 void
 linebreak_start(int f, int32_t localeStrNum, uint16_t* text, int32_t textLength)
 {
     UErrorCode status = U_ZERO_ERROR;
+    UErrorCode failure;
     char* locale = (char*)gettexstring(localeStrNum);
+    int i;
 
     if (font_area[f] == OTGR_FONT_FLAG && streq_ptr(locale, "G")) {
         XeTeXLayoutEngine engine = (XeTeXLayoutEngine) font_layout_engine[f];
-        if (initGraphiteBreaking(engine, text, textLength))
+        if (initGraphiteBreaking(engine, text, textLength)) {
             /* user asked for Graphite line breaking and the font supports it */
+            free(locale);
             return;
+        }
     }
 
-    if ((localeStrNum != brkLocaleStrNum) && (brkIter != NULL)) {
-        ubrk_close(brkIter);
-        brkIter = NULL;
-    }
-
-    if (brkIter == NULL) {
-        brkIter = ubrk_open(UBRK_LINE, locale, NULL, 0, &status);
-        if (U_FAILURE(status)) {
-            begin_diagnostic();
-            print_nl('E');
-            print_c_string("rror ");
-            print_int(status);
-            print_c_string(" creating linebreak iterator for locale `");
-            print_c_string(locale);
-            print_c_string("'; trying default locale `en_us'.");
-            end_diagnostic(1);
-            if (brkIter != NULL)
-                ubrk_close(brkIter);
-            status = U_ZERO_ERROR;
-            brkIter = ubrk_open(UBRK_LINE, "en_us", NULL, 0, &status);
-        }
+    for (i = 0; i < BRK_ITER_CACHE_SIZE && brkIterCache[i].locale != NULL; i++) {
+        if (streq_ptr(brkIterCache[i].locale, locale))
+            break;
+    }
+
+    if (i < BRK_ITER_CACHE_SIZE && brkIterCache[i].locale != NULL) {
+        /* found it; switching to a locale that failed reports it again */
         free(locale);
-        brkLocaleStrNum = localeStrNum;
+        locale = brkIterCache[i].locale;
+        brkIter = brkIterCache[i].iter;
+        failure = brkIterCache[i].failure;
+        if (failure != U_ZERO_ERROR && (i != 0 || !brkIterUsedThisRun))
+            report_linebreak_locale_failure(locale, failure);
+    } else {
+        brkIter = open_linebreak_iterator(locale, &status, &failure);
+        if (brkIter == NULL)
+            _tt_abort ("failed to create linebreak iterator, status=%d", (int) status);
+
+        if (i == BRK_ITER_CACHE_SIZE) {
+            /* evict the least recently used */
+            i--;
+            free(brkIterCache[i].locale);
+            ubrk_close(brkIterCache[i].iter);
+        }
     }
 
-    if (brkIter == NULL)
-        _tt_abort ("failed to create linebreak iterator, status=%d", (int) status);
+    /* move to the front */
+    memmove(&brkIterCache[1], &brkIterCache[0], i * sizeof(brkIterCache[0]));
+    brkIterCache[0].locale = locale;
+    brkIterCache[0].iter = brkIter;
+    brkIterCache[0].failure = failure;
+    brkIterUsedThisRun = true;
 
     ubrk_setText(brkIter, (UChar*) text, textLength, &status);
 }
@@ -182,6 +249,61 @@ print_chars(const unsigned short* str, int len)
         print_char(*(str++));
 }
 
+/* Compiling a TECkit mapping (decompressing it and setting up the pass
+ * pipeline) is repeated for every font that names it, and a document will
+ * typically load the same mapping for many fonts and sizes. Converters reset
+ * themselves after each complete conversion, so one converter per distinct
+ * mapping can be shared. They are keyed by the digest of the compiled
+ * mapping rather than its name, since the same name may resolve to
+ * different files as the search path changes. */
+typedef struct mapping_cache_entry {
+    struct mapping_cache_entry* next;
+    char digest[16];
+    char byteMapping;
+    TECkit_Converter cnv;
+} mapping_cache_entry;
+
+static mapping_cache_entry* mapping_cache = NULL;
+
+static TECkit_Converter
+get_cached_converter(Byte* mapping, size_t mappingSize, char byteMapping)
+{
+    mapping_cache_entry* entry;
+    char digest[16];
+
+    ttstub_get_data_md5((const char*) mapping, mappingSize, digest);
+
+    for (entry = mapping_cache; entry != NULL; entry = entry->next) {
+        if (entry->byteMapping == byteMapping && memcmp(entry->digest, digest, sizeof(digest)) == 0)
+            return entry->cnv;
+    }
+
+    entry = xmalloc(sizeof(mapping_cache_entry));
+    memcpy(entry->digest, digest, sizeof(digest));
+    entry->byteMapping = byteMapping;
+    entry->cnv = 0;
+
+    if (byteMapping != 0)
+        TECkit_CreateConverter(mapping, mappingSize,
+                               false,
+                               UTF16_NATIVE, kForm_Bytes,
+                               &entry->cnv);
+    else
+        TECkit_CreateConverter(mapping, mappingSize,
+                               true,
+                               UTF16_NATIVE, UTF16_NATIVE,
+                               &entry->cnv);
+
+    if (entry->cnv == NULL) {
+        free(entry);
+        return NULL;
+    }
+
+    entry->next = mapping_cache;
+    mapping_cache = entry;
+    return entry->cnv;
+}
+
 static void*
 load_mapping_file(const char* s, const char* e, char byteMapping)
 {
@@ -204,16 +326,9 @@ load_mapping_file(const char* s, const char* e, char byteMapping)
 
         ttstub_input_close(map);
 
-        if (byteMapping != 0)
-            TECkit_CreateConverter(mapping, mappingSize,
-                                   false,
-                                   UTF16_NATIVE, kForm_Bytes,
-                                   &cnv);
-        else
-            TECkit_CreateConverter(mapping, mappingSize,
-                                   true,
-                                   UTF16_NATIVE, UTF16_NATIVE,
-                                   &cnv);
+        /* The converter keeps its own copy of the table. */
+        cnv = get_cached_converter(mapping, mappingSize, byteMapping);
+        free(mapping);
 
         if (cnv == NULL)
             font_mapping_warning(buffer, strlen(buffer), 2); /* not loadable */
@@ -1308,16 +1423,18 @@ retry:
 
     switch (status) {
         case kStatus_NoError:
-            txtPtr = (UniChar*)mapped_text;
             return outUsed / sizeof(UniChar);
 
         case kStatus_OutputBufferFull:
+            /* The converter is shared between fonts, so leave it clean. */
+            TECkit_ResetConverter(cnv);
             outLength += (txtLen * sizeof(UniChar)) + 32;
             free(mapped_text);
             mapped_text = xmalloc(outLength);
             goto retry;
 
         default:
+            TECkit_ResetConverter(cnv);
             return 0;
     }
 }
@@ -1530,6 +1647,149 @@ store_justified_native_glyphs(void* pNode)
     }
 }
 
+/* True if the text contains anything that could give it a right-to-left
+ * level: RTL letters, directional controls, or (conservatively) any
+ * supplementary-plane character. Plain Latin text never gets near these. */
+static bool
+text_may_need_bidi(const uint16_t* txtPtr, int txtLen)
+{
+    int i;
+
+    for (i = 0; i < txtLen; ++i) {
+        uint16_t c = txtPtr[i];
+
+        if (c < 0x0590)
+            continue;
+        if (c <= 0x08FF)
+            return true;
+        if (c == 0x200F || (c >= 0x202A && c <= 0x202E) || (c >= 0x2066 && c <= 0x2069))
+            return true;
+        if (c >= 0xD800 && c <= 0xDFFF)
+            return true;
+        if (c >= 0xFB1D && c <= 0xFDFF)
+            return true;
+        if (c >= 0xFE70 && c <= 0xFEFF)
+            return true;
+    }
+
+    return false;
+}
+
+/* Scratch space for shape_native_word, kept between calls. The run_*
+ * arrays hold the output of one layoutChars call; the word_* arrays
+ * accumulate the whole word across its direction runs. */
+static int run_buf_size = 0;
+static uint32_t* run_glyphs = NULL;
+static FloatPoint* run_positions = NULL;
+static float* run_advances = NULL;
+
+static int word_buf_size = 0;
+static FixedPoint* word_locations = NULL;
+static uint16_t* word_glyph_ids = NULL;
+static Fixed* word_advances = NULL;
+
+static void
+grow_run_buffers(int n)
+{
+    if (n + 1 <= run_buf_size)
+        return;
+
+    run_buf_size = n + 1 > 2 * run_buf_size ? n + 1 : 2 * run_buf_size;
+    run_glyphs = xrealloc(run_glyphs, run_buf_size * sizeof(uint32_t));
+    run_positions = xrealloc(run_positions, run_buf_size * sizeof(FloatPoint));
+    run_advances = xrealloc(run_advances, run_buf_size * sizeof(float));
+}
+
+static void
+grow_word_buffers(int n)
+{
+    if (n <= word_buf_size)
+        return;
+
+    word_buf_size = n > 2 * word_buf_size ? n : 2 * word_buf_size;
+    word_locations = xrealloc(word_locations, word_buf_size * sizeof(FixedPoint));
+    word_glyph_ids = xrealloc(word_glyph_ids, word_buf_size * sizeof(uint16_t));
+    word_advances = xrealloc(word_advances, word_buf_size * sizeof(Fixed));
+}
+
+/* Shape a native word with HarfBuzz, splitting it into BiDi runs as needed.
+ * The results are returned in freshly allocated arrays, before letter
+ * spacing is applied, so that they can be stored in the shaping cache. */
+static void
+shape_native_word(XeTeXLayoutEngine engine, uint16_t* txtPtr, int txtLen,
+                  int* glyphCountOut, Fixed* widthOut, void** glyphInfoOut, Fixed** advancesOut)
+{
+    static UBiDi* pBiDi = NULL;
+    UBiDiDirection dir;
+    int nRuns = 1;
+    int runIndex, i;
+    int totalGlyphCount = 0;
+    double x = 0.0, y = 0.0;
+    void* glyph_info = NULL;
+    Fixed* glyphAdvances = NULL;
+
+    /* need to find direction runs within the text, and call layoutChars
+       separately for each; but text that can only come out left-to-right
+       doesn't need the full BiDi analysis */
+
+    if (getDefaultDirection(engine) == UBIDI_DEFAULT_LTR && !text_may_need_bidi(txtPtr, txtLen)) {
+        dir = UBIDI_LTR;
+    } else {
+        UErrorCode errorCode = U_ZERO_ERROR;
+
+        if (pBiDi == NULL)
+            pBiDi = ubidi_open();
+
+        ubidi_setPara(pBiDi, (const UChar*) txtPtr, txtLen, getDefaultDirection(engine), NULL, &errorCode);
+        dir = ubidi_getDirection(pBiDi);
+        if (dir == UBIDI_MIXED)
+            nRuns = ubidi_countRuns(pBiDi, &errorCode);
+    }
+
+    for (runIndex = 0; runIndex < nRuns; ++runIndex) {
+        int32_t logicalStart = 0, length = txtLen;
+        UBiDiDirection runDir = dir;
+        int nGlyphs;
+
+        if (dir == UBIDI_MIXED)
+            runDir = ubidi_getVisualRun(pBiDi, runIndex, &logicalStart, &length);
+
+        nGlyphs = layoutChars(engine, txtPtr, logicalStart, length, txtLen, (runDir == UBIDI_RTL));
+
+        grow_run_buffers(nGlyphs);
+        getGlyphs(engine, run_glyphs);
+        getGlyphAdvances(engine, run_advances);
+        getGlyphPositions(engine, run_positions);
+
+        grow_word_buffers(totalGlyphCount + nGlyphs);
+        for (i = 0; i < nGlyphs; ++i) {
+            word_glyph_ids[totalGlyphCount] = run_glyphs[i];
+            word_locations[totalGlyphCount].x = D2Fix(run_positions[i].x + x);
+            word_locations[totalGlyphCount].y = D2Fix(run_positions[i].y + y);
+            word_advances[totalGlyphCount] = D2Fix(run_advances[i]);
+            ++totalGlyphCount;
+        }
+        x += run_positions[nGlyphs].x;
+        y += run_positions[nGlyphs].y;
+    }
+
+    if (totalGlyphCount > 0) {
+        glyph_info = xmalloc(totalGlyphCount * native_glyph_info_size);
+        memcpy(glyph_info, word_locations, totalGlyphCount * sizeof(FixedPoint));
+        memcpy((FixedPoint*) glyph_info + totalGlyphCount, word_glyph_ids, totalGlyphCount * sizeof(uint16_t));
+        glyphAdvances = xmalloc(totalGlyphCount * sizeof(Fixed));
+        memcpy(glyphAdvances, word_advances, totalGlyphCount * sizeof(Fixed));
+    } else {
+        x = 0.0;
+    }
+
+    *widthOut = D2Fix(x);
+    *glyphCountOut = totalGlyphCount;
+    *glyphInfoOut = glyph_info;
+    *advancesOut = glyphAdvances;
+}
+
+
 void
 measure_native_node(void* pNode, int use_glyph_metrics)
 {
@@ -1550,119 +1810,23 @@ measure_native_node(void* pNode, int use_glyph_metrics)
 
         XeTeXLayoutEngine engine = (XeTeXLayoutEngine)(font_layout_engine[f]);
 
-        FixedPoint* locations = NULL;
-        uint16_t* glyphIDs;
-        Fixed* glyphAdvances = NULL;
-        int totalGlyphCount = 0;
-
-        /* need to find direction runs within the text, and call layoutChars separately for each */
-
-        UBiDiDirection dir;
-        void* glyph_info = 0;
-        static FloatPoint* positions = 0;
-        static float* advances = 0;
-        static uint32_t* glyphs = 0;
-
-        UBiDi* pBiDi = ubidi_open();
-
-        UErrorCode errorCode = U_ZERO_ERROR;
-        ubidi_setPara(pBiDi, (const UChar*) txtPtr, txtLen, getDefaultDirection(engine), NULL, &errorCode);
-
-        dir = ubidi_getDirection(pBiDi);
-        if (dir == UBIDI_MIXED) {
-            /* we actually do the layout twice here, once to count glyphs and then again to get them;
-               which is inefficient, but i figure that MIXED is a relatively rare occurrence, so i can't be
-               bothered to deal with the memory reallocation headache of doing it differently
-            */
-            int nRuns = ubidi_countRuns(pBiDi, &errorCode);
-            double width = 0;
-            int i, runIndex;
-            int32_t logicalStart, length;
-            for (runIndex = 0; runIndex < nRuns; ++runIndex) {
-                dir = ubidi_getVisualRun(pBiDi, runIndex, &logicalStart, &length);
-                totalGlyphCount += layoutChars(engine, txtPtr, logicalStart, length, txtLen, (dir == UBIDI_RTL));
-            }
-
-            if (totalGlyphCount > 0) {
-                double x, y;
-                glyph_info = xcalloc(totalGlyphCount, native_glyph_info_size);
-                locations = (FixedPoint*)glyph_info;
-                glyphIDs = (uint16_t*)(locations + totalGlyphCount);
-                glyphAdvances = xcalloc(totalGlyphCount, sizeof(Fixed));
-                totalGlyphCount = 0;
-
-                x = y = 0.0;
-                for (runIndex = 0; runIndex < nRuns; ++runIndex) {
-                    int nGlyphs;
-                    dir = ubidi_getVisualRun(pBiDi, runIndex, &logicalStart, &length);
-                    nGlyphs = layoutChars(engine, txtPtr, logicalStart, length, txtLen,
-                                            (dir == UBIDI_RTL));
-
-                    glyphs = xcalloc(nGlyphs, sizeof(uint32_t));
-                    positions = xcalloc(nGlyphs + 1, sizeof(FloatPoint));
-                    advances = xcalloc(nGlyphs, sizeof(float));
-
-                    getGlyphs(engine, glyphs);
-                    getGlyphAdvances(engine, advances);
-                    getGlyphPositions(engine, positions);
-
-                    for (i = 0; i < nGlyphs; ++i) {
-                        glyphIDs[totalGlyphCount] = glyphs[i];
-                        locations[totalGlyphCount].x = D2Fix(positions[i].x + x);
-                        locations[totalGlyphCount].y = D2Fix(positions[i].y + y);
-                        glyphAdvances[totalGlyphCount] = D2Fix(advances[i]);
-                        ++totalGlyphCount;
-                    }
-                    x += positions[nGlyphs].x;
-                    y += positions[nGlyphs].y;
-
-                    free(glyphs);
-                    free(positions);
-                    free(advances);
-                }
-                width = x;
-            }
-
-            node_width(node) = D2Fix(width);
-            native_glyph_count(node) = totalGlyphCount;
-            native_glyph_info_ptr(node) = glyph_info;
-        } else {
-            double width = 0;
-            totalGlyphCount = layoutChars(engine, txtPtr, 0, txtLen, txtLen, (dir == UBIDI_RTL));
-
-            glyphs = xcalloc(totalGlyphCount, sizeof(uint32_t));
-            positions = xcalloc(totalGlyphCount + 1, sizeof(FloatPoint));
-            advances = xcalloc(totalGlyphCount, sizeof(float));
-
-            getGlyphs(engine, glyphs);
-            getGlyphAdvances(engine, advances);
-            getGlyphPositions(engine, positions);
-
-            if (totalGlyphCount > 0) {
-                int i;
-                glyph_info = xcalloc(totalGlyphCount, native_glyph_info_size);
-                locations = (FixedPoint*)glyph_info;
-                glyphIDs = (uint16_t*)(locations + totalGlyphCount);
-                glyphAdvances = xcalloc(totalGlyphCount, sizeof(Fixed));
-                for (i = 0; i < totalGlyphCount; ++i) {
-                    glyphIDs[i] = glyphs[i];
-                    glyphAdvances[i] = D2Fix(advances[i]);
-                    locations[i].x = D2Fix(positions[i].x);
-                    locations[i].y = D2Fix(positions[i].y);
-                }
-                width = positions[totalGlyphCount].x;
-            }
-
-            node_width(node) = D2Fix(width);
-            native_glyph_count(node) = totalGlyphCount;
-            native_glyph_info_ptr(node) = glyph_info;
-
-            free(glyphs);
-            free(positions);
-            free(advances);
+        FixedPoint* locations;
+        Fixed* glyphAdvances;
+        int totalGlyphCount;
+        Fixed width;
+        void* glyph_info;
+
+        /* The shaping depends only on the font (which fixes the features,
+           script, language and default direction) and the text. */
+        if (!getCachedShaping(f, txtPtr, txtLen, &totalGlyphCount, &width, &glyph_info, &glyphAdvances)) {
+            shape_native_word(engine, txtPtr, txtLen, &totalGlyphCount, &width, &glyph_info, &glyphAdvances);
+            cacheShaping(f, txtPtr, txtLen, totalGlyphCount, width, glyph_info, glyphAdvances);
         }
 
-        ubidi_close(pBiDi);
+        locations = (FixedPoint*) glyph_info;
+        node_width(node) = width;
+        native_glyph_count(node) = totalGlyphCount;
+        native_glyph_info_ptr(node) = glyph_info;
 
 
         if (font_letter_space[f] != 0) {
@@ -103,6 +103,9 @@ extern const CFStringRef kXeTeXEmboldenAttributeName;
 
 BEGIN_EXTERN_C
 
+extern uint64_t linebreak_iterators_opened;
+
+void linebreak_reset(void);
 void linebreak_start(int f, int32_t localeStrNum, uint16_t* text, int32_t textLength);
 int linebreak_next(void);
 int get_encoding_mode_and_info(int32_t* info);
@@ -159,6 +162,7 @@ int find_pic_file(char** path, real_rect* bounds, int pdfBoxType, int page);
 int maketexstring(const char* s);
 void set_cp_code(int fontNum, unsigned int code, int side, int value);
 int get_cp_code(int fontNum, unsigned int code, int side);
+void clear_cp_codes(void);
 double Fix2D(Fixed f);
 Fixed D2Fix(double d);
 
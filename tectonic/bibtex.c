@@ -7289,6 +7289,28 @@ initialize(const char *aux_file_name)
 }
 
 
+/* Tell the driver how much of our big arrays this run used. */
+static void
+report_metrics(void)
+{
+    hash_loc k;
+    int32_t n_used = 0;
+
+    for (k = hash_base; k <= hash_max; k++) {
+        if (hash_text[k] != 0)
+            n_used++;
+    }
+
+    ttstub_report_metric("str_pool_used", (uint64_t) pool_ptr);
+    ttstub_report_metric("str_pool_size", (uint64_t) pool_size);
+    ttstub_report_metric("strings_used", (uint64_t) str_ptr);
+    ttstub_report_metric("hash_entries_used", (uint64_t) n_used);
+    ttstub_report_metric("cites_used", (uint64_t) num_cites);
+    ttstub_report_metric("field_slots_used", (uint64_t) field_ptr);
+    ttstub_report_metric("wiz_functions_used", (uint64_t) wiz_def_ptr);
+}
+
+
 tt_history_t
 bibtex_main(const char *aux_file_name)
 {
@@ -7433,6 +7455,7 @@ close_up_shop:
         break;
     }
 
+    report_metrics();
     ttstub_output_close (log_file);
     return history;
 }
@@ -46,6 +46,17 @@
  * configurable, but we hardcode it. */
 #define MEM_TOP 4999999
 
+/* Outside of INITEX, the one-word region of "mem" may grow upward past
+ * MEM_TOP (as in tex.web, where mem_max >= mem_top) up to this limit. The
+ * space is reserved at startup but only backed by memory once touched. */
+#define SUP_MAIN_MEMORY 256000000
+
+/* Outside of INITEX, the variable-size region may also use this many words
+ * below MEM_BOT (web2c's extra_mem_bot), so that boxes and glue are not
+ * limited to the space under the one-word region. Pointers into it are
+ * negative, which is fine as long as they stay above MIN_HALFWORD. */
+#define EXTRA_MEM_BOT 128000000
+
 /* fixed locations in the "mem" array */
 #define PAGE_INS_HEAD MEM_TOP
 #define CONTRIB_HEAD (MEM_TOP - 1)
@@ -346,6 +357,9 @@
 #define PIC_NODE 43 /* not to be confused with PIC_FILE_CODE = 41! */
 #define PDF_NODE 44 /* not to be confused with PDF_FILE_CODE = 42! */
 
+/* get_node() recycles nodes smaller than this through per-size free lists */
+#define NODE_SIZE_CLASSES 16
+
 #define IF_NODE_SIZE 2
 #define PASSIVE_NODE_SIZE 2
 #define POINTER_NODE_SIZE 2
@@ -57,11 +57,56 @@ tex_simple_main(tt_bridge_api_t *api, char *dump_name, char *input_file_name)
     tectonic_global_bridge = api;
 
     if (setjmp(jump_buffer)) {
+        /* Whatever the engine printed before aborting belongs in the log. */
+        flush_output_buffers();
         tectonic_global_bridge = NULL;
         return HISTORY_FATAL_ERROR;
     }
 
     rv = tt_run_engine(dump_name, input_file_name);
+    flush_output_buffers();
+    tectonic_global_bridge = NULL;
+    return rv;
+}
+
+
+int
+tex_preload_main(tt_bridge_api_t *api, char *dump_name)
+{
+    int rv;
+
+    tectonic_global_bridge = api;
+
+    if (setjmp(jump_buffer)) {
+        /* Whatever the engine printed before aborting belongs in the log. */
+        flush_output_buffers();
+        tectonic_global_bridge = NULL;
+        return HISTORY_FATAL_ERROR;
+    }
+
+    rv = tt_preload_engine(dump_name);
+    flush_output_buffers();
+    tectonic_global_bridge = NULL;
+    return rv;
+}
+
+
+int
+tex_preloaded_main(tt_bridge_api_t *api, char *input_file_name)
+{
+    int rv;
+
+    tectonic_global_bridge = api;
+
+    if (setjmp(jump_buffer)) {
+        /* Whatever the engine printed before aborting belongs in the log. */
+        flush_output_buffers();
+        tectonic_global_bridge = NULL;
+        return HISTORY_FATAL_ERROR;
+    }
+
+    rv = tt_run_preloaded_engine(input_file_name);
+    flush_output_buffers();
     tectonic_global_bridge = NULL;
     return rv;
 }
@@ -229,6 +274,12 @@ ttstub_input_read(rust_input_handle_t handle, char *data, size_t len)
     return TGB->input_read(TGB->context, handle, data, len);
 }
 
+ssize_t
+ttstub_input_read_partial(rust_input_handle_t handle, char *data, size_t len)
+{
+    return TGB->input_read_partial(TGB->context, handle, data, len);
+}
+
 int
 ttstub_input_getc(rust_input_handle_t handle)
 {
@@ -246,3 +297,21 @@ ttstub_input_close(rust_input_handle_t handle)
 {
     return TGB->input_close(TGB->context, handle);
 }
+
+void
+ttstub_report_metric(char const *name, uint64_t value)
+{
+    TGB->report_metric(TGB->context, name, value);
+}
+
+void
+ttstub_trace_begin(char const *name, char const *detail)
+{
+    TGB->trace_begin(TGB->context, name, detail);
+}
+
+void
+ttstub_trace_end(void)
+{
+    TGB->trace_end(TGB->context);
+}
@@ -70,9 +70,14 @@ typedef struct tt_bridge_api_t {
     size_t (*input_get_size)(void *context, rust_input_handle_t handle);
     size_t (*input_seek)(void *context, rust_input_handle_t handle, ssize_t offset, int whence);
     ssize_t (*input_read)(void *context, rust_input_handle_t handle, char *data, size_t len);
+    ssize_t (*input_read_partial)(void *context, rust_input_handle_t handle, char *data, size_t len);
     int (*input_getc)(void *context, rust_input_handle_t handle);
     int (*input_ungetc)(void *context, rust_input_handle_t handle, int ch);
     int (*input_close)(void *context, rust_input_handle_t handle);
+
+    void (*report_metric)(void *context, char const *name, uint64_t value);
+    void (*trace_begin)(void *context, char const *name, char const *detail);
+    void (*trace_end)(void *context);
 } tt_bridge_api_t;
 
 
@@ -83,6 +88,8 @@ BEGIN_EXTERN_C
 
 const char *tt_get_error_message(void);
 int tex_simple_main(tt_bridge_api_t *api, char *dump_name, char *input_file_name);
+int tex_preload_main(tt_bridge_api_t *api, char *dump_name);
+int tex_preloaded_main(tt_bridge_api_t *api, char *input_file_name);
 int dvipdfmx_simple_main(tt_bridge_api_t *api, char *dviname, char *pdfname, bool compress, bool deterministic_tags);
 int bibtex_simple_main(tt_bridge_api_t *api, char *aux_file_name);
 
@@ -113,10 +120,15 @@ rust_input_handle_t ttstub_input_open_primary (void);
 size_t ttstub_input_get_size (rust_input_handle_t handle);
 size_t ttstub_input_seek (rust_input_handle_t handle, ssize_t offset, int whence);
 ssize_t ttstub_input_read (rust_input_handle_t handle, char *data, size_t len);
+ssize_t ttstub_input_read_partial (rust_input_handle_t handle, char *data, size_t len);
 int ttstub_input_getc (rust_input_handle_t handle);
 int ttstub_input_ungetc (rust_input_handle_t handle, int ch);
 int ttstub_input_close (rust_input_handle_t handle);
 
+void ttstub_report_metric (char const *name, uint64_t value);
+void ttstub_trace_begin (char const *name, char const *detail);
+void ttstub_trace_end (void);
+
 END_EXTERN_C
 
 #endif /* not TECTONIC_CORE_BRIDGE_H */
@@ -332,6 +332,8 @@ CIDFont_dofont (CIDFont *font)
       dpx_message("[%s]", font->fontname);
   }
 
+  ttstub_trace_begin("embed_font", font->ident);
+
   switch (font->subtype) {
   case CIDFONT_TYPE0:
     if(__verbose)
@@ -352,6 +354,8 @@ CIDFont_dofont (CIDFont *font)
     _tt_abort("%s: Unknown CIDFontType %d.", CIDFONT_DEBUG_STR, font->subtype);
     break;
   }
+
+  ttstub_trace_end();
 }
 
 
@@ -282,6 +282,7 @@ do_dvi_pages (PageRange *page_ranges, unsigned int num_page_ranges)
 {
   int      page_no, step;
   unsigned int page_count, i;
+  char     page_name[16];
   double   page_width, page_height;
   double   init_paper_width, init_paper_height;
   pdf_rect mediabox;
@@ -336,7 +337,10 @@ do_dvi_pages (PageRange *page_ranges, unsigned int num_page_ranges)
           mediabox.ury = page_height;
           pdf_doc_set_mediabox(page_count+1, &mediabox);
         }
+        snprintf(page_name, sizeof(page_name), "%d", page_no + 1);
+        ttstub_trace_begin("dvi_do_page", page_name);
         dvi_do_page(page_height, x_offset, y_offset);
+        ttstub_trace_end();
         page_count++;
         dpx_message("]");
       }
@@ -516,7 +520,9 @@ dvipdfmx_main (
   /* Order of close... */
   pdf_close_device  ();
   /* pdf_close_document flushes XObject (image) and other resources. */
+  ttstub_trace_begin("pdf_close_document", NULL);
   pdf_close_document();
+  ttstub_trace_end();
 
   pdf_close_fontmaps(); /* pdf_font may depend on fontmap. */
 
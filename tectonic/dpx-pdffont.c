@@ -508,6 +508,11 @@ pdf_close_fonts (void)
       }
     }
 
+    /* Type 0 fonts are embedded later, by their descendant CIDFonts in
+     * CIDFont_dofont(), which gets its own span. */
+    if (font->subtype != PDF_FONT_FONTTYPE_TYPE0)
+      ttstub_trace_begin("embed_font", pdf_font_get_ident(font));
+
     /* Must come before load_xxx */
     try_load_ToUnicode_CMap(font);
 
@@ -541,6 +546,9 @@ pdf_close_fonts (void)
       break;
     }
 
+    if (font->subtype != PDF_FONT_FONTTYPE_TYPE0)
+      ttstub_trace_end();
+
     if (font->encoding_id >= 0 && font->subtype != PDF_FONT_FONTTYPE_TYPE0)
       pdf_encoding_add_usedchars(font->encoding_id, font->usedchars);
 
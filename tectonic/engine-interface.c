@@ -7,6 +7,8 @@
 #include "internals.h"
 #include "xetexd.h"
 #include "XeTeX_ext.h"
+#include "XeTeXLayoutInterface.h"
+#include "core-bridge.h"
 
 #include <string.h>
 
@@ -21,6 +23,10 @@ tt_set_int_variable (char *var_name, int value)
         synctex_enabled = (value != 0);
     else if (streq_ptr(var_name, "semantic_pagination_enabled"))
         semantic_pagination_enabled = (value != 0);
+    else if (streq_ptr(var_name, "linebreak_cache_enabled"))
+        linebreak_cache_enabled = (value != 0);
+    else if (streq_ptr(var_name, "profile_enabled"))
+        profile_enabled = (value != 0);
     else
         return 1; /* Uh oh: unrecognized variable */
 
@@ -28,9 +34,148 @@ tt_set_int_variable (char *var_name, int value)
 }
 
 
+/* Copy out the per-size node allocation counts of the most recent TeX run:
+ * slot N counts get_node(N) calls for N < NODE_SIZE_CLASSES, and the final
+ * slot counts all larger requests. Returns the number of slots available,
+ * which may exceed N_COUNTS. */
+int
+tt_get_node_alloc_counts (uint64_t *counts, int n_counts)
+{
+    int i;
+
+    for (i = 0; i < n_counts && i <= NODE_SIZE_CLASSES; i++)
+        counts[i] = node_alloc_count[i];
+
+    return NODE_SIZE_CLASSES + 1;
+}
+
+
+/* Look up one of the engine's event counters by name. Returns 0 on success
+ * and 1 if the name isn't recognized. */
+int
+tt_get_counter (const char *name, uint64_t *value)
+{
+    uint64_t hits, misses;
+
+    getShapingCacheStats(&hits, &misses);
+
+    if (streq_ptr(name, "input_lines_normalized"))
+        *value = input_lines_normalized;
+    else if (streq_ptr(name, "shaping_cache_hits"))
+        *value = hits;
+    else if (streq_ptr(name, "shaping_cache_misses"))
+        *value = misses;
+    else if (streq_ptr(name, "linebreak_iterators_opened"))
+        *value = linebreak_iterators_opened;
+    else if (streq_ptr(name, "hyphenation_cache_hits"))
+        *value = hyph_cache_hits;
+    else if (streq_ptr(name, "hyphenation_cache_misses"))
+        *value = hyph_cache_misses;
+    else if (streq_ptr(name, "linebreak_cache_hits"))
+        *value = linebreak_cache_hits;
+    else if (streq_ptr(name, "linebreak_cache_misses"))
+        *value = linebreak_cache_misses;
+    else if (streq_ptr(name, "cs_lookups"))
+        *value = cs_lookups;
+    else if (streq_ptr(name, "cs_index_probes"))
+        *value = cs_index_probes;
+    else
+        return 1;
+
+    return 0;
+}
+
+
+/* Count the words of mem that sit on a free list at the end of the run: in
+ * the rover ring, in the per-size node lists, and on the one-word avail list.
+ * The walks are bounded by the size of mem, in case a fatal error left a list
+ * half-linked. */
+static uint64_t
+mem_words_free(void)
+{
+    memory_word *mem = zmem;
+    uint64_t free_words = 0, steps = 0, max_steps = (uint64_t) (mem_end - mem_min + 1);
+    int32_t p, k;
+
+    p = rover;
+    do {
+        free_words += mem[p].b32.s0;
+        p = mem[p + 1].b32.s1;
+    } while (p != rover && ++steps < max_steps);
+
+    for (k = 0; k < NODE_SIZE_CLASSES; k++) {
+        for (p = node_free_list[k], steps = 0; p != TEX_NULL && steps < max_steps; p = mem[p].b32.s1, steps++)
+            free_words += k;
+    }
+
+    for (p = avail, steps = 0; p != TEX_NULL && steps < max_steps; p = mem[p].b32.s1, steps++)
+        free_words++;
+
+    return free_words;
+}
+
+
+/* Hand the driver the sizes of the engine's big arrays and the event counters
+ * above, through the bridge. Called from close_files_and_terminate(), so it
+ * runs after fatal errors as well as at the end of a normal run. The mem
+ * figures are what the run ends with, not peaks: nodes freed along the way
+ * don't count as used, and the variable-size region starts at |mem_min|,
+ * below zero when EXTRA_MEM_BOT reserves room there. */
+void
+report_engine_metrics(void)
+{
+    static const char *counters[] = {
+        "input_lines_normalized",
+        "shaping_cache_hits",
+        "shaping_cache_misses",
+        "linebreak_iterators_opened",
+        "hyphenation_cache_hits",
+        "hyphenation_cache_misses",
+        "linebreak_cache_hits",
+        "linebreak_cache_misses",
+        "cs_lookups",
+        "cs_index_probes",
+    };
+    uint64_t value, mem_span;
+    int32_t p, n_cs;
+    size_t i;
+
+    if (zmem != NULL) {
+        mem_span = (uint64_t) (lo_mem_max - mem_min + 1) + (uint64_t) (mem_end - hi_mem_min + 1);
+        ttstub_report_metric("mem_words_used_at_end", mem_span - mem_words_free());
+        ttstub_report_metric("mem_words_allocated_at_end", (uint64_t) (mem_end - mem_min + 1));
+    }
+
+    ttstub_report_metric("str_pool_used", (uint64_t) pool_ptr);
+    ttstub_report_metric("str_pool_size", (uint64_t) pool_size);
+    ttstub_report_metric("strings_used", (uint64_t) (str_ptr - TOO_BIG_CHAR));
+    ttstub_report_metric("font_info_words_used", (uint64_t) fmem_ptr);
+    ttstub_report_metric("font_info_words_allocated", (uint64_t) font_mem_size);
+
+    n_cs = hash_high;
+    for (p = HASH_BASE; p < FROZEN_CONTROL_SEQUENCE; p++) {
+        if (hash[p].s1 != 0)
+            n_cs++;
+    }
+
+    ttstub_report_metric("hash_entries_used", (uint64_t) n_cs);
+    ttstub_report_metric("hash_extra_used", (uint64_t) hash_high);
+
+    for (i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        if (tt_get_counter(counters[i], &value) == 0)
+            ttstub_report_metric(counters[i], value);
+    }
+}
+
+
 int
 tt_set_string_variable (char *var_name, char *value)
 {
-    /* Currently unused; see Git history for how we used to set output_comment */
-    return 1;
+    /* See Git history for how we used to set output_comment */
+    if (streq_ptr(var_name, "font_index_path"))
+        set_font_index_path(value);
+    else
+        return 1;
+
+    return 0;
 }
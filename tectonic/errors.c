@@ -46,7 +46,7 @@ post_error_message(int need_to_print_it)
 
     history = HISTORY_FATAL_ERROR;
     close_files_and_terminate();
-    ttstub_output_flush(rust_stdout);
+    update_terminal();
 }
 
 
@@ -103,7 +103,7 @@ fatal_error(const char* s)
     print_cstr("Emergency stop");
     print_nl_cstr(s);
     close_files_and_terminate();
-    ttstub_output_flush(rust_stdout);
+    update_terminal();
     _tt_abort("%s", s);
 }
 
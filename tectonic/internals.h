@@ -95,6 +95,11 @@ typedef struct {
     short skipNextLF;
     short encodingMode;
     void *conversionData;
+    /* Read-ahead buffer, so that we don't cross the bridge for every byte. */
+    unsigned char *buf;
+    size_t bufPos;
+    size_t bufLen;
+    bool atEOF;
 } UFILE;
 
 typedef enum {
@@ -122,6 +127,7 @@ extern const uint8_t firstByteMark[7];
 */
 
 /* io.c */
+extern uint64_t input_lines_normalized;
 rust_input_handle_t tt_open_input (int filefmt);
 void set_input_file_encoding(UFILE *f, int32_t mode, int32_t encodingData);
 void u_close(UFILE *f);
@@ -14,10 +14,18 @@
 #include <unicode/ubidi.h>
 #include <unicode/ubrk.h>
 #include <unicode/ucnv.h>
+#include <unicode/uchar.h>
+#include <unicode/unorm2.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Define some variables. */
 /* For "file:line:error" style error messages. */
 char *fullnameoffile; /* Defaults to NULL.  */
+/* How many input lines actually had to be run through the normalizer. */
+uint64_t input_lines_normalized;
 
 
 rust_input_handle_t
@@ -135,6 +143,10 @@ u_open_in(UFILE **f, int32_t filefmt, const char *fopen_mode, int32_t mode, int3
     (*f)->savedChar = -1;
     (*f)->skipNextLF = 0;
     (*f)->handle = handle;
+    (*f)->buf = NULL;
+    (*f)->bufPos = 0;
+    (*f)->bufLen = 0;
+    (*f)->atEOF = false;
 
     if (mode == AUTO) {
         /* sniff encoding form */
@@ -168,6 +180,176 @@ u_open_in(UFILE **f, int32_t filefmt, const char *fopen_mode, int32_t mode, int3
 }
 
 
+/* Byte-level reads of UFILEs go through a read-ahead buffer: going across
+ * the bridge for every byte, as ttstub_input_getc() does, dominated the cost
+ * of reading large files. The sniffing in u_open_in() happens before the
+ * buffer is first filled, so it can still use the handle directly. */
+
+#define UFILE_BUF_SIZE 65536
+
+/* Move any unread bytes to the front of the buffer and top it up. Returns the
+ * number of bytes now available. */
+static size_t
+ufile_fill(UFILE *f)
+{
+    size_t avail;
+    ssize_t n;
+
+    if (f->atEOF)
+        return f->bufLen - f->bufPos;
+
+    if (f->buf == NULL)
+        f->buf = xmalloc(UFILE_BUF_SIZE);
+
+    avail = f->bufLen - f->bufPos;
+    memmove(f->buf, f->buf + f->bufPos, avail);
+    f->bufPos = 0;
+    f->bufLen = avail;
+
+    n = ttstub_input_read_partial(f->handle, (char *) f->buf + avail, UFILE_BUF_SIZE - avail);
+    if (n > 0)
+        f->bufLen += n;
+    else
+        f->atEOF = true;
+
+    return f->bufLen;
+}
+
+
+static inline int
+ufile_getc(UFILE *f)
+{
+    if (f->bufPos == f->bufLen && ufile_fill(f) == 0)
+        return EOF;
+
+    return f->buf[f->bufPos++];
+}
+
+
+/* Push back the byte just returned by ufile_getc(). */
+static inline void
+ufile_ungetc(UFILE *f)
+{
+    f->bufPos--;
+}
+
+
+/* Copy the run of ASCII bytes at the start of [P, END) into DEST, widening
+ * each to a UnicodeScalar, but copy no more than MAX of them. Returns the
+ * number of bytes copied. TeX input is overwhelmingly ASCII, so we test and
+ * widen 16 bytes at a time where we can (8 without SSE2) and only fall back
+ * to single bytes at the end of the run. */
+static size_t
+widen_ascii_run(const unsigned char *p, const unsigned char *end, UnicodeScalar *dest, size_t max)
+{
+    size_t n = 0;
+    size_t lim = end - p;
+
+    if (lim > max)
+        lim = max;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+
+    while (n + 16 <= lim) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + n));
+
+        if (_mm_movemask_epi8(v) != 0)
+            break; /* some byte has its high bit set */
+
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_si128((__m128i *) (dest + n), _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *) (dest + n + 4), _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *) (dest + n + 8), _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128((__m128i *) (dest + n + 12), _mm_unpackhi_epi16(hi, zero));
+        n += 16;
+    }
+#else
+    while (n + 8 <= lim) {
+        uint64_t w;
+        int k;
+
+        memcpy(&w, p + n, 8);
+        if (w & UINT64_C(0x8080808080808080))
+            break;
+
+        for (k = 0; k < 8; k++)
+            dest[n + k] = p[n + k];
+        n += 8;
+    }
+#endif
+
+    while (n < lim && p[n] < 0x80) {
+        dest[n] = p[n];
+        n++;
+    }
+
+    return n;
+}
+
+
+/* Read the rest of a line from a UTF-8 file into buffer[last..]. This is
+ * equivalent to calling get_uni_c() until it returns a line ending or EOF,
+ * and the return value is the character that stopped the loop, but the line
+ * ending is found with memchr() and runs of ASCII are copied in bulk. */
+static int
+read_utf8_line(UFILE *f)
+{
+    unsigned char *p, *end, *eol, *cr, *safe;
+
+    for (;;) {
+        if (f->bufLen - f->bufPos < 4 && !f->atEOF)
+            ufile_fill(f);
+
+        p = f->buf + f->bufPos;
+        end = f->buf + f->bufLen;
+
+        if (p == end)
+            return EOF;
+
+        eol = memchr(p, '\n', end - p);
+        cr = memchr(p, '\r', (eol ? eol : end) - p);
+        if (cr != NULL)
+            eol = cr;
+
+        /* A multibyte sequence can't run past a line ending, but without one
+         * in view, leave the last few bytes until we've read more. */
+        if (eol != NULL)
+            safe = eol;
+        else if (f->atEOF)
+            safe = end;
+        else
+            safe = end - 3;
+
+        while (p < safe) {
+            if (last >= buf_size) {
+                f->bufPos = p - f->buf;
+                return *p;
+            }
+
+            if (*p < 0x80) {
+                size_t n = widen_ascii_run(p, safe, &buffer[last], buf_size - last);
+                p += n;
+                last += n;
+                continue;
+            }
+
+            f->bufPos = p - f->buf;
+            buffer[last++] = get_uni_c(f);
+            p = f->buf + f->bufPos;
+        }
+
+        f->bufPos = p - f->buf;
+
+        if (p == eol) {
+            f->bufPos++;
+            return *eol;
+        }
+    }
+}
+
+
 static void
 buffer_overflow(void)
 {
@@ -211,12 +393,44 @@ apply_normalization(uint32_t* buf, int len, int norm)
 }
 
 
+/* A UAX #15 quick check of whether LEN characters at BUF are already in the
+ * normal form selected by NORM (1 = NFC, 2 = NFD). "Maybe" counts as no: we
+ * only want to skip the normalizer when it certainly wouldn't change
+ * anything. Nothing below U+0300 (NFC) or U+00C0 (NFD) can fail the check,
+ * which makes the usual case a simple comparison per character. */
+static bool
+is_normalized(const UnicodeScalar *buf, int32_t len, int norm)
+{
+    UProperty qc_prop = (norm == 1) ? UCHAR_NFC_QUICK_CHECK : UCHAR_NFD_QUICK_CHECK;
+    UnicodeScalar always_ok = (norm == 1) ? 0x300 : 0xC0;
+    int32_t i, ccc, last_ccc = 0;
+
+    for (i = 0; i < len; i++) {
+        UnicodeScalar c = buf[i];
+
+        if (c < always_ok) {
+            last_ccc = 0;
+            continue;
+        }
+
+        ccc = u_getCombiningClass(c);
+        if (ccc != 0 && last_ccc > ccc)
+            return false;
+        if (u_getIntPropertyValue(c, qc_prop) != UNORM_YES)
+            return false;
+        last_ccc = ccc;
+    }
+
+    return true;
+}
+
+
 int
 input_line(UFILE* f)
 {
     static char* byteBuffer = NULL;
     static uint32_t *utf32Buf = NULL;
-    int i, tmpLen;
+    int i, k, tmpLen;
     int norm = get_input_normalization_state();
 
     if (f->handle == NULL)
@@ -235,17 +449,17 @@ input_line(UFILE* f)
             byteBuffer = xmalloc(buf_size + 1);
 
         /* Recognize either LF or CR as a line terminator; skip initial LF if prev line ended with CR.  */
-        i = ttstub_input_getc (f->handle);
+        i = ufile_getc(f);
         if (f->skipNextLF) {
             f->skipNextLF = 0;
             if (i == '\n')
-                i = ttstub_input_getc (f->handle);
+                i = ufile_getc(f);
         }
 
         if (i != EOF && i != '\n' && i != '\r')
             byteBuffer[bytesRead++] = i;
         if (i != EOF && i != '\n' && i != '\r')
-            while (bytesRead < buf_size && (i = ttstub_input_getc(f->handle)) != EOF && i != '\n' && i != '\r')
+            while (bytesRead < buf_size && (i = ufile_getc(f)) != EOF && i != '\n' && i != '\r')
                 byteBuffer[bytesRead++] = i;
 
         if (i == EOF && errno != EINTR && bytesRead == 0)
@@ -256,33 +470,15 @@ input_line(UFILE* f)
 
         /* now apply the mapping to turn external bytes into Unicode characters in buffer */
         cnv = (UConverter*)(f->conversionData);
-        switch (norm) {
-            case 1: // NFC
-            case 2: // NFD
-                if (utf32Buf == NULL)
-                    utf32Buf = xcalloc(buf_size, sizeof(uint32_t));
-                tmpLen = ucnv_toAlgorithmic(UCNV_UTF32_NativeEndian, cnv,
-                                            (char*)utf32Buf, buf_size * sizeof(*utf32Buf),
-                                            byteBuffer, bytesRead, &errorCode);
-                if (errorCode != 0) {
-                    conversion_error((int)errorCode);
-                    return false;
-                }
-                apply_normalization(utf32Buf, tmpLen / sizeof(*utf32Buf), norm); // sets 'last' correctly
-                break;
-
-            default: // none
-                outLen = ucnv_toAlgorithmic(UCNV_UTF32_NativeEndian, cnv,
-                                            (char*)&buffer[first], sizeof(*buffer) * (buf_size - first),
-                                            byteBuffer, bytesRead, &errorCode);
-                if (errorCode != 0) {
-                    conversion_error((int)errorCode);
-                    return false;
-                }
-                outLen /= sizeof(*buffer);
-                last = first + outLen;
-                break;
+        outLen = ucnv_toAlgorithmic(UCNV_UTF32_NativeEndian, cnv,
+                                    (char*)&buffer[first], sizeof(*buffer) * (buf_size - first),
+                                    byteBuffer, bytesRead, &errorCode);
+        if (errorCode != 0) {
+            conversion_error((int)errorCode);
+            return false;
         }
+        outLen /= sizeof(*buffer);
+        last = first + outLen;
     } else {
         /* Recognize either LF or CR as a line terminator; skip initial LF if prev line ended with CR.  */
         i = get_uni_c(f);
@@ -292,43 +488,34 @@ input_line(UFILE* f)
                 i = get_uni_c(f);
         }
 
-        switch (norm) {
-            case 1: // NFC
-            case 2: // NFD
-                // read Unicode chars into utf32Buf as UTF32
-                if (utf32Buf == NULL)
-                    utf32Buf = xcalloc(buf_size, sizeof(uint32_t));
-                tmpLen = 0;
-                if (i != EOF && i != '\n' && i != '\r')
-                    utf32Buf[tmpLen++] = i;
-                if (i != EOF && i != '\n' && i != '\r')
-                    while (tmpLen < buf_size && (i = get_uni_c(f)) != EOF && i != '\n' && i != '\r')
-                        utf32Buf[tmpLen++] = i;
-
-                if (i == EOF && errno != EINTR && tmpLen == 0)
-                    return false;
-
-                /* We didn't get the whole line because our buffer was too small.  */
-                if (i != EOF && i != '\n' && i != '\r')
-                    buffer_overflow();
-                apply_normalization(utf32Buf, tmpLen, norm);
-                break;
-
-            default: // none
-                if (last < buf_size && i != EOF && i != '\n' && i != '\r')
+        if (last < buf_size && i != EOF && i != '\n' && i != '\r')
+            buffer[last++] = i;
+        if (i != EOF && i != '\n' && i != '\r') {
+            if (f->encodingMode == UTF8 && f->savedChar == -1)
+                i = read_utf8_line(f);
+            else
+                while (last < buf_size && (i = get_uni_c(f)) != EOF && i != '\n' && i != '\r')
                     buffer[last++] = i;
-                if (i != EOF && i != '\n' && i != '\r')
-                    while (last < buf_size && (i = get_uni_c(f)) != EOF && i != '\n' && i != '\r')
-                        buffer[last++] = i;
+        }
 
-                if (i == EOF && errno != EINTR && last == first)
-                    return false;
+        if (i == EOF && errno != EINTR && last == first)
+            return false;
 
-                /* We didn't get the whole line because our buffer was too small.  */
-                if (i != EOF && i != '\n' && i != '\r')
-                    buffer_overflow();
-                break;
-        }
+        /* We didn't get the whole line because our buffer was too small.  */
+        if (i != EOF && i != '\n' && i != '\r')
+            buffer_overflow();
+    }
+
+    /* Normalize the line if needed. Most lines already are, so we only pay
+     * for the copy and the trip through TECkit when the quick check fails. */
+    if (norm != 0 && !is_normalized(&buffer[first], last - first, norm)) {
+        tmpLen = last - first;
+        if (utf32Buf == NULL)
+            utf32Buf = xcalloc(buf_size, sizeof(uint32_t));
+        for (k = 0; k < tmpLen; k++)
+            utf32Buf[k] = buffer[first + k];
+        apply_normalization(utf32Buf, tmpLen, norm); // sets 'last' correctly
+        input_lines_normalized++;
     }
 
     /* If line ended with CR, remember to skip following LF. */
@@ -360,6 +547,7 @@ u_close(UFILE* f)
     if (f->encodingMode == ICUMAPPING && f->conversionData != NULL)
         ucnv_close ((UConverter*) f->conversionData);
 
+    free (f->buf);
     free (f);
 }
 
@@ -378,25 +566,25 @@ get_uni_c(UFILE* f)
 
     switch (f->encodingMode) {
         case UTF8:
-            c = rval = ttstub_input_getc(f->handle);
+            c = rval = ufile_getc(f);
             if (rval != EOF) {
                 uint16_t extraBytes = bytesFromUTF8[rval];
                 switch (extraBytes) {
                 /* note: code falls through cases! */
                 case 3:
-                    c = ttstub_input_getc(f->handle);
+                    c = ufile_getc(f);
                     if (c < 0x80 || c >= 0xC0)
                         goto bad_utf8;
                     rval <<= 6;
                     rval += c;
                 case 2:
-                    c = ttstub_input_getc(f->handle);
+                    c = ufile_getc(f);
                     if (c < 0x80 || c >= 0xC0)
                         goto bad_utf8;
                     rval <<= 6;
                     rval += c;
                 case 1:
-                    c = ttstub_input_getc(f->handle);
+                    c = ufile_getc(f);
                     if (c < 0x80 || c >= 0xC0)
                         goto bad_utf8;
                     rval <<= 6;
@@ -406,7 +594,7 @@ get_uni_c(UFILE* f)
 
                 bad_utf8:
                     if (c != EOF)
-                        ttstub_input_ungetc(f->handle, c);
+                        ufile_ungetc(f);
                 case 5:
                 case 4:
                     bad_utf8_warning();
@@ -423,14 +611,14 @@ get_uni_c(UFILE* f)
             break;
 
         case UTF16BE:
-            rval = ttstub_input_getc(f->handle);
+            rval = ufile_getc(f);
             if (rval != EOF) {
                 rval <<= 8;
-                rval += ttstub_input_getc(f->handle);
+                rval += ufile_getc(f);
                 if (rval >= 0xd800 && rval <= 0xdbff) {
-                    int lo = ttstub_input_getc(f->handle);
+                    int lo = ufile_getc(f);
                     lo <<= 8;
-                    lo += ttstub_input_getc(f->handle);
+                    lo += ufile_getc(f);
                     if (lo >= 0xdc00 && lo <= 0xdfff)
                         rval = 0x10000 + (rval - 0xd800) * 0x400 + (lo - 0xdc00);
                     else {
@@ -443,12 +631,12 @@ get_uni_c(UFILE* f)
             break;
 
         case UTF16LE:
-            rval = ttstub_input_getc(f->handle);
+            rval = ufile_getc(f);
             if (rval != EOF) {
-                rval += (ttstub_input_getc(f->handle) << 8);
+                rval += (ufile_getc(f) << 8);
                 if (rval >= 0xd800 && rval <= 0xdbff) {
-                    int lo = ttstub_input_getc(f->handle);
-                    lo += (ttstub_input_getc(f->handle) << 8);
+                    int lo = ufile_getc(f);
+                    lo += (ufile_getc(f) << 8);
                     if (lo >= 0xdc00 && lo <= 0xdfff)
                         rval = 0x10000 + (rval - 0xd800) * 0x400 + (lo - 0xdc00);
                     else {
@@ -461,7 +649,7 @@ get_uni_c(UFILE* f)
             break;
 
         case RAW:
-            rval = ttstub_input_getc(f->handle);
+            rval = ufile_getc(f);
             break;
 
         default:
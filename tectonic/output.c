@@ -9,23 +9,125 @@
 #include "synctex.h"
 #include "core-bridge.h"
 
+#include <unistd.h> /* isatty */
+
+
+/* Output buffering. Every ttstub_output_putc() is a trip through the Rust
+ * bridge, and chatty packages can send megabytes to the log, so characters
+ * for the terminal, the log and the \write files are collected here and
+ * handed over in large chunks. If the terminal is interactive it is still
+ * flushed at the end of every line. Anything that writes to or closes one of
+ * these handles by other means must flush its buffer first; the bridge entry
+ * points flush everything when the engine returns, including on abort. */
+
+#define OUTPUT_BUF_SIZE 16384
+#define TERM_BUF 16 /* buffers 0 to 15 go with write_file[] */
+#define LOG_BUF 17
+#define N_OUTPUT_BUFS 18
+
+typedef struct {
+    rust_output_handle_t handle;
+    size_t len;
+    char data[OUTPUT_BUF_SIZE];
+} output_buffer;
+
+static output_buffer output_bufs[N_OUTPUT_BUFS];
+static int term_interactive = -1; /* not yet known */
+
+
+static void
+flush_buffer(output_buffer *b)
+{
+    if (b->len > 0) {
+        ttstub_output_write(b->handle, b->data, b->len);
+        b->len = 0;
+    }
+}
+
+
+static inline void
+buffered_putc(int which, rust_output_handle_t handle, char c)
+{
+    output_buffer *b = &output_bufs[which];
+
+    if (b->handle != handle) {
+        flush_buffer(b);
+        b->handle = handle;
+    }
+
+    b->data[b->len++] = c;
+
+    if (b->len == OUTPUT_BUF_SIZE)
+        flush_buffer(b);
+}
+
+
+static void
+term_newline(void)
+{
+    buffered_putc(TERM_BUF, rust_stdout, '\n');
+
+    if (term_interactive < 0)
+        term_interactive = isatty(STDOUT_FILENO);
+
+    if (term_interactive)
+        flush_buffer(&output_bufs[TERM_BUF]);
+}
+
+
+void
+flush_output_buffers(void)
+{
+    int i;
+
+    for (i = 0; i < N_OUTPUT_BUFS; i++)
+        flush_buffer(&output_bufs[i]);
+}
+
+
+/* Make everything printed so far visible on the terminal. */
+void
+update_terminal(void)
+{
+    flush_buffer(&output_bufs[TERM_BUF]);
+    ttstub_output_flush(rust_stdout);
+}
+
+
+/* Close an output that may have been printed to, writing out what is still
+ * buffered for it. */
+int
+close_output(rust_output_handle_t handle)
+{
+    int i;
+
+    for (i = 0; i < N_OUTPUT_BUFS; i++) {
+        if (output_bufs[i].handle == handle) {
+            flush_buffer(&output_bufs[i]);
+            output_bufs[i].handle = NULL;
+        }
+    }
+
+    return ttstub_output_close(handle);
+}
+
 
 void
 print_ln(void)
 {
     switch (selector) {
     case SELECTOR_TERM_AND_LOG:
-        ttstub_output_putc(rust_stdout, '\n');
-        ttstub_output_putc(log_file, '\n');
+        term_newline();
+        buffered_putc(LOG_BUF, log_file, '\n');
         term_offset = 0;
         file_offset = 0;
         break;
     case SELECTOR_LOG_ONLY:
-        ttstub_output_putc(log_file, '\n');
+        buffered_putc(LOG_BUF, log_file, '\n');
         file_offset = 0;
         break;
     case SELECTOR_TERM_ONLY:
-        ttstub_output_putc(rust_stdout, '\n');
+        term_newline();
         term_offset = 0;
         break;
     case SELECTOR_NO_PRINT:
@@ -33,7 +135,7 @@ print_ln(void)
     case SELECTOR_NEW_STRING:
         break;
     default:
-        ttstub_output_putc(write_file[selector], '\n');
+        buffered_putc(selector, write_file[selector], '\n');
         break;
     }
 }
@@ -44,30 +146,30 @@ print_raw_char(UTF16_code s, bool incr_offset)
 {
     switch (selector) {
     case SELECTOR_TERM_AND_LOG:
-        ttstub_output_putc(rust_stdout, s);
-        ttstub_output_putc(log_file, s);
+        buffered_putc(TERM_BUF, rust_stdout, s);
+        buffered_putc(LOG_BUF, log_file, s);
         if (incr_offset) {
             term_offset++;
             file_offset++;
         }
         if (term_offset == max_print_line) {
-            ttstub_output_putc(rust_stdout, '\n');
+            term_newline();
             term_offset = 0;
         }
         if (file_offset == max_print_line) {
-            ttstub_output_putc(log_file, '\n');
+            buffered_putc(LOG_BUF, log_file, '\n');
             file_offset = 0;
         }
         break;
     case SELECTOR_LOG_ONLY:
-        ttstub_output_putc(log_file, s);
+        buffered_putc(LOG_BUF, log_file, s);
         if (incr_offset)
             file_offset++;
         if (file_offset == max_print_line)
             print_ln();
         break;
     case SELECTOR_TERM_ONLY:
-        ttstub_output_putc(rust_stdout, s);
+        buffered_putc(TERM_BUF, rust_stdout, s);
         if (incr_offset)
             term_offset++;
         if (term_offset == max_print_line)
@@ -86,7 +188,7 @@ print_raw_char(UTF16_code s, bool incr_offset)
         }
         break;
     default:
-        ttstub_output_putc(write_file[selector], s);
+        buffered_putc(selector, write_file[selector], s);
         break;
     }
     tally++;
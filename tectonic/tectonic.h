@@ -52,6 +52,8 @@ BEGIN_EXTERN_C
 /* engine-interface.c */
 
 int tt_set_int_variable (char *var_name, int value);
+int tt_get_node_alloc_counts (uint64_t *counts, int n_counts);
+int tt_get_counter (const char *name, uint64_t *value);
 int tt_set_string_variable (char *var_name, char *value);
 
 END_EXTERN_C
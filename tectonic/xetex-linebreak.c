@@ -45,6 +45,9 @@ static void try_break(int32_t pi, small_number break_type);
 static void hyphenate(void);
 static int32_t finite_shrink(int32_t p);
 static small_number reconstitute(small_number j, small_number n, int32_t bchar, int32_t hchar);
+static bool paragraph_digest(char *digest, int32_t *lang_node);
+static bool replay_cached_breaks(const char *digest, int32_t lang_node);
+static void cache_breaks(const char *digest);
 
 
 /* Break a paragraph into lines (XTTP:843).
@@ -72,6 +75,9 @@ line_break(bool d)
     int32_t l;
     int32_t i;
     int32_t for_end_1;
+    bool use_cache;
+    char digest[16];
+    int32_t lang_node = TEX_NULL;
 
     pack_begin_line = cur_list.mode_line; /* "this is for over/underfull box messages" */
 
@@ -186,6 +192,34 @@ line_break(bool d)
     else
         easy_line = MAX_HALFWORD; /*:877*/
 
+    /* If the breaks of an identical paragraph were found on the first pass in
+     * an earlier run, reuse them. Paragraphs that need the second pass are
+     * never cached, since hyphenation changes the list; neither are those
+     * whose breaking depends on things the digest doesn't capture, nor those
+     * whose feasible breaks are being traced to the log. */
+
+    use_cache = (linebreak_cache_enabled && !in_initex_mode && !do_last_line_fit
+                 && INTPAR(xetex_protrude_chars) <= 0 && INTPAR(pretolerance) >= 0
+                 && INTPAR(tracing_paragraphs) <= 0);
+
+    if (use_cache) {
+        bool saved_ligature_present = xtx_ligature_present;
+
+        use_cache = paragraph_digest(digest, &lang_node);
+        /* The digest consumed the flag the way the first pass would; put it
+         * back so that both the replay and the real pass see the same state. */
+        xtx_ligature_present = saved_ligature_present;
+
+        if (use_cache && replay_cached_breaks(digest, lang_node)) {
+            linebreak_cache_hits++;
+            use_cache = false;
+            goto done;
+        }
+
+        if (use_cache)
+            linebreak_cache_misses++;
+    }
+
     /* Start finding optimal breakpoints (892) */
 
     threshold = INTPAR(pretolerance);
@@ -848,6 +882,9 @@ line_break(bool d)
     }
 
 done:
+    if (use_cache && !second_pass)
+        cache_breaks(digest);
+
     if (do_last_line_fit) { /*1641:*/
         if (ACTIVE_NODE_shortfall(best_bet) == 0) {
             do_last_line_fit = false;
@@ -890,6 +927,406 @@ done:
 }
 
 
+/* Line-break cache. LaTeX reruns mostly change cross-references, so most
+ * paragraphs are identical from one run to the next, and finding their
+ * breaks again is wasted work. When enabled, we remember the breaks of every
+ * paragraph that was broken on the first pass, keyed by a digest of
+ * everything that pass looks at: the widths, penalties and structure of the
+ * nodes, and the parameters that shape the lines. The cache lives for the
+ * whole process, so it carries over between the runs of one build. Breaks
+ * are stored as positions in the list, since node addresses differ from run
+ * to run. */
+
+#define LINEBREAK_CACHE_BUCKETS 16384 /* must be a power of 2 */
+#define LINEBREAK_CACHE_MAX_ENTRIES 65536
+
+typedef struct linebreak_cache_entry {
+    struct linebreak_cache_entry *next;
+    char digest[16];
+    int32_t best_line;
+    int32_t n_breaks;
+    int32_t *breaks; /* list positions of the breaks; -1 for the end of the paragraph */
+} linebreak_cache_entry;
+
+static linebreak_cache_entry *linebreak_cache[LINEBREAK_CACHE_BUCKETS];
+static int32_t linebreak_cache_entries = 0;
+
+static int32_t *digest_data = NULL;
+static size_t digest_len = 0, digest_alloc = 0;
+
+uint64_t linebreak_cache_hits = 0;
+uint64_t linebreak_cache_misses = 0;
+
+
+static void
+digest_put(int32_t v)
+{
+    if (digest_len == digest_alloc) {
+        digest_alloc = digest_alloc ? 2 * digest_alloc : 1024;
+        digest_data = xrealloc(digest_data, digest_alloc * sizeof(int32_t));
+    }
+
+    digest_data[digest_len++] = v;
+}
+
+
+static scaled_t
+digest_char_width(internal_font_number f, uint16_t c)
+{
+    return FONT_CHARACTER_WIDTH(f, effective_char(true, f, c));
+}
+
+
+/* Add one node of a discretionary's pre-break, post-break or replacement
+ * text. Returns false for nodes that line_break() doesn't expect there. */
+static bool
+digest_disc_node(int32_t p)
+{
+    memory_word *mem = zmem;
+
+    if (is_char_node(p)) {
+        digest_put(-1);
+        digest_put(digest_char_width(CHAR_NODE_font(p), CHAR_NODE_character(p)));
+        return true;
+    }
+
+    digest_put(NODE_type(p));
+
+    switch (NODE_type(p)) {
+    case LIGATURE_NODE:
+        xtx_ligature_present = true;
+        digest_put(digest_char_width(LIGATURE_NODE_lig_font(p), LIGATURE_NODE_lig_char(p)));
+        return true;
+    case HLIST_NODE:
+    case VLIST_NODE:
+    case RULE_NODE:
+    case KERN_NODE:
+        digest_put(BOX_width(p));
+        return true;
+    case WHATSIT_NODE:
+        if (NODE_subtype(p) == NATIVE_WORD_NODE || NODE_subtype(p) == NATIVE_WORD_NODE_AT
+            || NODE_subtype(p) == GLYPH_NODE || NODE_subtype(p) == PIC_NODE || NODE_subtype(p) == PDF_NODE) {
+            digest_put(BOX_width(p));
+            return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+
+/* Compute the digest of the paragraph in TEMP_HEAD.link, as set up by
+ * line_break(). The character widths are computed the same way, and in the
+ * same order, as the first pass would. Returns false if the paragraph can't
+ * be cached. */
+static bool
+paragraph_digest(char *digest, int32_t *lang_node)
+{
+    CACHE_THE_EQTB;
+    memory_word *mem = zmem;
+    int32_t p, q, r;
+
+    digest_len = 0;
+
+    digest_put(cur_list.prev_graf);
+    digest_put(DIMENPAR(hsize));
+    digest_put(DIMENPAR(hang_indent));
+    digest_put(INTPAR(hang_after));
+    digest_put(INTPAR(looseness));
+    digest_put(INTPAR(pretolerance));
+    digest_put(INTPAR(line_penalty));
+    digest_put(INTPAR(adj_demerits));
+    digest_put(INTPAR(double_hyphen_demerits));
+    digest_put(INTPAR(final_hyphen_demerits));
+
+    for (r = 1; r <= 6; r++)
+        digest_put(background[r]);
+
+    if (LOCAL(par_shape) == TEX_NULL) {
+        digest_put(0);
+    } else {
+        digest_put(LLIST_info(LOCAL(par_shape)));
+
+        for (r = 1; r <= 2 * LLIST_info(LOCAL(par_shape)); r++)
+            digest_put(mem[LOCAL(par_shape) + r].b32.s1);
+    }
+
+    p = LLIST_link(TEMP_HEAD);
+
+    while (p != TEX_NULL) {
+        if (is_char_node(p)) {
+            digest_put(-1);
+            digest_put(digest_char_width(CHAR_NODE_font(p), CHAR_NODE_character(p)));
+            p = LLIST_link(p);
+            continue;
+        }
+
+        digest_put(NODE_type(p));
+        digest_put(NODE_subtype(p));
+
+        switch (NODE_type(p)) {
+        case HLIST_NODE:
+        case VLIST_NODE:
+        case RULE_NODE:
+        case KERN_NODE:
+        case MATH_NODE:
+            digest_put(BOX_width(p));
+            break;
+
+        case WHATSIT_NODE:
+            if (NODE_subtype(p) == LANGUAGE_NODE)
+                *lang_node = p;
+            else if (NODE_subtype(p) == NATIVE_WORD_NODE || NODE_subtype(p) == NATIVE_WORD_NODE_AT
+                     || NODE_subtype(p) == GLYPH_NODE || NODE_subtype(p) == PIC_NODE || NODE_subtype(p) == PDF_NODE)
+                digest_put(BOX_width(p));
+            break;
+
+        case GLUE_NODE:
+            q = GLUE_NODE_glue_ptr(p);
+            /* The first pass would replace the glue and complain about it. */
+            if (GLUE_SPEC_shrink_order(q) != NORMAL && GLUE_SPEC_shrink(q) != 0)
+                return false;
+            digest_put(BOX_width(q));
+            digest_put(GLUE_SPEC_stretch(q));
+            digest_put(GLUE_SPEC_stretch_order(q));
+            digest_put(GLUE_SPEC_shrink(q));
+            break;
+
+        case LIGATURE_NODE:
+            xtx_ligature_present = true;
+            digest_put(digest_char_width(LIGATURE_NODE_lig_font(p), LIGATURE_NODE_lig_char(p)));
+            break;
+
+        case DISC_NODE:
+            if (DISCRETIONARY_NODE_pre_break(p) == TEX_NULL)
+                digest_put(INTPAR(ex_hyphen_penalty));
+            else
+                digest_put(INTPAR(hyphen_penalty));
+
+            for (q = DISCRETIONARY_NODE_pre_break(p); q != TEX_NULL; q = LLIST_link(q))
+                if (!digest_disc_node(q))
+                    return false;
+
+            digest_put(-2);
+
+            for (q = DISCRETIONARY_NODE_post_break(p); q != TEX_NULL; q = LLIST_link(q))
+                if (!digest_disc_node(q))
+                    return false;
+
+            digest_put(-2);
+
+            r = DISCRETIONARY_NODE_replace_count(p);
+            p = LLIST_link(p);
+
+            while (r > 0 && p != TEX_NULL) {
+                if (!digest_disc_node(p))
+                    return false;
+                r--;
+                p = LLIST_link(p);
+            }
+
+            continue;
+
+        case PENALTY_NODE:
+            digest_put(PENALTY_NODE_penalty(p));
+            break;
+
+        case MARK_NODE:
+        case INS_NODE:
+        case ADJUST_NODE:
+            break;
+
+        default:
+            return false;
+        }
+
+        p = LLIST_link(p);
+    }
+
+    ttstub_get_data_md5((const char *) digest_data, digest_len * sizeof(int32_t), digest);
+    return true;
+}
+
+
+static linebreak_cache_entry *
+find_cached_breaks(const char *digest)
+{
+    linebreak_cache_entry *e;
+    uint32_t bucket;
+
+    memcpy(&bucket, digest, sizeof(bucket));
+
+    for (e = linebreak_cache[bucket & (LINEBREAK_CACHE_BUCKETS - 1)]; e != NULL; e = e->next) {
+        if (memcmp(e->digest, digest, sizeof(e->digest)) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+
+/* Set up the passive nodes and `best_bet` as the first pass would have left
+ * them, so that post_line_break() can take over. */
+static bool
+replay_cached_breaks(const char *digest, int32_t lang_node)
+{
+    CACHE_THE_EQTB;
+    memory_word *mem = zmem;
+    linebreak_cache_entry *e = find_cached_breaks(digest);
+    int32_t *nodes;
+    int32_t p, last, pos, k, q;
+
+    if (e == NULL)
+        return false;
+
+    nodes = xmalloc(e->n_breaks * sizeof(int32_t));
+    p = LLIST_link(TEMP_HEAD);
+    last = TEX_NULL;
+    pos = 0;
+
+    for (k = 0; k < e->n_breaks; k++) {
+        if (e->breaks[k] < 0) {
+            nodes[k] = TEX_NULL;
+            continue;
+        }
+
+        while (p != TEX_NULL && pos < e->breaks[k]) {
+            p = LLIST_link(p);
+            pos++;
+        }
+
+        if (p == TEX_NULL) {
+            free(nodes);
+            return false;
+        }
+
+        nodes[k] = p;
+    }
+
+    for (p = LLIST_link(TEMP_HEAD); p != TEX_NULL; p = LLIST_link(p))
+        last = p;
+
+    passive = TEX_NULL;
+
+    for (k = 0; k < e->n_breaks; k++) {
+        q = get_node(PASSIVE_NODE_SIZE);
+        LLIST_link(q) = passive;
+        PASSIVE_NODE_cur_break(q) = nodes[k];
+        PASSIVE_NODE_prev_break(q) = passive;
+        PASSIVE_NODE_serial(q) = k + 1;
+        passive = q;
+    }
+
+    free(nodes);
+
+    q = get_node(active_node_size);
+    NODE_type(q) = UNHYPHENATED;
+    ACTIVE_NODE_fitness(q) = DECENT_FIT;
+    LLIST_link(q) = ACTIVE_LIST;
+    ACTIVE_NODE_break_node(q) = passive;
+    ACTIVE_NODE_line_number(q) = e->best_line;
+    ACTIVE_NODE_total_demerits(q) = 0;
+    LLIST_link(ACTIVE_LIST) = q;
+
+    best_bet = q;
+    best_line = e->best_line;
+
+    /* Leave the rest of the state as the first pass would have. */
+    threshold = INTPAR(pretolerance);
+    second_pass = false;
+    final_pass = false;
+    font_in_short_display = 0;
+    first_p = LLIST_link(TEMP_HEAD);
+    global_prev_p = last;
+    cur_p = TEX_NULL;
+
+    if (lang_node != TEX_NULL) {
+        cur_lang = mem[lang_node + 1].b32.s1;
+        l_hyf = mem[lang_node + 1].b16.s1;
+        r_hyf = mem[lang_node + 1].b16.s0;
+        if (trie_trc[hyph_start + cur_lang] != cur_lang)
+            hyph_index = 0;
+        else
+            hyph_index = trie_trl[hyph_start + cur_lang];
+    }
+
+    return true;
+}
+
+
+/* Remember the breaks chosen by the first pass. Must be called before
+ * post_line_break(), which relinks the passive nodes. */
+static void
+cache_breaks(const char *digest)
+{
+    memory_word *mem = zmem;
+    linebreak_cache_entry *e;
+    uint32_t bucket;
+    int32_t n, k, p, pos, q;
+
+    if (find_cached_breaks(digest) != NULL)
+        return;
+
+    if (linebreak_cache_entries >= LINEBREAK_CACHE_MAX_ENTRIES) {
+        for (k = 0; k < LINEBREAK_CACHE_BUCKETS; k++) {
+            while (linebreak_cache[k] != NULL) {
+                e = linebreak_cache[k];
+                linebreak_cache[k] = e->next;
+                free(e->breaks);
+                free(e);
+            }
+        }
+
+        linebreak_cache_entries = 0;
+    }
+
+    n = 0;
+    for (q = ACTIVE_NODE_break_node(best_bet); q != TEX_NULL; q = PASSIVE_NODE_prev_break(q))
+        n++;
+
+    e = xmalloc(sizeof(linebreak_cache_entry));
+    e->breaks = xmalloc(n * sizeof(int32_t));
+    e->n_breaks = n;
+    e->best_line = best_line;
+    memcpy(e->digest, digest, sizeof(e->digest));
+
+    /* The chain runs from the last break back to the first. */
+    k = n;
+    for (q = ACTIVE_NODE_break_node(best_bet); q != TEX_NULL; q = PASSIVE_NODE_prev_break(q))
+        e->breaks[--k] = PASSIVE_NODE_cur_break(q);
+
+    p = LLIST_link(TEMP_HEAD);
+    pos = 0;
+
+    for (k = 0; k < n; k++) {
+        if (e->breaks[k] == TEX_NULL) {
+            e->breaks[k] = -1;
+            continue;
+        }
+
+        while (p != TEX_NULL && p != e->breaks[k]) {
+            p = LLIST_link(p);
+            pos++;
+        }
+
+        if (p == TEX_NULL) {
+            free(e->breaks);
+            free(e);
+            return;
+        }
+
+        e->breaks[k] = pos;
+    }
+
+    memcpy(&bucket, digest, sizeof(bucket));
+    bucket &= LINEBREAK_CACHE_BUCKETS - 1;
+    e->next = linebreak_cache[bucket];
+    linebreak_cache[bucket] = e;
+    linebreak_cache_entries++;
+}
+
+
 /* This was just separated out to prevent line_break() from becoming
  * proposterously long. */
 static void
@@ -1845,6 +2282,114 @@ exit:
 }
 
 
+/* Hyphenation cache. Running text repeats the same words constantly, and
+ * each attempt to hyphenate one walks the exception table and the pattern
+ * trie from scratch -- in every paragraph and on every pass. So we remember
+ * the breakpoints found for recent words, keyed by the language, the
+ * \lefthyphenmin/\righthyphenmin in effect and the (lowercased) letters of
+ * the word. Only whether hyf[j] is odd matters once the trie has been walked,
+ * so that is all we store. The cache is direct-mapped: a word simply evicts
+ * whatever was in its slot. */
+
+#define HYPH_CACHE_SIZE 4096 /* must be a power of 2 */
+
+typedef struct {
+    uint32_t hash;
+    int32_t lang;
+    int32_t l_hyf, r_hyf;
+    small_number len;
+    int32_t *word; /* hc[1..len] */
+    unsigned char *odd; /* bitset of odd hyf[0..len] */
+} hyph_cache_entry;
+
+static hyph_cache_entry hyph_cache[HYPH_CACHE_SIZE];
+
+uint64_t hyph_cache_hits = 0;
+uint64_t hyph_cache_misses = 0;
+
+
+void
+clear_hyphenation_cache(void)
+{
+    int i;
+
+    for (i = 0; i < HYPH_CACHE_SIZE; i++) {
+        free(hyph_cache[i].word);
+        hyph_cache[i].word = NULL;
+        hyph_cache[i].odd = NULL;
+        hyph_cache[i].len = 0;
+    }
+}
+
+
+static uint32_t
+hyph_cache_hash(void)
+{
+    uint32_t h = 2166136261U;
+    small_number j;
+
+    h = (h ^ cur_lang) * 16777619U;
+    h = (h ^ l_hyf) * 16777619U;
+    h = (h ^ r_hyf) * 16777619U;
+
+    for (j = 1; j <= hn; j++)
+        h = (h ^ (uint32_t) hc[j]) * 16777619U;
+
+    return h;
+}
+
+
+/* Look up the word in hc[1..hn]. On a hit, mark its breakpoints in hyf[],
+ * which the caller has cleared. */
+static bool
+hyph_cache_lookup(uint32_t hash)
+{
+    hyph_cache_entry *e = &hyph_cache[hash & (HYPH_CACHE_SIZE - 1)];
+    small_number j;
+
+    if (e->word == NULL || e->hash != hash || e->len != hn || e->lang != cur_lang
+        || e->l_hyf != l_hyf || e->r_hyf != r_hyf
+        || memcmp(e->word, &hc[1], hn * sizeof(int32_t)) != 0) {
+        hyph_cache_misses++;
+        return false;
+    }
+
+    for (j = 0; j <= hn; j++) {
+        if (e->odd[j >> 3] & (1 << (j & 7)))
+            hyf[j] = 1;
+    }
+
+    hyph_cache_hits++;
+    return true;
+}
+
+
+static void
+hyph_cache_store(uint32_t hash)
+{
+    hyph_cache_entry *e = &hyph_cache[hash & (HYPH_CACHE_SIZE - 1)];
+    size_t nbits = (hn + 8) / 8;
+    small_number j;
+
+    free(e->word);
+    e->word = xmalloc(hn * sizeof(int32_t) + nbits);
+    e->odd = (unsigned char *) (e->word + hn);
+    memcpy(e->word, &hc[1], hn * sizeof(int32_t));
+    memset(e->odd, 0, nbits);
+
+    for (j = 0; j <= hn; j++) {
+        if (odd(hyf[j]))
+            e->odd[j >> 3] |= 1 << (j & 7);
+    }
+
+    e->hash = hash;
+    e->lang = cur_lang;
+    e->l_hyf = l_hyf;
+    e->r_hyf = r_hyf;
+    e->len = hn;
+}
+
+
 static void
 hyphenate(void)
 {
@@ -1863,6 +2408,7 @@ hyphenate(void)
     hyph_pointer h;
     str_number k;
     pool_pointer u;
+    uint32_t cache_hash;
 
     {
         register int32_t for_end;
@@ -1873,6 +2419,9 @@ hyphenate(void)
                 hyf[j] = 0;
             while (j++ < for_end);
     }
+    cache_hash = hyph_cache_hash();
+    if (hyph_cache_lookup(cache_hash))
+        goto cached;
     h = hc[1];
     hn++;
     hc[hn] = cur_lang;
@@ -1966,6 +2515,8 @@ not_found:
                 hyf[hn - j] = 0 /*:958 */ ;
             while (j++ < for_end);
     }
+    hyph_cache_store(cache_hash);
+cached:
     {
         register int32_t for_end;
         j = l_hyf;
@@ -0,0 +1,673 @@
+/* Copyright 2016-2018 The Tectonic Project
+ * Licensed under the MIT License.
+ */
+
+/* The macro expansion profiler.
+ *
+ * When `profile_enabled` is set, the engine reports three kinds of events
+ * here: macro calls (from macro_call() until the macro body's token list is
+ * used up), expansions of expandable primitives (the duration of expand()),
+ * and main_control() dispatches of unexpandable commands. Each of these
+ * opens a "frame" labeled with the control sequence involved, or with the
+ * command code if there isn't one. Frames opened while no other frame is
+ * open are filed under the source file and line being read at the time.
+ *
+ * Time is always charged to whichever frame was opened most recently, and
+ * the frames themselves are arranged in a call tree. Frames usually nest,
+ * but not always: a macro whose body starts while \expandafter is being
+ * expanded outlives the \expandafter, and because TeX pops a finished
+ * token list before it pushes the next macro body, a macro called at the
+ * very end of another one shows up as its sibling, not as its child. So
+ * frames are closed wherever in the stack they happen to be.
+ *
+ * At the end of the run we write the call tree to `<jobname>.prof` in the
+ * "collapsed stack" format used by flamegraph.pl and friends, with one
+ * line per call path weighted by its exclusive time in microseconds, and
+ * put a summary of the most expensive control sequences in the log.
+ */
+
+#include "tectonic.h"
+#include "internals.h"
+#include "xetexd.h"
+#include "core-bridge.h"
+
+#include <time.h>
+
+#define CMD_LABEL(c) (-1 - (c))
+#define SITE_LABEL(s) (-1000 - (s))
+#define IS_SITE_LABEL(l) ((l) <= -1000)
+
+#define FRAME_SYNC (-1)
+#define FRAME_PENDING (-2)
+
+#define SUMMARY_LENGTH 30
+
+typedef struct {
+    uint64_t key;
+    int32_t value; /* -1 for an empty slot */
+} prof_slot;
+
+typedef struct {
+    prof_slot *slots;
+    uint32_t mask;
+    uint32_t count;
+} prof_map;
+
+typedef struct {
+    int32_t label;
+    int32_t active; /* frames with this label that are currently open */
+    uint64_t calls;
+    uint64_t outer_start;
+    uint64_t incl_ns;
+    uint64_t excl_ns;
+    char *name;
+} prof_stat;
+
+typedef struct {
+    int32_t parent; /* -1 for a source location at the root */
+    int32_t label;
+    int32_t stat; /* -1 for a source location */
+    uint64_t self_ns;
+} prof_node;
+
+typedef struct {
+    int32_t file;
+    int32_t line;
+} prof_site;
+
+typedef struct {
+    int32_t serial;
+    int32_t node;
+    int32_t level; /* input level of a macro body, or FRAME_SYNC or FRAME_PENDING */
+} prof_frame;
+
+static prof_map stat_map, node_map, site_map, file_map;
+static prof_stat *stats = NULL;
+static int32_t n_stats = 0, stats_size = 0;
+static prof_node *nodes = NULL;
+static int32_t n_nodes = 0, nodes_size = 0;
+static prof_site *sites = NULL;
+static int32_t n_sites = 0, sites_size = 0;
+static char **files = NULL;
+static int32_t n_files = 0, files_size = 0;
+static prof_frame *frames = NULL;
+static int32_t n_frames = 0, frames_size = 0;
+
+static int32_t last_serial = 0;
+static int32_t dispatch_serial = 0;
+static int32_t idle_node = -1;
+static uint64_t last_tick = 0;
+
+
+#define GROW(array, n, size) do {                                       \
+        if ((n) >= (size)) {                                            \
+            (size) = (size) ? 2 * (size) : 256;                         \
+            (array) = xrealloc((array), (size) * sizeof(*(array)));     \
+        }                                                               \
+    } while (0)
+
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+
+static inline uint32_t
+map_hash(uint64_t key)
+{
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (uint32_t) (key >> 32);
+}
+
+static int32_t
+map_get(const prof_map *m, uint64_t key)
+{
+    uint32_t i;
+
+    if (m->slots == NULL)
+        return -1;
+
+    for (i = map_hash(key) & m->mask; m->slots[i].value >= 0; i = (i + 1) & m->mask) {
+        if (m->slots[i].key == key)
+            return m->slots[i].value;
+    }
+
+    return -1;
+}
+
+static void
+map_put_slot(prof_slot *slots, uint32_t mask, uint64_t key, int32_t value)
+{
+    uint32_t i = map_hash(key) & mask;
+
+    while (slots[i].value >= 0)
+        i = (i + 1) & mask;
+
+    slots[i].key = key;
+    slots[i].value = value;
+}
+
+static void
+map_put(prof_map *m, uint64_t key, int32_t value)
+{
+    uint32_t i;
+
+    if (2 * (m->count + 1) > m->mask + 1) {
+        prof_slot *old = m->slots;
+        uint32_t old_size = old ? m->mask + 1 : 0;
+
+        m->mask = old ? 2 * old_size - 1 : 1023;
+        m->slots = xmalloc((m->mask + 1) * sizeof(prof_slot));
+
+        for (i = 0; i <= m->mask; i++)
+            m->slots[i].value = -1;
+
+        for (i = 0; i < old_size; i++) {
+            if (old[i].value >= 0)
+                map_put_slot(m->slots, m->mask, old[i].key, old[i].value);
+        }
+
+        free(old);
+    }
+
+    map_put_slot(m->slots, m->mask, key, value);
+    m->count++;
+}
+
+static void
+map_free(prof_map *m)
+{
+    m->slots = mfree(m->slots);
+    m->mask = 0;
+    m->count = 0;
+}
+
+
+static int32_t
+stat_for_label(int32_t label)
+{
+    int32_t s = map_get(&stat_map, (uint32_t) label);
+
+    if (s >= 0)
+        return s;
+
+    GROW(stats, n_stats, stats_size);
+    s = n_stats++;
+    memset(&stats[s], 0, sizeof(prof_stat));
+    stats[s].label = label;
+    map_put(&stat_map, (uint32_t) label, s);
+    return s;
+}
+
+static int32_t
+child_node(int32_t parent, int32_t label)
+{
+    uint64_t key = ((uint64_t) (uint32_t) (parent + 1) << 32) | (uint32_t) label;
+    int32_t n = map_get(&node_map, key);
+
+    if (n >= 0)
+        return n;
+
+    GROW(nodes, n_nodes, nodes_size);
+    n = n_nodes++;
+    nodes[n].parent = parent;
+    nodes[n].label = label;
+    nodes[n].stat = IS_SITE_LABEL(label) ? -1 : stat_for_label(label);
+    nodes[n].self_ns = 0;
+    map_put(&node_map, key, n);
+    return n;
+}
+
+/* The root node for the source line that TeX is reading. */
+static int32_t
+site_node(void)
+{
+    str_number name = in_open > 0 ? full_source_filename_stack[in_open] : 0;
+    int32_t ln = in_open > 0 ? line : 0;
+    int32_t f, s;
+    uint64_t key;
+
+    f = map_get(&file_map, (uint32_t) name);
+
+    if (f < 0) {
+        GROW(files, n_files, files_size);
+        f = n_files++;
+        files[f] = name > 0 ? gettexstring(name) : NULL;
+        map_put(&file_map, (uint32_t) name, f);
+    }
+
+    key = ((uint64_t) (uint32_t) f << 32) | (uint32_t) ln;
+    s = map_get(&site_map, key);
+
+    if (s < 0) {
+        GROW(sites, n_sites, sites_size);
+        s = n_sites++;
+        sites[s].file = f;
+        sites[s].line = ln;
+        map_put(&site_map, key, s);
+    }
+
+    return child_node(-1, SITE_LABEL(s));
+}
+
+
+/* Charge the time since the last event to the innermost open frame. */
+static void
+tick(void)
+{
+    uint64_t now = now_ns();
+    int32_t n = n_frames > 0 ? frames[n_frames - 1].node : idle_node;
+
+    if (n >= 0 && last_tick != 0) {
+        nodes[n].self_ns += now - last_tick;
+        if (nodes[n].stat >= 0)
+            stats[nodes[n].stat].excl_ns += now - last_tick;
+    }
+
+    last_tick = now;
+}
+
+static int32_t
+push_frame(int32_t label, int32_t level)
+{
+    int32_t parent, n;
+    prof_stat *st;
+
+    tick();
+
+    if (n_frames > 0) {
+        parent = frames[n_frames - 1].node;
+    } else {
+        parent = site_node();
+        idle_node = parent;
+    }
+
+    n = child_node(parent, label);
+    st = &stats[nodes[n].stat];
+    st->calls++;
+    if (st->active++ == 0)
+        st->outer_start = last_tick;
+
+    if (++last_serial <= 0)
+        last_serial = 1;
+
+    GROW(frames, n_frames, frames_size);
+    frames[n_frames].serial = last_serial;
+    frames[n_frames].node = n;
+    frames[n_frames].level = level;
+    n_frames++;
+    return last_serial;
+}
+
+static void
+pop_frame(int32_t i)
+{
+    prof_stat *st = &stats[nodes[frames[i].node].stat];
+
+    tick();
+
+    if (--st->active == 0)
+        st->incl_ns += last_tick - st->outer_start;
+
+    memmove(&frames[i], &frames[i + 1], (n_frames - i - 1) * sizeof(prof_frame));
+    n_frames--;
+}
+
+static int32_t
+label_for(int32_t cs, int32_t cmd)
+{
+    if (cs != 0)
+        return cs;
+    if (cmd == LETTER)
+        cmd = OTHER_CHAR;
+    return CMD_LABEL(cmd);
+}
+
+
+void
+reset_profile(void)
+{
+    int32_t i;
+
+    for (i = 0; i < n_stats; i++)
+        free(stats[i].name);
+    for (i = 0; i < n_files; i++)
+        free(files[i]);
+
+    map_free(&stat_map);
+    map_free(&node_map);
+    map_free(&site_map);
+    map_free(&file_map);
+    stats = mfree(stats);
+    nodes = mfree(nodes);
+    sites = mfree(sites);
+    files = mfree(files);
+    frames = mfree(frames);
+    n_stats = stats_size = 0;
+    n_nodes = nodes_size = 0;
+    n_sites = sites_size = 0;
+    n_files = files_size = 0;
+    n_frames = frames_size = 0;
+    last_serial = 0;
+    dispatch_serial = 0;
+    idle_node = -1;
+    last_tick = 0;
+}
+
+
+int32_t
+profile_enter(int32_t cs, int32_t cmd)
+{
+    return push_frame(label_for(cs, cmd), FRAME_SYNC);
+}
+
+
+void
+profile_leave(int32_t serial)
+{
+    int32_t i;
+
+    for (i = n_frames - 1; i >= 0; i--) {
+        if (frames[i].serial == serial) {
+            pop_frame(i);
+            return;
+        }
+    }
+}
+
+
+/* macro_call() opens a pending frame before it scans the arguments, and
+ * binds it to the input level of the macro body once that has been pushed.
+ * If the call fails, |level| is negative and the frame is dropped. */
+
+void
+profile_enter_macro(int32_t cs)
+{
+    push_frame(label_for(cs, CALL), FRAME_PENDING);
+}
+
+
+void
+profile_bind_macro(int32_t level)
+{
+    int32_t i;
+
+    for (i = n_frames - 1; i >= 0; i--) {
+        if (frames[i].level == FRAME_PENDING) {
+            if (level < 0)
+                pop_frame(i);
+            else
+                frames[i].level = level;
+            return;
+        }
+    }
+}
+
+
+void
+profile_leave_macro(int32_t level)
+{
+    int32_t i;
+
+    for (i = n_frames - 1; i >= 0; i--) {
+        if (frames[i].level == level) {
+            pop_frame(i);
+            return;
+        }
+    }
+}
+
+
+void
+profile_dispatch(int32_t cs, int32_t cmd)
+{
+    profile_end_dispatch();
+    dispatch_serial = profile_enter(cs, cmd);
+}
+
+
+void
+profile_end_dispatch(void)
+{
+    if (dispatch_serial != 0) {
+        profile_leave(dispatch_serial);
+        dispatch_serial = 0;
+    }
+}
+
+
+/* Output */
+
+static void
+put_utf8(char *buf, size_t *len, uint32_t c)
+{
+    if (c < 0x20 || c == 0x7F) {
+        buf[(*len)++] = '^';
+        buf[(*len)++] = '^';
+        buf[(*len)++] = c ^ 0x40;
+    } else if (c == ';') {
+        /* The frame separator of the collapsed format. */
+        memcpy(buf + *len, "(semicolon)", 11);
+        *len += 11;
+    } else if (c < 0x80) {
+        buf[(*len)++] = c;
+    } else if (c < 0x800) {
+        buf[(*len)++] = 0xC0 | (c >> 6);
+        buf[(*len)++] = 0x80 | (c & 0x3F);
+    } else if (c < 0x10000) {
+        buf[(*len)++] = 0xE0 | (c >> 12);
+        buf[(*len)++] = 0x80 | ((c >> 6) & 0x3F);
+        buf[(*len)++] = 0x80 | (c & 0x3F);
+    } else {
+        buf[(*len)++] = 0xF0 | (c >> 18);
+        buf[(*len)++] = 0x80 | ((c >> 12) & 0x3F);
+        buf[(*len)++] = 0x80 | ((c >> 6) & 0x3F);
+        buf[(*len)++] = 0x80 | (c & 0x3F);
+    }
+}
+
+static char *
+label_name(int32_t label)
+{
+    char *buf;
+    size_t len = 0;
+
+    if (label >= HASH_BASE && hash[label].s1 > 0) {
+        str_number s = hash[label].s1;
+        pool_pointer j, end;
+
+        if (s < 65536L) {
+            buf = xmalloc(1 + 11 + 1);
+            buf[len++] = '\\';
+            put_utf8(buf, &len, s);
+        } else {
+            j = str_start[s - 65536L];
+            end = str_start[s + 1 - 65536L];
+            buf = xmalloc(1 + 11 * (end - j) + 1);
+            buf[len++] = '\\';
+
+            for (; j < end; j++) {
+                uint32_t c = str_pool[j];
+
+                if (c >= 0xD800 && c < 0xDC00 && j + 1 < end) {
+                    j++;
+                    c = 0x10000 + (c - 0xD800) * 1024 + (str_pool[j] - 0xDC00);
+                }
+
+                put_utf8(buf, &len, c);
+            }
+        }
+    } else if (label > 0 && label < SINGLE_BASE) {
+        buf = xmalloc(11 + 1);
+        put_utf8(buf, &len, label - ACTIVE_BASE);
+    } else if (label > 0 && label < NULL_CS) {
+        buf = xmalloc(1 + 11 + 1);
+        buf[len++] = '\\';
+        put_utf8(buf, &len, label - SINGLE_BASE);
+    } else {
+        const char *s;
+        char tmp[32];
+
+        switch (label) {
+        case NULL_CS: s = "\\csname\\endcsname"; break;
+        case CMD_LABEL(LEFT_BRACE): s = "(begin-group character)"; break;
+        case CMD_LABEL(RIGHT_BRACE): s = "(end-group character)"; break;
+        case CMD_LABEL(MATH_SHIFT): s = "(math shift character)"; break;
+        case CMD_LABEL(TAB_MARK): s = "(alignment tab character)"; break;
+        case CMD_LABEL(SPACER): s = "(blank space)"; break;
+        case CMD_LABEL(OTHER_CHAR): s = "(characters)"; break;
+        default:
+            if (label > 0)
+                s = "(undefined)";
+            else {
+                snprintf(tmp, sizeof(tmp), "(command %d)", CMD_LABEL(label));
+                s = tmp;
+            }
+            break;
+        }
+
+        return xstrdup(s);
+    }
+
+    buf[len] = '\0';
+    return buf;
+}
+
+static const char *
+node_name(int32_t n, char *site_buf, size_t site_len)
+{
+    prof_stat *st;
+
+    if (nodes[n].stat < 0) {
+        prof_site *site = &sites[SITE_LABEL(0) - nodes[n].label];
+        const char *file = files[site->file];
+
+        if (file == NULL)
+            return "(terminal)";
+
+        snprintf(site_buf, site_len, "%s:%d", file, site->line);
+        return site_buf;
+    }
+
+    st = &stats[nodes[n].stat];
+    if (st->name == NULL)
+        st->name = label_name(st->label);
+    return st->name;
+}
+
+static int
+compare_inclusive(const void *a, const void *b)
+{
+    const prof_stat *sa = &stats[*(const int32_t *) a];
+    const prof_stat *sb = &stats[*(const int32_t *) b];
+
+    if (sa->incl_ns != sb->incl_ns)
+        return sa->incl_ns < sb->incl_ns ? 1 : -1;
+    return 0;
+}
+
+static void
+write_summary(const char *prof_name)
+{
+    selector_t saved_selector = selector;
+    int32_t *order;
+    int32_t i;
+
+    selector = SELECTOR_LOG_ONLY;
+    print_nl_cstr("Macro profile written to ");
+    print_cstr(prof_name);
+    print_char('.');
+    print_ln();
+    selector = saved_selector;
+
+    /* The rest goes straight to the log file, since print() would mangle
+     * non-ASCII control sequence names. */
+    flush_output_buffers();
+
+    order = xmalloc((n_stats + 1) * sizeof(int32_t));
+    for (i = 0; i < n_stats; i++)
+        order[i] = i;
+    qsort(order, n_stats, sizeof(int32_t), compare_inclusive);
+
+    ttstub_fprintf(log_file, "%12s %12s %12s  %s\n", "incl. ms", "excl. ms", "calls", "name");
+
+    for (i = 0; i < n_stats && i < SUMMARY_LENGTH; i++) {
+        prof_stat *st = &stats[order[i]];
+
+        if (st->name == NULL)
+            st->name = label_name(st->label);
+
+        ttstub_fprintf(log_file, "%12.3f %12.3f %12llu  %s\n",
+                       st->incl_ns / 1e6, st->excl_ns / 1e6,
+                       (unsigned long long) st->calls, st->name);
+    }
+
+    free(order);
+}
+
+void
+write_profile(void)
+{
+    rust_output_handle_t out;
+    char *job, *prof_name;
+    char site_buf[1024];
+    int32_t *path = NULL;
+    int32_t path_size = 0;
+    int32_t i, n, depth;
+
+    while (n_frames > 0)
+        pop_frame(n_frames - 1);
+    tick();
+
+    if (job_name == 0 || n_nodes == 0)
+        return;
+
+    job = gettexstring(job_name);
+    prof_name = xmalloc(strlen(job) + strlen(".prof") + 1);
+    strcpy(prof_name, job);
+    strcat(prof_name, ".prof");
+    free(job);
+
+    out = ttstub_output_open(prof_name, 0);
+
+    if (out == NULL) {
+        free(prof_name);
+        return;
+    }
+
+    for (i = 0; i < n_nodes; i++) {
+        uint64_t us = nodes[i].self_ns / 1000;
+
+        if (us == 0)
+            continue;
+
+        depth = 0;
+        for (n = i; n >= 0; n = nodes[n].parent) {
+            GROW(path, depth, path_size);
+            path[depth++] = n;
+        }
+
+        while (depth-- > 0) {
+            const char *name = node_name(path[depth], site_buf, sizeof(site_buf));
+
+            ttstub_output_write(out, name, strlen(name));
+            if (depth > 0)
+                ttstub_output_putc(out, ';');
+        }
+
+        ttstub_fprintf(out, " %llu\n", (unsigned long long) us);
+    }
+
+    ttstub_output_close(out);
+
+    if (log_opened)
+        write_summary(prof_name);
+
+    free(path);
+    free(prof_name);
+}
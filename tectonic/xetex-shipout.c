@@ -9,18 +9,22 @@
 #include "core-bridge.h"
 
 
-#define DVI_BUF_SIZE 16384
-#define HALF_BUF 8192
+/* The DVI buffer. Bytes are flushed to the output file in large chunks, but
+ * the last DVI_KEEP bytes always stay in the buffer: movement() may go back
+ * and turn an earlier `down`/`right` command into a `y`/`z`/`w`/`x` one, and
+ * dvi_pop() may retract a `push`. The buffer grows if a single command needs
+ * more room than is left. */
+#define DVI_BUF_SIZE 65536
+#define DVI_KEEP 16384
 
 static rust_output_handle_t dvi_file;
 static str_number output_file_name;
 static eight_bits *dvi_buf = NULL;
-static int32_t dvi_limit;
+static int32_t dvi_buf_size;
 static int32_t g;
 static int32_t lq, lr;
-static int32_t dvi_ptr;
-static int32_t dvi_offset;
-static int32_t dvi_gone;
+static int32_t dvi_ptr; /* next free byte in dvi_buf */
+static int32_t dvi_offset; /* number of bytes already written to the file */
 static int32_t down_ptr, right_ptr;
 static scaled_t dvi_h, dvi_v;
 static internal_font_number dvi_f;
@@ -37,22 +41,68 @@ static void special_out(int32_t p);
 static void write_out(int32_t p);
 static void pic_out(int32_t p);
 static void write_to_dvi(int32_t a, int32_t b);
-static void dvi_swap(void);
+static void dvi_make_room(int32_t n);
 static void dvi_four(int32_t x);
-static void dvi_two(UTF16_code s);
+static void dvi_out_bytes(const char *data, int32_t n);
+static void dvi_glyph(scaled_t w, uint16_t glyph);
 static void dvi_pop(int32_t l);
 static void dvi_font_def(internal_font_number f);
 
 
+/* Make sure there is room for `n` more bytes in the buffer. The dvi_put
+ * functions below may then store that many bytes without checking. */
+static inline void
+dvi_reserve(int32_t n)
+{
+    if (dvi_buf_size - dvi_ptr < n)
+        dvi_make_room(n);
+}
+
+static inline void
+dvi_put(eight_bits b)
+{
+    dvi_buf[dvi_ptr++] = b;
+}
+
+static inline void
+dvi_put_two(uint16_t s)
+{
+    eight_bits *p = dvi_buf + dvi_ptr;
+
+    p[0] = s >> 8;
+    p[1] = s;
+    dvi_ptr += 2;
+}
+
+static inline void
+dvi_put_four(int32_t x)
+{
+    uint32_t u = (uint32_t) x; /* two's complement, as DVI wants */
+    eight_bits *p = dvi_buf + dvi_ptr;
+
+    p[0] = u >> 24;
+    p[1] = u >> 16;
+    p[2] = u >> 8;
+    p[3] = u;
+    dvi_ptr += 4;
+}
+
+static inline void
+dvi_out(eight_bits b)
+{
+    dvi_reserve(1);
+    dvi_put(b);
+}
+
+
 void
 initialize_shipout_variables(void)
 {
     output_file_name = 0;
     dvi_buf = xmalloc_array(eight_bits, DVI_BUF_SIZE);
-    dvi_limit = DVI_BUF_SIZE;
+    dvi_buf_size = DVI_BUF_SIZE;
     dvi_ptr = 0;
     dvi_offset = 0;
-    dvi_gone = 0;
     down_ptr = TEX_NULL;
     right_ptr = TEX_NULL;
     cur_s = -1;
@@ -77,6 +127,10 @@ ship_out(int32_t p)
     pool_pointer s;
     unsigned char old_setting;
     const char *output_comment = "tectonic";
+    char page_name[16];
+
+    snprintf(page_name, sizeof(page_name), "%d", total_pages + 1);
+    ttstub_trace_begin("ship_out", page_name);
 
     synctex_sheet(INTPAR(mag));
 
@@ -105,7 +159,7 @@ ship_out(int32_t p)
             print_char('.' );
     }
 
-    ttstub_output_flush(rust_stdout);
+    update_terminal();
 
     if (INTPAR(tracing_output) > 0) {
         print_char(']' );
@@ -172,18 +226,12 @@ ship_out(int32_t p)
     }
 
     if (total_pages == 0) {
-        dvi_buf[dvi_ptr] = PRE;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+        dvi_out(PRE);
 
         if (semantic_pagination_enabled)
-            dvi_buf[dvi_ptr] = SPX_ID_BYTE;
+            dvi_out(SPX_ID_BYTE);
         else
-            dvi_buf[dvi_ptr] = XDV_ID_BYTE;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+            dvi_out(XDV_ID_BYTE);
 
         dvi_four(25400000L); /* magic values: conversion ratio for sp */
         dvi_four(473628672L); /* magic values: conversion ratio for sp */
@@ -193,25 +241,16 @@ ship_out(int32_t p)
 
         l = strlen(output_comment);
 
-        dvi_buf[dvi_ptr] = l;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+        dvi_out(l);
 
         for (s = 0; s <= l - 1; s++) {
-            dvi_buf[dvi_ptr] = output_comment[s];
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
+            dvi_out(output_comment[s]);
         }
     }
 
     page_loc = dvi_offset + dvi_ptr;
 
-    dvi_buf[dvi_ptr] = BOP;
-    dvi_ptr++;
-    if (dvi_ptr == dvi_limit)
-        dvi_swap();
+    dvi_out(BOP);
 
     for (k = 0; k <= 9; k++)
         dvi_four(COUNT_REG(k));
@@ -237,21 +276,12 @@ ship_out(int32_t p)
     }
     selector = old_setting;
 
-    dvi_buf[dvi_ptr] = XXX1;
-    dvi_ptr++;
-    if (dvi_ptr == dvi_limit)
-        dvi_swap();
+    dvi_out(XXX1);
 
-    dvi_buf[dvi_ptr] = pool_ptr - str_start[str_ptr - 65536L];
-    dvi_ptr++;
-    if (dvi_ptr == dvi_limit)
-        dvi_swap();
+    dvi_out(pool_ptr - str_start[str_ptr - 65536L]);
 
     for (s = str_start[str_ptr - 65536L]; s <= pool_ptr - 1; s++) {
-        dvi_buf[dvi_ptr] = str_pool[s];
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+        dvi_out(str_pool[s]);
     }
 
     pool_ptr = str_start[str_ptr - 65536L];
@@ -263,10 +293,7 @@ ship_out(int32_t p)
     else
         hlist_out();
 
-    dvi_buf[dvi_ptr] = EOP;
-    dvi_ptr++;
-    if (dvi_ptr == dvi_limit)
-        dvi_swap();
+    dvi_out(EOP);
 
     total_pages++;
     cur_s = -1; /*:662 */
@@ -291,9 +318,10 @@ done: /*1518:*/
         print_char(']');
 
     dead_cycles = 0;
-    ttstub_output_flush (rust_stdout);
+    update_terminal();
     flush_node_list(p);
     synctex_teehs();
+    ttstub_trace_end();
 }
 
 
@@ -502,10 +530,7 @@ hlist_out(void)
     p = mem[this_box + 5].b32.s1;
     cur_s++;
     if (cur_s > 0) {
-        dvi_buf[dvi_ptr] = PUSH;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+        dvi_out(PUSH);
     }
     if (cur_s > max_push)
         max_push = cur_s;
@@ -565,43 +590,15 @@ hlist_out(void)
                         font_used[f] = true;
                     }
                     if (f <= 64) {
-                        dvi_buf[dvi_ptr] = f + 170;
-                        dvi_ptr++;
-                        if (dvi_ptr == dvi_limit)
-                            dvi_swap();
+                        dvi_out(f + 170);
                     } else if (f <= 256) {
-                        {
-                            dvi_buf[dvi_ptr] = FNT1;
-                            dvi_ptr++;
-                            if (dvi_ptr == dvi_limit)
-                                dvi_swap();
-                        }
-                        {
-                            dvi_buf[dvi_ptr] = f - 1;
-                            dvi_ptr++;
-                            if (dvi_ptr == dvi_limit)
-                                dvi_swap();
-                        }
+                        dvi_out(FNT1);
+                        dvi_out(f - 1);
                     } else {
 
-                        {
-                            dvi_buf[dvi_ptr] = (FNT1 + 1);
-                            dvi_ptr++;
-                            if (dvi_ptr == dvi_limit)
-                                dvi_swap();
-                        }
-                        {
-                            dvi_buf[dvi_ptr] = (f - 1) / 256;
-                            dvi_ptr++;
-                            if (dvi_ptr == dvi_limit)
-                                dvi_swap();
-                        }
-                        {
-                            dvi_buf[dvi_ptr] = (f - 1) % 256;
-                            dvi_ptr++;
-                            if (dvi_ptr == dvi_limit)
-                                dvi_swap();
-                        }
+                        dvi_out((FNT1 + 1));
+                        dvi_out((f - 1) / 256);
+                        dvi_out((f - 1) % 256);
                     }
                     dvi_f = f;
                 }
@@ -611,17 +608,9 @@ hlist_out(void)
 
                         if ((FONT_CHARACTER_INFO(f, c).s3 > 0)) {
                             if (c >= 128) {
-                                dvi_buf[dvi_ptr] = SET1;
-                                dvi_ptr++;
-                                if (dvi_ptr == dvi_limit)
-                                    dvi_swap();
-                            }
-                            {
-                                dvi_buf[dvi_ptr] = c;
-                                dvi_ptr++;
-                                if (dvi_ptr == dvi_limit)
-                                    dvi_swap();
+                                dvi_out(SET1);
                             }
+                            dvi_out(c);
                             cur_h = cur_h + FONT_CHARACTER_WIDTH(f, c);
                             goto continue_;
                         }
@@ -696,119 +685,40 @@ hlist_out(void)
                                     font_used[f] = true;
                                 }
                                 if (f <= 64) {
-                                    dvi_buf[dvi_ptr] = f + 170;
-                                    dvi_ptr++;
-                                    if (dvi_ptr == dvi_limit)
-                                        dvi_swap();
+                                    dvi_out(f + 170);
                                 } else if (f <= 256) {
-                                    {
-                                        dvi_buf[dvi_ptr] = FNT1;
-                                        dvi_ptr++;
-                                        if (dvi_ptr == dvi_limit)
-                                            dvi_swap();
-                                    }
-                                    {
-                                        dvi_buf[dvi_ptr] = f - 1;
-                                        dvi_ptr++;
-                                        if (dvi_ptr == dvi_limit)
-                                            dvi_swap();
-                                    }
+                                    dvi_out(FNT1);
+                                    dvi_out(f - 1);
                                 } else {
 
-                                    {
-                                        dvi_buf[dvi_ptr] = (FNT1 + 1);
-                                        dvi_ptr++;
-                                        if (dvi_ptr == dvi_limit)
-                                            dvi_swap();
-                                    }
-                                    {
-                                        dvi_buf[dvi_ptr] = (f - 1) / 256;
-                                        dvi_ptr++;
-                                        if (dvi_ptr == dvi_limit)
-                                            dvi_swap();
-                                    }
-                                    {
-                                        dvi_buf[dvi_ptr] = (f - 1) % 256;
-                                        dvi_ptr++;
-                                        if (dvi_ptr == dvi_limit)
-                                            dvi_swap();
-                                    }
+                                    dvi_out((FNT1 + 1));
+                                    dvi_out((f - 1) / 256);
+                                    dvi_out((f - 1) % 256);
                                 }
                                 dvi_f = f;
                             }
                             if (mem[p].b16.s0 == GLYPH_NODE) {
-                                {
-                                    dvi_buf[dvi_ptr] = SET_GLYPHS;
-                                    dvi_ptr++;
-                                    if (dvi_ptr == dvi_limit)
-                                        dvi_swap();
-                                }
-                                dvi_four(mem[p + 1].b32.s1);
-                                dvi_two(1);
-                                dvi_four(0);
-                                dvi_four(0);
-                                dvi_two(mem[p + 4].b16.s1);
+                                dvi_glyph(mem[p + 1].b32.s1, mem[p + 4].b16.s1);
                                 cur_h = cur_h + mem[p + 1].b32.s1;
                             } else {
 
                                 if (mem[p].b16.s0 == NATIVE_WORD_NODE_AT) {
                                     if ((mem[p + 4].b16.s1 > 0) || (mem[p + 5].ptr != NULL)) {
-                                        {
-                                            dvi_buf[dvi_ptr] = SET_TEXT_AND_GLYPHS;
-                                            dvi_ptr++;
-                                            if (dvi_ptr == dvi_limit)
-                                                dvi_swap();
-                                        }
                                         len = mem[p + 4].b16.s1;
-                                        dvi_two(len);
-                                        {
-                                            register int32_t for_end;
-                                            k = 0;
-                                            for_end = len - 1;
-                                            if (k <= for_end)
-                                                do {
-                                                    dvi_two(get_native_char(p, k));
-                                                }
-                                                while (k++ < for_end);
-                                        }
+                                        dvi_reserve(3 + 2 * len);
+                                        dvi_put(SET_TEXT_AND_GLYPHS);
+                                        dvi_put_two(len);
+                                        for (k = 0; k < len; k++)
+                                            dvi_put_two(get_native_char(p, k));
                                         len = make_xdv_glyph_array_data(p);
-                                        {
-                                            register int32_t for_end;
-                                            k = 0;
-                                            for_end = len - 1;
-                                            if (k <= for_end)
-                                                do {
-                                                    dvi_buf[dvi_ptr] = xdv_buffer[k];
-                                                    dvi_ptr++;
-                                                    if (dvi_ptr == dvi_limit)
-                                                        dvi_swap();
-                                                }
-                                                while (k++ < for_end);
-                                        }
+                                        dvi_out_bytes(xdv_buffer, len);
                                     }
                                 } else {
 
                                     if (mem[p + 5].ptr != NULL) {
-                                        {
-                                            dvi_buf[dvi_ptr] = SET_GLYPHS;
-                                            dvi_ptr++;
-                                            if (dvi_ptr == dvi_limit)
-                                                dvi_swap();
-                                        }
+                                        dvi_out(SET_GLYPHS);
                                         len = make_xdv_glyph_array_data(p);
-                                        {
-                                            register int32_t for_end;
-                                            k = 0;
-                                            for_end = len - 1;
-                                            if (k <= for_end)
-                                                do {
-                                                    dvi_buf[dvi_ptr] = xdv_buffer[k];
-                                                    dvi_ptr++;
-                                                    if (dvi_ptr == dvi_limit)
-                                                        dvi_swap();
-                                                }
-                                                while (k++ < for_end);
-                                        }
+                                        dvi_out_bytes(xdv_buffer, len);
                                     }
                                 }
                                 cur_h = cur_h + mem[p + 1].b32.s1;
@@ -1047,12 +957,7 @@ hlist_out(void)
                     movement(cur_v - dvi_v, DOWN1);
                     dvi_v = cur_v;
                 }
-                {
-                    dvi_buf[dvi_ptr] = SET_RULE;
-                    dvi_ptr++;
-                    if (dvi_ptr == dvi_limit)
-                        dvi_swap();
-                }
+                dvi_out(SET_RULE);
                 dvi_four(rule_ht);
                 dvi_four(rule_wd);
                 cur_v = base_line;
@@ -1123,10 +1028,7 @@ vlist_out(void)
     upwards = (mem[this_box].b16.s0 == 1);
     cur_s++;
     if (cur_s > 0) {
-        dvi_buf[dvi_ptr] = PUSH;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+        dvi_out(PUSH);
     }
     if (cur_s > max_push)
         max_push = cur_s;
@@ -1222,57 +1124,19 @@ vlist_out(void)
                                     font_used[f] = true;
                                 }
                                 if (f <= 64) {
-                                    dvi_buf[dvi_ptr] = f + 170;
-                                    dvi_ptr++;
-                                    if (dvi_ptr == dvi_limit)
-                                        dvi_swap();
+                                    dvi_out(f + 170);
                                 } else if (f <= 256) {
-                                    {
-                                        dvi_buf[dvi_ptr] = FNT1;
-                                        dvi_ptr++;
-                                        if (dvi_ptr == dvi_limit)
-                                            dvi_swap();
-                                    }
-                                    {
-                                        dvi_buf[dvi_ptr] = f - 1;
-                                        dvi_ptr++;
-                                        if (dvi_ptr == dvi_limit)
-                                            dvi_swap();
-                                    }
+                                    dvi_out(FNT1);
+                                    dvi_out(f - 1);
                                 } else {
 
-                                    {
-                                        dvi_buf[dvi_ptr] = (FNT1 + 1);
-                                        dvi_ptr++;
-                                        if (dvi_ptr == dvi_limit)
-                                            dvi_swap();
-                                    }
-                                    {
-                                        dvi_buf[dvi_ptr] = (f - 1) / 256;
-                                        dvi_ptr++;
-                                        if (dvi_ptr == dvi_limit)
-                                            dvi_swap();
-                                    }
-                                    {
-                                        dvi_buf[dvi_ptr] = (f - 1) % 256;
-                                        dvi_ptr++;
-                                        if (dvi_ptr == dvi_limit)
-                                            dvi_swap();
-                                    }
+                                    dvi_out((FNT1 + 1));
+                                    dvi_out((f - 1) / 256);
+                                    dvi_out((f - 1) % 256);
                                 }
                                 dvi_f = f;
                             }
-                            {
-                                dvi_buf[dvi_ptr] = SET_GLYPHS;
-                                dvi_ptr++;
-                                if (dvi_ptr == dvi_limit)
-                                    dvi_swap();
-                            }
-                            dvi_four(0);
-                            dvi_two(1);
-                            dvi_four(0);
-                            dvi_four(0);
-                            dvi_two(mem[p + 4].b16.s1);
+                            dvi_glyph(0, mem[p + 4].b16.s1);
                             cur_v = cur_v + mem[p + 2].b32.s1;
                             cur_h = left_edge;
                         }
@@ -1423,12 +1287,7 @@ vlist_out(void)
                     movement(cur_v - dvi_v, DOWN1);
                     dvi_v = cur_v;
                 }
-                {
-                    dvi_buf[dvi_ptr] = PUT_RULE;
-                    dvi_ptr++;
-                    if (dvi_ptr == dvi_limit)
-                        dvi_swap();
-                }
+                dvi_out(PUT_RULE);
                 dvi_four(rule_ht);
                 dvi_four(rule_wd);
                 cur_h = left_edge;
@@ -1676,7 +1535,7 @@ out_what(int32_t p)
         }
 
         if (write_open[j])
-            ttstub_output_close(write_file[j]);
+            close_output(write_file[j]);
 
         if (mem[p].b16.s0 == CLOSE_NODE) {
             write_open[j] = false;
@@ -1737,12 +1596,7 @@ static void
 dvi_native_font_def(internal_font_number f)
 {
     int32_t font_def_length, i;
-    {
-        dvi_buf[dvi_ptr] = DEFINE_NATIVE_FONT;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
-    }
+    dvi_out(DEFINE_NATIVE_FONT);
     dvi_four(f - 1);
     font_def_length = make_font_def(f);
     {
@@ -1751,10 +1605,7 @@ dvi_native_font_def(internal_font_number f)
         for_end = font_def_length - 1;
         if (i <= for_end)
             do {
-                dvi_buf[dvi_ptr] = xdv_buffer[i];
-                dvi_ptr++;
-                if (dvi_ptr == dvi_limit)
-                    dvi_swap();
+                dvi_out(xdv_buffer[i]);
             }
             while (i++ < for_end);
     }
@@ -1771,71 +1622,21 @@ dvi_font_def(internal_font_number f)
     else {
 
         if (f <= 256) {
-            {
-                dvi_buf[dvi_ptr] = FNT_DEF1;
-                dvi_ptr++;
-                if (dvi_ptr == dvi_limit)
-                    dvi_swap();
-            }
-            {
-                dvi_buf[dvi_ptr] = f - 1;
-                dvi_ptr++;
-                if (dvi_ptr == dvi_limit)
-                    dvi_swap();
-            }
+            dvi_out(FNT_DEF1);
+            dvi_out(f - 1);
         } else {
 
-            {
-                dvi_buf[dvi_ptr] = (FNT_DEF1 + 1);
-                dvi_ptr++;
-                if (dvi_ptr == dvi_limit)
-                    dvi_swap();
-            }
-            {
-                dvi_buf[dvi_ptr] = (f - 1) / 256;
-                dvi_ptr++;
-                if (dvi_ptr == dvi_limit)
-                    dvi_swap();
-            }
-            {
-                dvi_buf[dvi_ptr] = (f - 1) % 256;
-                dvi_ptr++;
-                if (dvi_ptr == dvi_limit)
-                    dvi_swap();
-            }
-        }
-        {
-            dvi_buf[dvi_ptr] = font_check[f].s3;
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
-        }
-        {
-            dvi_buf[dvi_ptr] = font_check[f].s2;
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
-        }
-        {
-            dvi_buf[dvi_ptr] = font_check[f].s1;
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
-        }
-        {
-            dvi_buf[dvi_ptr] = font_check[f].s0;
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
+            dvi_out((FNT_DEF1 + 1));
+            dvi_out((f - 1) / 256);
+            dvi_out((f - 1) % 256);
         }
+        dvi_out(font_check[f].s3);
+        dvi_out(font_check[f].s2);
+        dvi_out(font_check[f].s1);
+        dvi_out(font_check[f].s0);
         dvi_four(font_size[f]);
         dvi_four(font_dsize[f]);
-        {
-            dvi_buf[dvi_ptr] = length(font_area[f]);
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
-        }
+        dvi_out(length(font_area[f]));
         l = 0;
         k = str_start[(font_name[f]) - 65536L];
         while ((l == 0) && (k < str_start[(font_name[f] + 1) - 65536L])) {
@@ -1846,22 +1647,14 @@ dvi_font_def(internal_font_number f)
         }
         if (l == 0)
             l = length(font_name[f]);
-        {
-            dvi_buf[dvi_ptr] = l;
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
-        }
+        dvi_out(l);
         {
             register int32_t for_end;
             k = str_start[(font_area[f]) - 65536L];
             for_end = str_start[(font_area[f] + 1) - 65536L] - 1;
             if (k <= for_end)
                 do {
-                    dvi_buf[dvi_ptr] = str_pool[k];
-                    dvi_ptr++;
-                    if (dvi_ptr == dvi_limit)
-                        dvi_swap();
+                    dvi_out(str_pool[k]);
                 }
                 while (k++ < for_end);
         }
@@ -1871,10 +1664,7 @@ dvi_font_def(internal_font_number f)
             for_end = str_start[(font_name[f]) - 65536L] + l - 1;
             if (k <= for_end)
                 do {
-                    dvi_buf[dvi_ptr] = str_pool[k];
-                    dvi_ptr++;
-                    if (dvi_ptr == dvi_limit)
-                        dvi_swap();
+                    dvi_out(str_pool[k]);
                 }
                 while (k++ < for_end);
         }
@@ -1912,12 +1702,10 @@ movement(scaled_t w, eight_bits o)
             case (MOV_NONE_SEEN + MOV_Y_OK):
             case (MOV_Z_SEEN + MOV_YZ_OK):
             case (MOV_Z_SEEN + MOV_Y_OK):
-                if (mem[p + 2].b32.s1 < dvi_gone) {
+                if (mem[p + 2].b32.s1 < dvi_offset) {
                     goto not_found;
                 } else { /*633:*/
                     k = mem[p + 2].b32.s1 - dvi_offset;
-                    if (k < 0)
-                        k = k + DVI_BUF_SIZE;
                     dvi_buf[k] = dvi_buf[k] + 5;
                     mem[p].b32.s0 = MOV_Y_HERE;
                     goto found;
@@ -1927,12 +1715,10 @@ movement(scaled_t w, eight_bits o)
             case (MOV_NONE_SEEN + MOV_Z_OK):
             case (MOV_Y_SEEN + MOV_YZ_OK):
             case (MOV_Y_SEEN + MOV_Z_OK):
-                if (mem[p + 2].b32.s1 < dvi_gone) {
+                if (mem[p + 2].b32.s1 < dvi_offset) {
                     goto not_found;
                 } else { /*634:*/
                     k = mem[p + 2].b32.s1 - dvi_offset;
-                    if (k < 0)
-                        k = k + DVI_BUF_SIZE;
                     dvi_buf[k] = dvi_buf[k] + 10;
                     mem[p].b32.s0 = MOV_Z_HERE;
                     goto found;
@@ -1972,74 +1758,32 @@ movement(scaled_t w, eight_bits o)
 not_found:
     mem[q].b32.s0 = MOV_YZ_OK;
 
-    if (abs(w) >= 0x800000) {
-        dvi_buf[dvi_ptr] = o + 3;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
-        dvi_four(w);
-        return;
-    }
-
-    if (abs(w) >= 0x8000) {
-        dvi_buf[dvi_ptr] = o + 2;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
-
-        if (w < 0)
-            w = w + 0x1000000;
-
-        dvi_buf[dvi_ptr] = w / 0x10000;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
-        w = w % 0x10000;
-        goto lab2;
-    }
-
-    if (abs(w) >= 128) {
-        dvi_buf[dvi_ptr] = o + 1;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+    /* Operands are signed big-endian, so the low bytes of the two's
+     * complement are what we want. */
+    dvi_reserve(5);
 
-        if (w < 0)
-            w = w + 0x10000;
-        goto lab2;
+    if (abs(w) >= 0x800000) {
+        dvi_put(o + 3);
+        dvi_put_four(w);
+    } else if (abs(w) >= 0x8000) {
+        dvi_put(o + 2);
+        dvi_put(((uint32_t) w >> 16) & 0xFF);
+        dvi_put_two(w & 0xFFFF);
+    } else if (abs(w) >= 128) {
+        dvi_put(o + 1);
+        dvi_put_two(w & 0xFFFF);
+    } else {
+        dvi_put(o);
+        dvi_put(w & 0xFF);
     }
 
-    dvi_buf[dvi_ptr] = o;
-    dvi_ptr++;
-    if (dvi_ptr == dvi_limit)
-        dvi_swap();
-
-    if (w < 0)
-        w = w + 256;
-    goto lab1;
-
-lab2:
-    dvi_buf[dvi_ptr] = w / 256;
-    dvi_ptr++;
-    if (dvi_ptr == dvi_limit)
-        dvi_swap();
-
-lab1:
-    dvi_buf[dvi_ptr] = w % 256;
-    dvi_ptr++;
-    if (dvi_ptr == dvi_limit)
-        dvi_swap();
-
     return;
 
 found: /*629:*/
     mem[q].b32.s0 = mem[p].b32.s0;
 
     if (mem[q].b32.s0 == MOV_Y_HERE) {
-        dvi_buf[dvi_ptr] = o + 4;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+        dvi_out(o + 4);
 
         while (mem[q].b32.s1 != p) {
             q = mem[q].b32.s1;
@@ -2054,10 +1798,7 @@ found: /*629:*/
             }
         }
     } else {
-        dvi_buf[dvi_ptr] = o + 9;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+        dvi_out(o + 9);
 
         while (mem[q].b32.s1 != p) {
             q = mem[q].b32.s1;
@@ -2127,26 +1868,11 @@ special_out(int32_t p)
             overflow("pool size", pool_size - init_pool_ptr);
     }
     if ((pool_ptr - str_start[str_ptr - 65536L]) < 256) {
-        {
-            dvi_buf[dvi_ptr] = XXX1;
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
-        }
-        {
-            dvi_buf[dvi_ptr] = (pool_ptr - str_start[str_ptr - 65536L]);
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
-        }
+        dvi_out(XXX1);
+        dvi_out((pool_ptr - str_start[str_ptr - 65536L]));
     } else {
 
-        {
-            dvi_buf[dvi_ptr] = XXX4;
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
-        }
+        dvi_out(XXX4);
         dvi_four((pool_ptr - str_start[str_ptr - 65536L]));
     }
     {
@@ -2155,10 +1881,7 @@ special_out(int32_t p)
         for_end = pool_ptr - 1;
         if (k <= for_end)
             do {
-                dvi_buf[dvi_ptr] = str_pool[k];
-                dvi_ptr++;
-                if (dvi_ptr == dvi_limit)
-                    dvi_swap();
+                dvi_out(str_pool[k]);
             }
             while (k++ < for_end);
     }
@@ -2321,26 +2044,11 @@ pic_out(int32_t p)
     print(')');
     selector = old_setting;
     if ((pool_ptr - str_start[str_ptr - 65536L]) < 256) {
-        {
-            dvi_buf[dvi_ptr] = XXX1;
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
-        }
-        {
-            dvi_buf[dvi_ptr] = (pool_ptr - str_start[str_ptr - 65536L]);
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
-        }
+        dvi_out(XXX1);
+        dvi_out((pool_ptr - str_start[str_ptr - 65536L]));
     } else {
 
-        {
-            dvi_buf[dvi_ptr] = XXX4;
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
-        }
+        dvi_out(XXX4);
         dvi_four((pool_ptr - str_start[str_ptr - 65536L]));
     }
     {
@@ -2349,10 +2057,7 @@ pic_out(int32_t p)
         for_end = pool_ptr - 1;
         if (k <= for_end)
             do {
-                dvi_buf[dvi_ptr] = str_pool[k];
-                dvi_ptr++;
-                if (dvi_ptr == dvi_limit)
-                    dvi_swap();
+                dvi_out(str_pool[k]);
             }
             while (k++ < for_end);
     }
@@ -2367,15 +2072,9 @@ finalize_dvi_file(void)
 
     while (cur_s > -1) {
         if (cur_s > 0) {
-            dvi_buf[dvi_ptr] = POP;
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
+            dvi_out(POP);
         } else {
-            dvi_buf[dvi_ptr] = EOP;
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
+            dvi_out(EOP);
             total_pages++;
         }
         cur_s--;
@@ -2384,10 +2083,7 @@ finalize_dvi_file(void)
     if (total_pages == 0)
         print_nl_cstr("No pages of output.");
     else if (cur_s != -2) {
-        dvi_buf[dvi_ptr] = POST;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+        dvi_out(POST);
 
         dvi_four(last_bop);
         last_bop = dvi_offset + dvi_ptr - 5;
@@ -2398,25 +2094,13 @@ finalize_dvi_file(void)
         dvi_four(max_v);
         dvi_four(max_h);
 
-        dvi_buf[dvi_ptr] = max_push / 256;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+        dvi_out(max_push / 256);
 
-        dvi_buf[dvi_ptr] = max_push % 256;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+        dvi_out(max_push % 256);
 
-        dvi_buf[dvi_ptr] = (total_pages / 256) % 256;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+        dvi_out((total_pages / 256) % 256);
 
-        dvi_buf[dvi_ptr] = total_pages % 256;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+        dvi_out(total_pages % 256);
 
         while (font_ptr > FONT_BASE) {
             if (font_used[font_ptr])
@@ -2424,34 +2108,22 @@ finalize_dvi_file(void)
             font_ptr--;
         }
 
-        dvi_buf[dvi_ptr] = POST_POST;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+        dvi_out(POST_POST);
 
         dvi_four(last_bop);
 
         if (semantic_pagination_enabled)
-            dvi_buf[dvi_ptr] = SPX_ID_BYTE;
+            dvi_out(SPX_ID_BYTE);
         else
-            dvi_buf[dvi_ptr] = XDV_ID_BYTE;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+            dvi_out(XDV_ID_BYTE);
 
-        k = 4 + (DVI_BUF_SIZE - dvi_ptr) % 4;
+        k = 4 + (4 - (dvi_offset + dvi_ptr) % 4) % 4;
 
         while (k > 0) {
-            dvi_buf[dvi_ptr] = 223;
-            dvi_ptr++;
-            if (dvi_ptr == dvi_limit)
-                dvi_swap();
+            dvi_out(223);
             k--;
         }
 
-        if (dvi_limit == HALF_BUF)
-            write_to_dvi(HALF_BUF, DVI_BUF_SIZE - 1);
-
         if (dvi_ptr > TEX_INFINITY - dvi_offset) {
             cur_s = -2;
             fatal_error("dvi length exceeds \"7FFFFFFF");
@@ -2499,76 +2171,64 @@ write_to_dvi(int32_t a, int32_t b)
 }
 
 
+/* Called by dvi_reserve() when fewer than `n` bytes are free: flush all but
+ * the last DVI_KEEP bytes to the file, and grow the buffer if that still
+ * isn't enough. */
 static void
-dvi_swap(void)
+dvi_make_room(int32_t n)
 {
+    int32_t keep = (dvi_ptr < DVI_KEEP) ? dvi_ptr : DVI_KEEP;
+    int32_t flush = dvi_ptr - keep;
+
     if (dvi_ptr > (TEX_INFINITY - dvi_offset)) {
         cur_s = -2;
         fatal_error("dvi length exceeds \"7FFFFFFF");
     }
-    if (dvi_limit == DVI_BUF_SIZE) {
-        write_to_dvi(0, HALF_BUF - 1);
-        dvi_limit = HALF_BUF;
-        dvi_offset = dvi_offset + DVI_BUF_SIZE;
-        dvi_ptr = 0;
-    } else {
 
-        write_to_dvi(HALF_BUF, DVI_BUF_SIZE - 1);
-        dvi_limit = DVI_BUF_SIZE;
+    if (flush > 0) {
+        write_to_dvi(0, flush - 1);
+        memmove(dvi_buf, dvi_buf + flush, keep);
+        dvi_offset += flush;
+        dvi_ptr = keep;
+    }
+
+    if (dvi_buf_size - dvi_ptr < n) {
+        while (dvi_buf_size - dvi_ptr < n)
+            dvi_buf_size *= 2;
+        dvi_buf = xrealloc(dvi_buf, dvi_buf_size);
     }
-    dvi_gone = dvi_gone + HALF_BUF;
 }
 
 
 static void
 dvi_four(int32_t x)
 {
-    if (x >= 0) {
-        dvi_buf[dvi_ptr] = x / 0x1000000;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
-    } else {
-        x = x + 0x40000000;
-        x = x + 0x40000000;
+    dvi_reserve(4);
+    dvi_put_four(x);
+}
 
-        dvi_buf[dvi_ptr] = (x / 0x1000000) + 128;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
-    }
 
-    x = x % 0x1000000;
-    dvi_buf[dvi_ptr] = x / 0x10000;
-    dvi_ptr++;
-    if (dvi_ptr == dvi_limit)
-        dvi_swap();
-
-    x = x % 0x10000;
-    dvi_buf[dvi_ptr] = x / 0x100;
-    dvi_ptr++;
-    if (dvi_ptr == dvi_limit)
-        dvi_swap();
-
-    dvi_buf[dvi_ptr] = x % 0x100;
-    dvi_ptr++;
-    if (dvi_ptr == dvi_limit)
-        dvi_swap();
+static void
+dvi_out_bytes(const char *data, int32_t n)
+{
+    dvi_reserve(n);
+    memcpy(dvi_buf + dvi_ptr, data, n);
+    dvi_ptr += n;
 }
 
 
+/* A `set_glyphs` command for a single glyph at the origin, as used for
+ * glyph nodes. */
 static void
-dvi_two(UTF16_code s)
+dvi_glyph(scaled_t w, uint16_t glyph)
 {
-    dvi_buf[dvi_ptr] = s / 0x100;
-    dvi_ptr++;
-    if (dvi_ptr == dvi_limit)
-        dvi_swap();
-
-    dvi_buf[dvi_ptr] = s % 0x100;
-    dvi_ptr++;
-    if (dvi_ptr == dvi_limit)
-        dvi_swap();
+    dvi_reserve(17);
+    dvi_put(SET_GLYPHS);
+    dvi_put_four(w);
+    dvi_put_two(1);
+    dvi_put_four(0);
+    dvi_put_four(0);
+    dvi_put_two(glyph);
 }
 
 
@@ -2579,9 +2239,6 @@ dvi_pop(int32_t l)
         dvi_ptr--;
     else {
 
-        dvi_buf[dvi_ptr] = POP;
-        dvi_ptr++;
-        if (dvi_ptr == dvi_limit)
-            dvi_swap();
+        dvi_out(POP);
     }
 }
@@ -177,7 +177,7 @@ int32_t get_avail(void)
     p = avail;
     if (p != TEX_NULL)
         avail = mem[avail].b32.s1;
-    else if (mem_end < MEM_TOP) {
+    else if (mem_end < mem_max) {
         mem_end++;
         p = mem_end;
     } else {
@@ -186,7 +186,7 @@ int32_t get_avail(void)
         p = hi_mem_min;
         if (is_char_node(lo_mem_max)) {
             runaway();
-            overflow("main memory size", MEM_TOP + 1);
+            overflow("main memory size", mem_max + 1 - mem_min);
         }
     }
     mem[p].b32.s1 = TEX_NULL;
@@ -207,6 +207,62 @@ void flush_list(int32_t p)
     }
 }
 
+/* Nodes smaller than NODE_SIZE_CLASSES words are recycled through per-size
+ * free lists, much like the one-word `avail` list, so that the common node
+ * sizes are allocated and freed in O(1) without walking the rover ring. The
+ * rover only sees odd sizes and whatever we flush back to it when memory gets
+ * tight. INITEX always uses the rover so that dumped formats are unaffected.
+ * node_alloc_count tallies get_node() calls by size, with every size of
+ * NODE_SIZE_CLASSES or more in the last slot. */
+
+void reset_node_free_lists(void)
+{
+    int32_t k;
+
+    for (k = 0; k < NODE_SIZE_CLASSES; k++)
+        node_free_list[k] = TEX_NULL;
+
+    for (k = 0; k <= NODE_SIZE_CLASSES; k++)
+        node_alloc_count[k] = 0;
+}
+
+
+static void
+free_node_to_rover(int32_t p, int32_t s)
+{
+    memory_word *mem = zmem; int32_t q;
+    mem[p].b32.s0 = s;
+    mem[p].b32.s1 = MAX_HALFWORD;
+    q = mem[rover + 1].b32.s0;
+    mem[p + 1].b32.s0 = q;
+    mem[p + 1].b32.s1 = rover;
+    mem[rover + 1].b32.s0 = p;
+    mem[q + 1].b32.s1 = p;
+}
+
+
+/* Hand every node sitting in the size-class lists back to the rover, so that
+ * they can be merged into larger blocks. Returns whether anything was freed. */
+static bool
+flush_node_free_lists(void)
+{
+    memory_word *mem = zmem;
+    bool flushed = false;
+    int32_t k, p;
+
+    for (k = 0; k < NODE_SIZE_CLASSES; k++) {
+        while (node_free_list[k] != TEX_NULL) {
+            p = node_free_list[k];
+            node_free_list[k] = mem[p].b32.s1;
+            free_node_to_rover(p, k);
+            flushed = true;
+        }
+    }
+
+    return flushed;
+}
+
+
 int32_t get_node(int32_t s)
 {
     memory_word *mem = zmem; int32_t p;
@@ -214,6 +270,17 @@ int32_t get_node(int32_t s)
     int32_t r;
     int32_t t;
 
+    if (s < NODE_SIZE_CLASSES) {
+        node_alloc_count[s]++;
+        r = node_free_list[s];
+        if (r != TEX_NULL) {
+            node_free_list[s] = mem[r].b32.s1;
+            goto found;
+        }
+    } else {
+        node_alloc_count[NODE_SIZE_CLASSES]++;
+    }
+
 restart:
     p = rover;
 
@@ -274,7 +341,10 @@ restart:
             goto restart;
         }
     }
-    overflow("main memory size", MEM_TOP + 1);
+    if (flush_node_free_lists())
+        goto restart;
+
+    overflow("main memory size", mem_max + 1 - mem_min);
 
 found:
     mem[r].b32.s1 = TEX_NULL;
@@ -287,14 +357,15 @@ found:
 
 void free_node(int32_t p, int32_t s)
 {
-    memory_word *mem = zmem; int32_t q;
-    mem[p].b32.s0 = s;
-    mem[p].b32.s1 = MAX_HALFWORD;
-    q = mem[rover + 1].b32.s0;
-    mem[p + 1].b32.s0 = q;
-    mem[p + 1].b32.s1 = rover;
-    mem[rover + 1].b32.s0 = p;
-    mem[q + 1].b32.s1 = p;
+    memory_word *mem = zmem;
+
+    if (s < NODE_SIZE_CLASSES && !in_initex_mode) {
+        mem[p].b32.s1 = node_free_list[s];
+        node_free_list[s] = p;
+        return;
+    }
+
+    free_node_to_rover(p, s);
 }
 
 int32_t new_null_box(void)
@@ -604,7 +675,7 @@ void print_spec(int32_t p, const char* s)
 {
     memory_word *mem = zmem;
 
-    if (p < 0 || p >= lo_mem_max)
+    if (p < mem_min || p >= lo_mem_max)
         print_char('*');
     else {
         print_scaled(mem[p + 1].b32.s1);
@@ -3677,6 +3748,166 @@ void not_native_font_error(int32_t cmd, int32_t c, int32_t f)
 /*:1434*/
 
 
+/* An auxiliary index over the control-sequence hash table. TeX's own hash
+ * is a chained table with a fixed number of buckets whose positions end up
+ * in the format file, so we leave it exactly as it is and keep an
+ * open-addressed table next to it, keyed by a stronger hash of the name,
+ * that maps names straight to their |hash| positions. With a large format
+ * the TeX chains get long, and this saves walking them and comparing
+ * strings on every lookup. Names are hashed as the UTF-16 code units that
+ * are stored in the string pool, four to a word. */
+
+typedef struct {
+    uint32_t hash;
+    int32_t p; /* 0 for an empty slot */
+} cs_index_entry;
+
+static cs_index_entry *cs_index = NULL;
+static uint32_t cs_index_mask = 0;
+static uint32_t cs_index_count = 0;
+
+#define CS_INDEX_MIN_SIZE 16384
+
+/* For the metrics: calls to id_lookup(), and index slots they examined. */
+uint64_t cs_lookups = 0;
+uint64_t cs_index_probes = 0;
+
+typedef struct {
+    uint64_t h;
+    uint64_t w;
+    int n;
+} cs_hasher;
+
+static inline void
+cs_hash_word(cs_hasher *st)
+{
+    st->h = (st->h ^ st->w) * 0x9E3779B97F4A7C15ULL;
+    st->h ^= st->h >> 29;
+    st->w = 0;
+}
+
+static inline void
+cs_hash_unit(cs_hasher *st, uint16_t u)
+{
+    st->w = (st->w << 16) | u;
+    if (++st->n % 4 == 0)
+        cs_hash_word(st);
+}
+
+static inline uint32_t
+cs_hash_finish(cs_hasher *st)
+{
+    st->w = (st->w << 16) | (uint64_t) st->n;
+    cs_hash_word(st);
+    return (uint32_t) (st->h ^ (st->h >> 32));
+}
+
+static uint32_t
+cs_hash_buffer(int32_t j, int32_t l)
+{
+    cs_hasher st = { 0, 0, 0 };
+    int32_t k;
+
+    for (k = j; k <= j + l - 1; k++) {
+        if (buffer[k] < 65536L) {
+            cs_hash_unit(&st, buffer[k]);
+        } else {
+            cs_hash_unit(&st, 0xD800 + (buffer[k] - 65536L) / 1024);
+            cs_hash_unit(&st, 0xDC00 + (buffer[k] - 65536L) % 1024);
+        }
+    }
+
+    return cs_hash_finish(&st);
+}
+
+static uint32_t
+cs_hash_string(str_number s)
+{
+    cs_hasher st = { 0, 0, 0 };
+    pool_pointer j;
+
+    if (s < 65536L) {
+        cs_hash_unit(&st, s);
+        return cs_hash_finish(&st);
+    }
+
+    for (j = str_start[s - 65536L]; j < str_start[s + 1 - 65536L]; j++)
+        cs_hash_unit(&st, str_pool[j]);
+
+    return cs_hash_finish(&st);
+}
+
+static void
+cs_index_insert(uint32_t hv, int32_t p)
+{
+    uint32_t i;
+
+    if (2 * (cs_index_count + 1) > cs_index_mask + 1) {
+        cs_index_entry *old = cs_index;
+        uint32_t old_size = cs_index_mask + 1;
+
+        cs_index_mask = 2 * old_size - 1;
+        cs_index = xcalloc(cs_index_mask + 1, sizeof(cs_index_entry));
+
+        for (i = 0; i < old_size; i++) {
+            uint32_t m = old[i].hash & cs_index_mask;
+
+            if (old[i].p == 0)
+                continue;
+
+            while (cs_index[m].p != 0)
+                m = (m + 1) & cs_index_mask;
+
+            cs_index[m] = old[i];
+        }
+
+        free(old);
+    }
+
+    i = hv & cs_index_mask;
+    while (cs_index[i].p != 0)
+        i = (i + 1) & cs_index_mask;
+
+    cs_index[i].hash = hv;
+    cs_index[i].p = p;
+    cs_index_count++;
+}
+
+/* Enter every name in the hash chains into the index. Only id_lookup()
+ * links new names into the chains, and it keeps the index up to date, so
+ * the index only has to be rebuilt when the table is reallocated. */
+static void
+cs_index_build(void)
+{
+    int32_t b, p;
+
+    cs_index_mask = CS_INDEX_MIN_SIZE - 1;
+    cs_index_count = 0;
+    cs_index = xcalloc(CS_INDEX_MIN_SIZE, sizeof(cs_index_entry));
+
+    for (b = HASH_BASE; b < HASH_BASE + HASH_PRIME; b++) {
+        p = b;
+
+        while (true) {
+            if (hash[p].s1 > 0)
+                cs_index_insert(cs_hash_string(hash[p].s1), p);
+            if (hash[p].s0 == 0)
+                break;
+            p = hash[p].s0;
+        }
+    }
+}
+
+void
+reset_cs_index(void)
+{
+    free(cs_index);
+    cs_index = NULL;
+    cs_index_mask = 0;
+    cs_index_count = 0;
+}
+
+
 int32_t
 id_lookup(int32_t j, int32_t l)
 {
@@ -3685,16 +3916,8 @@ id_lookup(int32_t j, int32_t l)
     int32_t p;
     int32_t k;
     int32_t ll;
+    uint32_t hv, i;
 
-    h = 0;
-
-    for (k = j; k <= j + l - 1; k++) {
-        h = h + h + buffer[k];
-        while (h >= HASH_PRIME)
-            h = h - 8501;
-    }
-
-    p = h + HASH_BASE;
     ll = l;
 
     for (d = 0; d <= l - 1; d++) {
@@ -3702,68 +3925,81 @@ id_lookup(int32_t j, int32_t l)
             ll++;
     }
 
-    while (true) {
-        if (hash[p].s1 > 0) {
-            if (length(hash[p].s1) == ll) {
-                if (str_eq_buf(hash[p].s1, j))
-                    goto found;
-            }
-        }
+    if (cs_index == NULL)
+        cs_index_build();
 
-        if (hash[p].s0 == 0) {
-            if (no_new_control_sequence) {
-                p = UNDEFINED_CONTROL_SEQUENCE;
-            } else { /*269:*/
-                if (hash[p].s1 > 0) {
-                    if (hash_high < hash_extra) {
-                        hash_high++;
-                        hash[p].s0 = hash_high + EQTB_SIZE;
-                        p = hash_high + EQTB_SIZE;
-                    } else {
-                        do {
-                            if (hash_used == HASH_BASE)
-                                overflow("hash size", HASH_SIZE + hash_extra);
-                            hash_used--;
-                        } while (hash[hash_used].s1 != 0);
+    hv = cs_hash_buffer(j, l);
+    cs_lookups++;
 
-                        hash[p].s0 = hash_used;
-                        p = hash_used;
-                    }
-                }
+    for (i = hv & cs_index_mask; cs_index[i].p != 0; i = (i + 1) & cs_index_mask) {
+        p = cs_index[i].p;
+        cs_index_probes++;
 
-                if (pool_ptr + ll > pool_size)
-                    overflow("pool size", pool_size - init_pool_ptr);
+        if (cs_index[i].hash == hv && length(hash[p].s1) == ll && str_eq_buf(hash[p].s1, j))
+            return p;
+    }
 
-                d = pool_ptr - str_start[str_ptr - 65536L];
+    /* The name is not in the table. */
 
-                while (pool_ptr > str_start[str_ptr - 65536L]) {
-                    pool_ptr--;
-                    str_pool[pool_ptr + l] = str_pool[pool_ptr];
-                }
+    if (no_new_control_sequence)
+        return UNDEFINED_CONTROL_SEQUENCE;
 
-                for (k = j; k <= j + l - 1; k++) {
-                    if (buffer[k] < 65536L) {
-                        str_pool[pool_ptr] = buffer[k];
-                        pool_ptr++;
-                    } else {
-                        str_pool[pool_ptr] = 0xD800 + (buffer[k] - 65536L) / 1024;
-                        pool_ptr++;
-                        str_pool[pool_ptr] = 0xDC00 + (buffer[k] - 65536L) % 1024;
-                        pool_ptr++;
-                    }
-                }
+    h = 0;
 
-                hash[p].s1 = make_string();
-                pool_ptr += d;
-            }
-            goto found;
+    for (k = j; k <= j + l - 1; k++) {
+        h = h + h + buffer[k];
+        while (h >= HASH_PRIME)
+            h = h - 8501;
+    }
 
-        }
+    p = h + HASH_BASE;
 
+    while (hash[p].s0 != 0)
         p = hash[p].s0;
+
+    /*269:*/
+    if (hash[p].s1 > 0) {
+        if (hash_high < hash_extra) {
+            hash_high++;
+            hash[p].s0 = hash_high + EQTB_SIZE;
+            p = hash_high + EQTB_SIZE;
+        } else {
+            do {
+                if (hash_used == HASH_BASE)
+                    overflow("hash size", HASH_SIZE + hash_extra);
+                hash_used--;
+            } while (hash[hash_used].s1 != 0);
+
+            hash[p].s0 = hash_used;
+            p = hash_used;
+        }
     }
 
-found:
+    if (pool_ptr + ll > pool_size)
+        overflow("pool size", pool_size - init_pool_ptr);
+
+    d = pool_ptr - str_start[str_ptr - 65536L];
+
+    while (pool_ptr > str_start[str_ptr - 65536L]) {
+        pool_ptr--;
+        str_pool[pool_ptr + l] = str_pool[pool_ptr];
+    }
+
+    for (k = j; k <= j + l - 1; k++) {
+        if (buffer[k] < 65536L) {
+            str_pool[pool_ptr] = buffer[k];
+            pool_ptr++;
+        } else {
+            str_pool[pool_ptr] = 0xD800 + (buffer[k] - 65536L) / 1024;
+            pool_ptr++;
+            str_pool[pool_ptr] = 0xDC00 + (buffer[k] - 65536L) % 1024;
+            pool_ptr++;
+        }
+    }
+
+    hash[p].s1 = make_string();
+    pool_ptr += d;
+    cs_index_insert(hv, p);
     return p;
 }
 
@@ -4918,6 +5154,9 @@ begin_token_list(int32_t p, uint16_t t)
 
 void end_token_list(void)
 {
+    if (profile_enabled && cur_input.index == MACRO)
+        profile_leave_macro(input_ptr);
+
     if (cur_input.index >= BACKED_UP) {
         if (cur_input.index <= INSERTED)
             flush_list(cur_input.start);
@@ -5535,7 +5774,7 @@ restart:
                     if (cur_input.name >= 19) {
                         print_char(')');
                         open_parens--;
-                        ttstub_output_flush(rust_stdout);
+                        update_terminal();
                     }
 
                     force_eof = false;
@@ -5675,10 +5914,14 @@ macro_call(void)
     small_number save_scanner_status;
     int32_t save_warning_index;
     UTF16_code match_chr;
+    int32_t body_level = -1;
 
     save_scanner_status = scanner_status;
     save_warning_index = warning_index;
     warning_index = cur_cs;
+
+    if (profile_enabled)
+        profile_enter_macro(warning_index);
     ref_count = cur_chr;
     r = mem[ref_count].b32.s1;
     n = 0;
@@ -5954,6 +6197,7 @@ macro_call(void)
     begin_token_list(ref_count, MACRO);
     cur_input.name = warning_index;
     cur_input.loc = mem[r].b32.s1;
+    body_level = input_ptr;
 
     if (n > 0) {
         if (param_ptr + n > max_param_stack) {
@@ -5969,6 +6213,9 @@ macro_call(void)
     }
 
 exit:
+    if (profile_enabled)
+        profile_bind_macro(body_level);
+
     scanner_status = save_scanner_status;
     warning_index = save_warning_index;
 }
@@ -6154,6 +6401,7 @@ expand(void)
     small_number cvl_backup, radix_backup, co_backup;
     int32_t backup_backup;
     small_number save_scanner_status;
+    int32_t prof_frame = 0;
 
     expand_depth_count++;
     if (expand_depth_count >= expand_depth)
@@ -6165,6 +6413,9 @@ expand(void)
     co_backup = cur_order;
     backup_backup = mem[BACKUP_HEAD].b32.s1;
 
+    if (profile_enabled && cur_cmd < CALL)
+        prof_frame = profile_enter(cur_cs, cur_cmd);
+
 reswitch:
     if (cur_cmd < CALL) { /*384:*/
         if (INTPAR(tracing_commands) > 1)
@@ -6425,6 +6676,9 @@ reswitch:
     cur_order = co_backup;
     mem[BACKUP_HEAD].b32.s1 = backup_backup;
     expand_depth_count--;
+
+    if (prof_frame != 0)
+        profile_leave(prof_frame);
 }
 
 
@@ -9022,7 +9276,7 @@ void pseudo_start(void)
         cur_input.name = 19;
         print_cstr("( ");
         open_parens++;
-        ttstub_output_flush (rust_stdout);
+        update_terminal();
     } else {
 
         cur_input.name = 18;
@@ -10737,7 +10991,7 @@ start_input(const char *primary_input_name)
     print_char('(');
     open_parens++;
     print(full_source_filename_stack[in_open]);
-    ttstub_output_flush(rust_stdout);
+    update_terminal();
 
     cur_input.state = NEW_LINE;
 
@@ -10988,7 +11242,9 @@ internal_font_number load_native_font(int32_t u, str_number nom, str_number aire
     scaled_t ascent, descent, font_slant, x_ht, cap_ht;
     internal_font_number f;
     str_number full_name;
+    ttstub_trace_begin("find_native_font", (const char *) name_of_file + 1);
     font_engine = find_native_font(name_of_file + 1, s);
+    ttstub_trace_end();
     if (!font_engine)
         return FONT_BASE;
     if (s >= 0)
@@ -20410,7 +20666,7 @@ void issue_message(void)
         else if ((term_offset > 0) || (file_offset > 0))
             print_char(' ');
         print(s);
-        ttstub_output_flush (rust_stdout);
+        update_terminal();
     } else {                    /*1318: */
 
         {
@@ -21471,11 +21727,17 @@ void main_control(void)
         begin_token_list(LOCAL(every_job), EVERY_JOB_TEXT);
 
 big_switch: /* big_switch */
+    if (profile_enabled)
+        profile_end_dispatch();
+
     get_x_token();
 
 reswitch:
     /*1066: */
 
+    if (profile_enabled)
+        profile_dispatch(cur_cs, cur_cmd);
+
     if (INTPAR(tracing_commands) > 0)
         show_cur_cmd_chr();
     switch (abs(cur_list.mode) + cur_cmd) {
@@ -22986,14 +23248,20 @@ close_files_and_terminate(void)
 
     for (k = 0; k <= 15; k++)
         if (write_open[k])
-            ttstub_output_close (write_file[k]);
+            close_output(write_file[k]);
 
     finalize_dvi_file();
     synctex_terminate(log_opened);
 
+    if (profile_enabled)
+        write_profile();
+
+    report_engine_metrics();
+
     if (log_opened) {
+        flush_output_buffers();
         ttstub_output_putc (log_file, '\n');
-        ttstub_output_close (log_file);
+        close_output (log_file);
         selector = selector - 2;
         if (selector == SELECTOR_TERM_ONLY) {
             print_nl_cstr("Transcript written on ");
@@ -398,7 +398,11 @@ extern int32_t hi_mem_min;
 extern int32_t var_used, dyn_used;
 extern int32_t avail;
 extern int32_t mem_end;
+extern int32_t mem_max;
+extern int32_t mem_min;
 extern int32_t rover;
+extern int32_t node_free_list[NODE_SIZE_CLASSES];
+extern uint64_t node_alloc_count[NODE_SIZE_CLASSES + 1];
 extern int32_t last_leftmost_char;
 extern int32_t last_rightmost_char;
 extern int32_t hlist_stack[513];
@@ -587,6 +591,12 @@ extern int32_t *hyph_list;
 extern hyph_pointer *hyph_link;
 extern int32_t hyph_count;
 extern int32_t hyph_next;
+extern uint64_t hyph_cache_hits;
+extern uint64_t hyph_cache_misses;
+extern uint64_t linebreak_cache_hits;
+extern uint64_t linebreak_cache_misses;
+extern uint64_t cs_lookups;
+extern uint64_t cs_index_probes;
 extern trie_opcode trie_used[256];
 extern unsigned char trie_op_lang[trie_op_size + 1];
 extern trie_opcode trie_op_val[trie_op_size + 1];
@@ -676,6 +686,8 @@ extern scaled_t delta;
 extern int synctex_enabled;
 extern bool used_tectonic_coda_tokens;
 extern bool semantic_pagination_enabled;
+extern bool linebreak_cache_enabled;
+extern bool profile_enabled;
 
 /*:1683*/
 
@@ -691,6 +703,9 @@ extern int32_t _trie_op_hash_array[trie_op_size - neg_trie_op_size + 1];
 
 /* the former xetexcoerce.h: */
 
+void flush_output_buffers(void);
+void update_terminal(void);
+int close_output(rust_output_handle_t handle);
 void print_ln(void);
 void print_raw_char(UTF16_code s, bool incr_offset);
 void print_char(int32_t s);
@@ -736,6 +751,7 @@ int32_t get_avail(void);
 void flush_list(int32_t p);
 int32_t get_node(int32_t s);
 void free_node(int32_t p, int32_t s);
+void reset_node_free_lists(void);
 int32_t new_null_box(void);
 int32_t new_rule(void);
 int32_t new_ligature(internal_font_number f, uint16_t c, int32_t q);
@@ -787,6 +803,7 @@ void not_ot_font_error(int32_t cmd, int32_t c, int32_t f);
 void not_native_font_error(int32_t cmd, int32_t c, int32_t f);
 void show_eqtb(int32_t n);
 int32_t id_lookup(int32_t j, int32_t l);
+void reset_cs_index(void);
 int32_t prim_lookup(str_number s);
 void restore_trace(int32_t p, str_number s);
 void print_group(bool e);
@@ -995,6 +1012,7 @@ void trie_pack(trie_pointer p);
 void trie_fix(trie_pointer p);
 void init_trie(void);
 void line_break(bool d);
+void clear_hyphenation_cache(void);
 bool eTeX_enabled(bool b, uint16_t j, int32_t k);
 void show_save_groups(void);
 int32_t prune_page_top(int32_t p, bool s);
@@ -1089,6 +1107,7 @@ void handle_right_brace(void);
 void main_control(void);
 void give_err_help(void);
 void close_files_and_terminate(void);
+void report_engine_metrics(void);
 void debug_help(void);
 void flush_str(str_number s);
 str_number tokens_to_string(int32_t p);
@@ -1102,6 +1121,18 @@ void deinitialize_shipout_variables(void);
 void ship_out(int32_t p);
 void finalize_dvi_file(void);
 
+/* xetex-profile */
+
+void reset_profile(void);
+int32_t profile_enter(int32_t cs, int32_t cmd);
+void profile_leave(int32_t serial);
+void profile_enter_macro(int32_t cs);
+void profile_bind_macro(int32_t level);
+void profile_leave_macro(int32_t level);
+void profile_dispatch(int32_t cs, int32_t cmd);
+void profile_end_dispatch(void);
+void write_profile(void);
+
 /* Inlines */
 
 static inline bool is_char_node(const int32_t p) {
@@ -1115,6 +1146,8 @@ static inline bool is_non_discardable_node(const int32_t p) {
 
 /* Tectonic related functions */
 tt_history_t tt_run_engine(char *dump_name, char *input_file_name);
+tt_history_t tt_preload_engine(char *dump_name);
+tt_history_t tt_run_preloaded_engine(char *input_file_name);
 
 
 /* formerly xetex.h: */
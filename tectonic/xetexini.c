@@ -9,6 +9,9 @@
 #include "synctex.h"
 #include "core-bridge.h"
 #include "dpx-pdfobj.h" /* pdf_files_{init,close} */
+#include "XeTeXLayoutInterface.h" /* clearShapingCache, clearGlyphBBoxCache, resetSharedFontFaces */
+
+#include <sys/mman.h>
 
 /* All the following variables are declared in xetexd.h */
 memory_word *the_eqtb;
@@ -87,7 +90,11 @@ int32_t hi_mem_min;
 int32_t var_used, dyn_used;
 int32_t avail;
 int32_t mem_end;
+int32_t mem_max;
+int32_t mem_min;
 int32_t rover;
+int32_t node_free_list[NODE_SIZE_CLASSES];
+uint64_t node_alloc_count[NODE_SIZE_CLASSES + 1];
 int32_t last_leftmost_char;
 int32_t last_rightmost_char;
 int32_t hlist_stack[513];
@@ -366,6 +373,8 @@ scaled_t delta;
 int synctex_enabled;
 bool used_tectonic_coda_tokens;
 bool semantic_pagination_enabled;
+bool linebreak_cache_enabled;
+bool profile_enabled;
 
 uint16_t _xeq_level_array[1114731];
 int32_t _trie_op_hash_array[trie_op_size - neg_trie_op_size + 1];
@@ -466,16 +475,46 @@ do_dump (char *p, size_t item_size, size_t nitems, rust_output_handle_t out_file
 }
 
 
-/* Here is the dual of the writing routine.  */
+/* Here is the dual of the writing routine. Rather than making a trip across
+   the bridge for every item, load_fmt_file() pulls the whole format file
+   into memory with one read and we undump from that image. The hash table
+   alone used to cost two bridge calls per control sequence name. */
+
+static char *fmt_image = NULL;
+static size_t fmt_image_len = 0;
+static size_t fmt_image_pos = 0;
 
 static void
-do_undump (char *p, size_t item_size, size_t nitems, rust_input_handle_t in_file)
+fmt_image_load (rust_input_handle_t in_file)
 {
-    ssize_t r = ttstub_input_read (in_file, p, item_size * nitems);
-    if (r < 0 || (size_t) r != item_size * nitems)
+    size_t len = ttstub_input_get_size (in_file);
+
+    if (len == 0)
+        _tt_abort ("format file \"%s\" is empty or its size is unknown",
+                   name_of_file + 1);
+
+    free (fmt_image);
+    fmt_image = xmalloc (len);
+    fmt_image_len = len;
+    fmt_image_pos = 0;
+
+    ssize_t r = ttstub_input_read (in_file, fmt_image, len);
+    if (r < 0 || (size_t) r != len)
+        _tt_abort ("could not read %zu bytes of format file \"%s\"",
+                   len, name_of_file + 1);
+}
+
+static void
+do_undump (char *p, size_t item_size, size_t nitems)
+{
+    size_t n = item_size * nitems;
+
+    if (n > fmt_image_len - fmt_image_pos)
         _tt_abort("could not undump %zu %zu-byte item(s) from %s",
                   nitems, item_size, name_of_file+1);
 
+    memcpy (p, fmt_image + fmt_image_pos, n);
+    fmt_image_pos += n;
     swap_items (p, nitems, item_size);
 }
 
@@ -483,7 +522,7 @@ do_undump (char *p, size_t item_size, size_t nitems, rust_input_handle_t in_file
 #define dump_things(base, len) \
     do_dump ((char *) &(base), sizeof (base), (size_t) (len), fmt_out)
 #define undump_things(base, len) \
-    do_undump ((char *) &(base), sizeof (base), (size_t) (len), fmt_in)
+    do_undump ((char *) &(base), sizeof (base), (size_t) (len))
 
 /* Like do_undump, but check each value against LOW and HIGH.  The
    slowdown isn't significant, and this improves the chances of
@@ -806,6 +845,8 @@ new_patterns(void)
     bool first_child;
     UTF16_code c;
 
+    clear_hyphenation_cache();
+
     if (trie_not_ready) {
         if (INTPAR(language) <= 0)
             cur_lang = 0;
@@ -1172,6 +1213,8 @@ new_hyph_exceptions(void)
     str_number s;
     pool_pointer u, v;
 
+    clear_hyphenation_cache();
+
     scan_left_brace();
 
     if (INTPAR(language) <= 0)
@@ -2152,6 +2195,54 @@ done: /*1304:*/
 /*:1328*/
 
 
+/* The main memory array. INITEX keeps it at exactly MEM_TOP + 1 words so
+ * that dumped formats don't depend on how much memory the run used.
+ * Otherwise we reserve address space for EXTRA_MEM_BOT words below MEM_BOT
+ * and SUP_MAIN_MEMORY + 1 words from MEM_BOT up. load_fmt_file() hands the
+ * space below MEM_BOT to get_node() as one big free block, and get_avail()
+ * grows the one-word region past MEM_TOP on demand. Nothing ever moves, so
+ * the many cached `mem` pointers stay valid; the OS only commits the pages
+ * that actually get used. */
+
+#define MEM_MAPPING_BYTES (((size_t) EXTRA_MEM_BOT + SUP_MAIN_MEMORY + 1) * sizeof(memory_word))
+
+static memory_word *
+alloc_mem_array(void)
+{
+    void *p;
+
+    mem_min = 0;
+    mem_max = MEM_TOP;
+
+    if (in_initex_mode)
+        return xmalloc_array(memory_word, MEM_TOP + 1);
+
+    p = mmap(NULL, MEM_MAPPING_BYTES, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return xmalloc_array(memory_word, MEM_TOP + 1);
+
+    mem_min = -EXTRA_MEM_BOT;
+    mem_max = SUP_MAIN_MEMORY;
+    return (memory_word *) p + EXTRA_MEM_BOT;
+}
+
+
+static void
+free_mem_array(void)
+{
+    if (zmem == NULL)
+        return;
+
+    if (mem_max > MEM_TOP)
+        munmap(zmem + mem_min, MEM_MAPPING_BYTES);
+    else
+        free(zmem);
+
+    zmem = NULL;
+}
+
+
 /*1337:*/
 static void
 store_fmt_file(void)
@@ -2180,7 +2271,7 @@ store_fmt_file(void)
 
         history = HISTORY_FATAL_ERROR;
         close_files_and_terminate();
-        ttstub_output_flush (rust_stdout);
+        update_terminal();
         _tt_abort("\\dump inside a group");
     }
 
@@ -2626,6 +2717,9 @@ load_fmt_file(void)
     if (fmt_in == NULL)
         _tt_abort("cannot open the format file \"%s\"", (char *) name_of_file + 1);
 
+    fmt_image_load(fmt_in);
+    ttstub_input_close(fmt_in);
+
     cur_input.loc = j;
 
     if (in_initex_mode) {
@@ -2634,8 +2728,8 @@ load_fmt_file(void)
         free(str_start);
         free(yhash);
         free(the_eqtb);
-        free(zmem);
-        mem = zmem = NULL;
+        free_mem_array();
+        mem = NULL;
     }
 
     /* start reading the header */
@@ -2671,6 +2765,8 @@ load_fmt_file(void)
     for (x = HASH_BASE + 1; x <= hash_top; x++)
         hash[x] = hash[HASH_BASE];
 
+    reset_cs_index();
+
     eqtb = the_eqtb = xmalloc_array(memory_word, eqtb_top + 1);
     eqtb[UNDEFINED_CONTROL_SEQUENCE].b16.s1 = UNDEFINED_CS;
     eqtb[UNDEFINED_CONTROL_SEQUENCE].b32.s1 = TEX_NULL;
@@ -2691,7 +2787,7 @@ load_fmt_file(void)
     cur_list.head = CONTRIB_HEAD;
     cur_list.tail = CONTRIB_HEAD;
     page_tail = PAGE_HEAD;
-    mem = zmem = xmalloc_array(memory_word, MEM_TOP + 1);
+    mem = zmem = alloc_mem_array();
 
     undump_int(x);
     if (x != EQTB_SIZE)
@@ -2786,6 +2882,23 @@ load_fmt_file(void)
         avail = x;
 
     mem_end = MEM_TOP;
+    reset_node_free_lists();
+
+    if (mem_min < -2) {
+        /* Make more low memory available: link the space below MEM_BOT
+         * into the rover ring as a single free block. We don't use the
+         * bottom word. */
+        p = mem[rover + 1].b32.s0;
+        q = mem_min + 1;
+        mem[mem_min].b32.s1 = TEX_NULL;
+        mem[mem_min].b32.s0 = TEX_NULL;
+        mem[p + 1].b32.s1 = q;
+        mem[rover + 1].b32.s0 = q;
+        mem[q + 1].b32.s1 = rover;
+        mem[q + 1].b32.s0 = p;
+        mem[q].b32.s1 = MAX_HALFWORD;
+        mem[q].b32.s0 = -q;
+    }
 
     undump_things(mem[hi_mem_min], mem_end + 1 - hi_mem_min);
     undump_int(var_used);
@@ -3082,10 +3195,11 @@ load_fmt_file(void)
     if (x != FORMAT_FOOTER_MAGIC)
         goto bad_fmt;
 
-    ttstub_input_close (fmt_in);
+    fmt_image = mfree(fmt_image);
     return true;
 
 bad_fmt:
+    fmt_image = mfree(fmt_image);
     _tt_abort ("fatal format file error");
 }
 
@@ -3195,7 +3309,12 @@ init_io(void)
     stdin_ufile.skipNextLF = 0;
     stdin_ufile.encodingMode = UTF8;
     stdin_ufile.conversionData = 0;
+    stdin_ufile.buf = NULL;
+    stdin_ufile.bufPos = 0;
+    stdin_ufile.bufLen = 0;
+    stdin_ufile.atEOF = false;
     input_file[0] = &stdin_ufile;
+    input_lines_normalized = 0;
 
     buffer[first] = 0;
     last = first;
@@ -3388,6 +3507,7 @@ initialize_more_initex_variables(void)
     lo_mem_max = rover + 1000;
     mem[lo_mem_max].b32.s1 = TEX_NULL;
     mem[lo_mem_max].b32.s0 = TEX_NULL;
+    reset_node_free_lists();
 
     for (k = PRE_ADJUST_HEAD; k <= MEM_TOP; k++)
         mem[k] = mem[lo_mem_max];
@@ -4002,11 +4122,16 @@ get_strings_started(void)
 /*:1001*/
 
 
-tt_history_t
-tt_run_engine(char *dump_name, char *input_file_name)
-{
-    CACHE_THE_EQTB;
+/* Running the engine happens in two phases. The first sets up the big
+ * arrays and either initializes them from scratch (initex) or loads the
+ * format file into them. It does not depend on the primary input at all. The
+ * second phase processes the primary input. Splitting them lets the driver
+ * stop after the first phase and fork() off copies of the warm engine, each
+ * of which goes on to run the second phase on a different document. */
 
+static bool
+setup_engine(char *dump_name)
+{
     /* Miscellaneous initializations that were mostly originally done in the
      * main() driver routines. */
 
@@ -4014,6 +4139,20 @@ tt_run_engine(char *dump_name, char *input_file_name)
 
     rust_stdout = ttstub_output_open_stdout ();
 
+    clearShapingCache();
+    clearGlyphBBoxCache();
+    clear_cp_codes();
+    resetSharedFontFaces();
+    linebreak_reset();
+    clear_hyphenation_cache();
+    hyph_cache_hits = 0;
+    hyph_cache_misses = 0;
+    linebreak_cache_hits = 0;
+    linebreak_cache_misses = 0;
+    cs_lookups = 0;
+    cs_index_probes = 0;
+    reset_profile();
+
     /* TEX_format_default must get a leading space character for Pascal
      * style string magic. */
 
@@ -4073,7 +4212,7 @@ tt_run_engine(char *dump_name, char *input_file_name)
     /* First bit of initex handling: more allocations. */
 
     if (in_initex_mode) {
-        zmem = xmalloc_array(memory_word, MEM_TOP + 1);
+        zmem = alloc_mem_array();
         eqtb_top = EQTB_SIZE + hash_extra;
 
         if (hash_extra == 0)
@@ -4089,6 +4228,8 @@ tt_run_engine(char *dump_name, char *input_file_name)
         for (hash_used = HASH_BASE + 1; hash_used <= hash_top; hash_used++)
             hash[hash_used] = hash[HASH_BASE];
 
+        reset_cs_index();
+
         the_eqtb = xcalloc_array(memory_word, eqtb_top);
         str_start = xmalloc_array(pool_pointer, max_strings);
         str_pool = xmalloc_array(packed_UTF16_code, pool_size);
@@ -4130,6 +4271,10 @@ tt_run_engine(char *dump_name, char *input_file_name)
         bad = 31;
     if (2 * MAX_HALFWORD < MEM_TOP)
         bad = 41;
+    if (SUP_MAIN_MEMORY < MEM_TOP || SUP_MAIN_MEMORY > MAX_HALFWORD)
+        bad = 43;
+    if (EXTRA_MEM_BOT < 0 || -EXTRA_MEM_BOT <= MIN_HALFWORD)
+        bad = 44;
 
     if (bad > 0)
         _tt_abort ("failed internal consistency check #%d", bad);
@@ -4357,10 +4502,17 @@ tt_run_engine(char *dump_name, char *input_file_name)
 
     if (!in_initex_mode) {
         if (!load_fmt_file())
-            return history;
+            return false;
     }
 
-    eqtb = the_eqtb;
+    return true;
+}
+
+
+static tt_history_t
+run_engine(char *input_file_name)
+{
+    CACHE_THE_EQTB;
 
     if (INTPAR(end_line_char) < 0 || INTPAR(end_line_char) > BIGGEST_CHAR)
         cur_input.limit--;
@@ -4500,7 +4652,7 @@ tt_run_engine(char *dump_name, char *input_file_name)
     // Free arrays allocated in load_fmt_file
     free(yhash);
     free(eqtb);
-    free(zmem);
+    free_mem_array();
     free(str_start);
     free(str_pool);
     free(font_info);
@@ -4538,3 +4690,33 @@ tt_run_engine(char *dump_name, char *input_file_name)
     trie_trc = mfree(trie_trc);
     return history;
 }
+
+
+tt_history_t
+tt_run_engine(char *dump_name, char *input_file_name)
+{
+    if (!setup_engine(dump_name))
+        return history;
+
+    return run_engine(input_file_name);
+}
+
+
+tt_history_t
+tt_preload_engine(char *dump_name)
+{
+    if (!setup_engine(dump_name))
+        return history;
+
+    return HISTORY_SPOTLESS;
+}
+
+
+tt_history_t
+tt_run_preloaded_engine(char *input_file_name)
+{
+    /* The stdout handle opened during setup belonged to the I/O session that
+     * did the preloading; this run gets its own. */
+    rust_stdout = ttstub_output_open_stdout ();
+    return run_engine(input_file_name);
+}
@@ -148,6 +148,81 @@ fn relative_include() {
     check_file(&tempdir, "subdirectory/relative_include.pdf");
 }
 
+#[cfg(unix)]
+#[test]
+fn server_two_jobs() {
+    use std::io::BufRead;
+    use std::os::unix::net::UnixStream;
+    use std::thread;
+    use std::time::Duration;
+
+    if env::var("RUNNING_COVERAGE").is_ok() { return }
+
+    let tempdir = setup_and_copy_files(&["test space.tex",
+                                         "subdirectory/relative_include.tex",
+                                         "subdirectory/content/1.tex"]);
+
+    // The server only loads formats that a regular build has generated.
+    let output = run_tectonic(tempdir.path(), &["--format=plain.fmt", "test space.tex"]);
+    success_or_panic(output);
+
+    struct KillOnDrop(std::process::Child);
+
+    impl Drop for KillOnDrop {
+        fn drop(&mut self) {
+            let _ = self.0.kill();
+            let _ = self.0.wait();
+        }
+    }
+
+    let socket = tempdir.path().join("server.sock");
+    let mut command = prep_tectonic(tempdir.path(), &["--format=plain.fmt", "--server", socket.to_str().unwrap()]);
+    command.stdout(Stdio::null()).stderr(Stdio::null());
+    let _server = KillOnDrop(command.spawn().expect("tectonic failed to start"));
+
+    let submit = |path: &Path| -> Vec<String> {
+        let mut conn = None;
+
+        for _ in 0..600 {
+            if let Ok(c) = UnixStream::connect(&socket) {
+                conn = Some(c);
+                break;
+            }
+            thread::sleep(Duration::from_millis(100));
+        }
+
+        let mut conn = conn.expect("the server never started listening");
+        writeln!(conn, "{}", path.display()).unwrap();
+        std::io::BufReader::new(conn).lines().map(|l| l.unwrap()).collect()
+    };
+
+    // Files written come back in no particular order.
+    let expect_reply = |reply: Vec<String>, reads: &[&str], stem: &Path| {
+        let mut wrote: Vec<&str> = reply.iter().filter(|l| l.starts_with("wrote ")).map(|l| &l[..]).collect();
+        wrote.sort();
+        let want_wrote = vec![format!("wrote {}.log", stem.display()), format!("wrote {}.xdv", stem.display())];
+        assert_eq!(wrote, want_wrote);
+
+        let read: Vec<&str> = reply.iter().filter(|l| l.starts_with("read ")).map(|l| &l[5..]).collect();
+        assert_eq!(read, reads);
+
+        assert_eq!(reply.last().map(|l| &l[..]), Some("result spotless"));
+        assert_eq!(reply.len(), reads.len() + 3);
+    };
+
+    expect_reply(submit(&tempdir.path().join("test space.tex")),
+                 &[], &tempdir.path().join("test space"));
+    check_file(&tempdir, "test space.xdv");
+    check_file(&tempdir, "test space.log");
+
+    // The second job runs in a fresh copy of the preloaded engine, and must
+    // report the file that its document pulls in.
+    expect_reply(submit(&tempdir.path().join("subdirectory/relative_include.tex")),
+                 &["content/1.tex"], &tempdir.path().join("subdirectory/relative_include"));
+    check_file(&tempdir, "subdirectory/relative_include.xdv");
+    check_file(&tempdir, "subdirectory/relative_include.log");
+}
+
 #[test]
 fn stdin_content() {
     if env::var("RUNNING_COVERAGE").is_ok() { return }
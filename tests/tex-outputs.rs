@@ -5,9 +5,9 @@ extern crate flate2;
 #[macro_use] extern crate lazy_static;
 extern crate tectonic;
 
-use std::collections::HashSet;
+use std::collections::{HashMap, HashSet};
 use std::env;
-use std::ffi::OsStr;
+use std::ffi::{OsStr, OsString};
 use std::fs::File;
 use std::io::Write;
 use std::path::Path;
@@ -16,7 +16,7 @@ use std::sync::Mutex;
 use tectonic::errors::{DefinitelySame, ErrorKind, Result};
 use tectonic::engines::NoopIoEventBackend;
 use tectonic::engines::tex::TexResult;
-use tectonic::io::{FilesystemIo, FilesystemPrimaryInputIo, IoStack, MemoryIo, try_open_file};
+use tectonic::io::{FilesystemIo, FilesystemPrimaryInputIo, IoProvider, IoStack, MemoryIo, try_open_file};
 use tectonic::io::testing::SingleInputFileIo;
 use tectonic::status::NoopStatusBackend;
 use tectonic::{TexEngine, XdvipdfmxEngine};
@@ -29,38 +29,46 @@ lazy_static! {
 }
 
 
+/// Run `tests/assets/<texname>` in initex mode and return the contents of the
+/// format file that it dumps.
+fn dump_format(tests_dir: &Path, texname: &str, fmtname: &str) -> Result<Vec<u8>> {
+    let mut mem = MemoryIo::new(true);
+
+    let mut assets_dir = tests_dir.to_owned();
+    assets_dir.push("assets");
+    let mut fs_support = FilesystemIo::new(&assets_dir, false, false, HashSet::new());
+
+    assets_dir.push(texname);
+    let mut fs_primary = FilesystemPrimaryInputIo::new(&assets_dir);
+
+    {
+        let mut io = IoStack::new(vec![
+            &mut mem,
+            &mut fs_primary,
+            &mut fs_support,
+        ]);
+
+        TexEngine::new()
+            .halt_on_error_mode(true)
+            .initex_mode(true)
+            .process(&mut io, &mut NoopIoEventBackend::new(),
+                      &mut NoopStatusBackend::new(), "UNUSED.fmt", texname)?;
+    }
+
+    let data = mem.files.borrow_mut().remove(OsStr::new(fmtname)).unwrap();
+    Ok(data)
+}
+
+
 fn set_up_format_file(tests_dir: &Path) -> Result<SingleInputFileIo> {
     let mut fmt_path = tests_dir.to_owned();
     fmt_path.push("plain.fmt");
 
     if try_open_file(&fmt_path).is_not_available() {
         // Well, we need to regenerate the format file. Not too difficult.
-        let mut mem = MemoryIo::new(true);
-
-        let mut assets_dir = tests_dir.to_owned();
-        assets_dir.push("assets");
-        let mut fs_support = FilesystemIo::new(&assets_dir, false, false, HashSet::new());
-
-        assets_dir.push("plain");
-        assets_dir.set_extension("tex");
-        let mut fs_primary = FilesystemPrimaryInputIo::new(&assets_dir);
-
-        {
-            let mut io = IoStack::new(vec![
-                &mut mem,
-                &mut fs_primary,
-                &mut fs_support,
-            ]);
-
-            TexEngine::new()
-                .halt_on_error_mode(true)
-                .initex_mode(true)
-                .process(&mut io, &mut NoopIoEventBackend::new(),
-                          &mut NoopStatusBackend::new(), "UNUSED.fmt", "plain.tex")?;
-        }
-
+        let data = dump_format(tests_dir, "plain.tex", "plain.fmt")?;
         let mut fmt_file = File::create(&fmt_path)?;
-        fmt_file.write_all(mem.files.borrow().get(OsStr::new("plain.fmt")).unwrap())?;
+        fmt_file.write_all(&data)?;
     }
 
     Ok(SingleInputFileIo::new(&fmt_path))
@@ -187,17 +195,208 @@ impl TestCase {
 }
 
 
+/// Run the TeX engine on `tests/tex-outputs/<stem>.tex` with the named format,
+/// which `fmt` provides, and return the contents of the files it wrote.
+fn run_tex_to_memory(engine: &mut TexEngine, fmt: &mut IoProvider, fmtname: &str,
+                     stem: &str) -> HashMap<OsString, Vec<u8>> {
+    let mut p = test_path(&["tex-outputs", stem]);
+    p.set_extension("tex");
+    let texname = p.file_name().unwrap().to_str().unwrap().to_owned();
+    let mut tex = FilesystemPrimaryInputIo::new(&p);
+    let mut mem = MemoryIo::new(true);
+    let mut assets = FilesystemIo::new(&test_path(&["assets"]), false, false, HashSet::new());
+
+    {
+        let mut io = IoStack::new(vec![&mut mem, &mut tex, fmt, &mut assets]);
+        let res = engine.process(&mut io, &mut NoopIoEventBackend::new(),
+                                 &mut NoopStatusBackend::new(), fmtname, &texname);
+        match res {
+            Ok(TexResult::Spotless) | Ok(TexResult::Warnings) => {},
+            _ => panic!("TeX run failed: {:?}", res),
+        }
+    }
+
+    let files = mem.files.borrow().clone();
+    files
+}
+
+
+/// Typeset `stem` without the line-break cache, then twice in one process
+/// with it, and check that the cached run's .xdv and .log are byte-identical
+/// to the uncached ones. Returns the cache's (hits, misses) in the last run.
+fn check_linebreak_cache(stem: &str) -> (u64, u64) {
+    let mut fmt = set_up_format_file(&test_path(&[])).expect("couldn't write format file");
+    let plain = run_tex_to_memory(&mut TexEngine::new(), &mut fmt, "plain.fmt", stem);
+
+    let mut engine = TexEngine::new();
+    engine.linebreak_cache(true);
+    run_tex_to_memory(&mut engine, &mut fmt, "plain.fmt", stem);
+    let cached = run_tex_to_memory(&mut engine, &mut fmt, "plain.fmt", stem);
+
+    for ext in &["xdv", "log"] {
+        let name = OsString::from(format!("{}.{}", stem, ext));
+        assert!(plain[&name] == cached[&name], "{:?} differs with the line-break cache", name);
+    }
+
+    engine.linebreak_cache_stats()
+}
+
+
 // Keep these alphabetized.
 
+#[test]
+fn csname_lookup() {
+    let _guard = LOCK.lock().unwrap(); // until we're thread-safe ...
+
+    // The document checks its control sequences itself; see also
+    // `format_round_trip`.
+    let mut fmt = set_up_format_file(&test_path(&[])).expect("couldn't write format file");
+    let mut engine = TexEngine::new();
+    run_tex_to_memory(&mut engine, &mut fmt, "plain.fmt", "csname_lookup");
+
+    // With the index at most half full, a lookup should rarely look at more
+    // than a slot or two.
+    let (lookups, probes) = engine.cs_lookup_stats();
+    assert!(lookups > 0 && probes < 2 * lookups, "{} lookups took {} probes", lookups, probes);
+}
+
+#[test]
+fn format_round_trip() {
+    let _guard = LOCK.lock().unwrap(); // until we're thread-safe ...
+
+    // Control sequences defined before a \dump must be found by the same
+    // lookups after the format is loaded again, and must typeset the same as
+    // when they are defined at run time.
+    let mut plain_fmt = set_up_format_file(&test_path(&[])).expect("couldn't write format file");
+    let direct = run_tex_to_memory(&mut TexEngine::new(), &mut plain_fmt, "plain.fmt", "csname_lookup");
+
+    let data = dump_format(&test_path(&[]), "csnames.tex", "csnames.fmt").expect("couldn't dump format");
+    let mut csnames_fmt = MemoryIo::new(false);
+    csnames_fmt.create_entry(OsStr::new("csnames.fmt"), data);
+    let loaded = run_tex_to_memory(&mut TexEngine::new(), &mut csnames_fmt, "csnames.fmt", "csname_lookup");
+
+    let name = OsString::from("csname_lookup.xdv");
+    assert!(direct[&name] == loaded[&name], "output differs when loaded from a format");
+}
+
+#[test]
+fn glyph_tables() {
+    let _guard = LOCK.lock().unwrap(); // until we're thread-safe ...
+
+    // The documents check what they read back themselves. The tables are
+    // keyed by font number, so they must start out empty in the next run.
+    let mut fmt = set_up_format_file(&test_path(&[])).expect("couldn't write format file");
+    let mut engine = TexEngine::new();
+    run_tex_to_memory(&mut engine, &mut fmt, "plain.fmt", "glyph_tables");
+    run_tex_to_memory(&mut engine, &mut fmt, "plain.fmt", "glyph_tables_fresh");
+}
+
+#[test]
+fn hyphenation_cache() {
+    let _guard = LOCK.lock().unwrap(); // until we're thread-safe ...
+
+    // The document counts its own hyphens.
+    let mut fmt = set_up_format_file(&test_path(&[])).expect("couldn't write format file");
+    let mut engine = TexEngine::new();
+    run_tex_to_memory(&mut engine, &mut fmt, "plain.fmt", "hyphenation_cache");
+
+    let (hits, misses) = engine.hyphenation_cache_stats();
+    assert!(hits > 0 && misses > 0, "hyphenation cache hits {}, misses {}", hits, misses);
+}
+
+#[test]
+fn linebreak_cache() {
+    let _guard = LOCK.lock().unwrap(); // until we're thread-safe ...
+
+    // The cache outlives a run, so all four paragraphs of the second cached
+    // run take their breaks from the first.
+    assert_eq!(check_linebreak_cache("linebreak_cache"), (4, 0));
+}
+
+#[test]
+fn linebreak_cache_tracing() {
+    let _guard = LOCK.lock().unwrap(); // until we're thread-safe ...
+
+    assert_eq!(check_linebreak_cache("linebreak_cache_tracing"), (0, 0));
+}
+
+#[test]
+fn linebreak_locales() {
+    let _guard = LOCK.lock().unwrap(); // until we're thread-safe ...
+
+    // The document counts its own breaks. Line-break iterators are cached
+    // across runs, so a second run must log exactly what the first one did.
+    let mut fmt = set_up_format_file(&test_path(&[])).expect("couldn't write format file");
+    let mut engine = TexEngine::new();
+    let first = run_tex_to_memory(&mut engine, &mut fmt, "plain.fmt", "linebreak_locales");
+    let second = run_tex_to_memory(&mut engine, &mut fmt, "plain.fmt", "linebreak_locales");
+
+    let name = OsString::from("linebreak_locales.log");
+    assert!(first[&name] == second[&name], "log differs with cached iterators");
+}
+
+#[test]
+fn math_data() {
+    let _guard = LOCK.lock().unwrap(); // until we're thread-safe ...
+
+    // The document compares its formulas across sizes itself. Font faces,
+    // and the MATH data decoded from them, outlive a run, so a second run
+    // must come out exactly the same as the first.
+    let mut fmt = set_up_format_file(&test_path(&[])).expect("couldn't write format file");
+    let mut engine = TexEngine::new();
+    let first = run_tex_to_memory(&mut engine, &mut fmt, "plain.fmt", "math_data");
+    let second = run_tex_to_memory(&mut engine, &mut fmt, "plain.fmt", "math_data");
+
+    let name = OsString::from("math_data.xdv");
+    assert!(first[&name] == second[&name], "output differs with cached MATH data");
+}
+
 #[test]
 fn md5_of_hello() { TestCase::new("md5_of_hello").check_pdf(true).go() }
 
 #[test]
 fn negative_roman_numeral() { TestCase::new("negative_roman_numeral").go() }
 
+#[test]
+fn node_free_lists() {
+    let _guard = LOCK.lock().unwrap(); // until we're thread-safe ...
+
+    // Outside of INITEX, small nodes are recycled through per-size free
+    // lists; INITEX takes every node from the rover. The same document must
+    // come out the same either way.
+    let mut fmt = set_up_format_file(&test_path(&[])).expect("couldn't write format file");
+    let mut engine = TexEngine::new();
+    let recycled = run_tex_to_memory(&mut engine, &mut fmt, "plain.fmt", "node_free_lists");
+
+    let counts = engine.node_allocation_counts();
+    assert!(counts[2] > 0 && counts[4] > 0 && counts[8] > 0,
+            "no small nodes allocated: {:?}", counts);
+
+    let mut initex = TexEngine::new();
+    initex.initex_mode(true);
+    let rover = run_tex_to_memory(&mut initex, &mut MemoryIo::new(false), "UNUSED.fmt",
+                                  "node_free_lists_initex");
+
+    assert!(recycled[OsStr::new("node_free_lists.xdv")] == rover[OsStr::new("node_free_lists_initex.xdv")],
+            "output differs when nodes come from the free lists");
+}
+
 #[test]
 fn pdfoutput() { TestCase::new("pdfoutput").go() }
 
+#[test]
+fn shaping_cache() {
+    let _guard = LOCK.lock().unwrap(); // until we're thread-safe ...
+
+    // The document compares the widths it gets itself.
+    let mut fmt = set_up_format_file(&test_path(&[])).expect("couldn't write format file");
+    let mut engine = TexEngine::new();
+    run_tex_to_memory(&mut engine, &mut fmt, "plain.fmt", "shaping_cache");
+
+    let (hits, misses) = engine.shaping_cache_stats();
+    assert!(hits > 0 && misses > 0, "shaping cache hits {}, misses {}", hits, misses);
+}
+
 #[test]
 fn synctex() { TestCase::new("synctex").check_synctex(true).go() }
 
@@ -220,3 +419,12 @@ fn tectoniccodatokens_ok() { TestCase::new("tectoniccodatokens_ok").go() }
 
 #[test]
 fn the_letter_a() { TestCase::new("the_letter_a").check_pdf(true).go() }
+
+#[test]
+fn utf8_input() {
+    let _guard = LOCK.lock().unwrap(); // until we're thread-safe ...
+
+    // The document checks the character codes of the lines it reads itself.
+    let mut fmt = set_up_format_file(&test_path(&[])).expect("couldn't write format file");
+    run_tex_to_memory(&mut TexEngine::new(), &mut fmt, "plain.fmt", "utf8_input");
+}